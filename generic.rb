@@ -7,6 +7,9 @@
 # redistribute it freely.
 #
 
+# KERN_BENCHMARK=1 ruby build-i686.rb: Run the boot-time benchmarks.
+Compiler.cdef "KERN_BENCHMARK=1" if ENV["KERN_BENCHMARK"]
+
 MKList.add "kernel", Makefile.glob("system/kern/*.c")
 MKList.add "kernel", Makefile.glob("system/physmem/*.c")
 MKList.add "kernel", Makefile.glob("system/vm/*.c")
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <x86/acpi.h>
+#include <x86/mp.h>
+#include <x86/x86.h>
+
+void _i686_get_mp(paddr_t *addrs);
+u_intptr_t __i686_mp_map_range(paddr_t pa,int n);
+void __i686_mp_unmap_range(u_intptr_t va,int n);
+
+/* Physical address of the RSDT (or XSDT), 0 if not searched yet, 1 if not found. */
+static paddr_t   g_sdt = 0;
+static int       g_sdt_wide; /* The XSDT has 64 bit entries. */
+
+static u_int8_t sum(const u_int8_t *addr, u_int32_t len)
+{
+	u_int32_t i;
+	u_int8_t sum;
+	sum = 0;
+	for(i=0; i<len; i++)
+		sum += addr[i];
+	return sum;
+}
+
+static int compare(const u_int8_t* a, const char* b, int n){
+	int i;
+	for(i=0;i<n;++i)
+		if(a[i] != (u_int8_t)b[i]) return 0;
+	return 1;
+}
+
+/*
+ * Look for the RSDP in the len bytes at pa. It is aligned to 16 bytes.
+ */
+static int rsdpsearch1(paddr_t pa, int len)
+{
+	struct acpi_rsdp* rsdp;
+	u_intptr_t ptr = __i686_mp_map_range(pa,len);
+	u_intptr_t p;
+	if(!ptr) return 0;
+	
+	for(p = ptr; p+sizeof(struct acpi_rsdp) <= ptr+len; p += 16){
+		rsdp = (struct acpi_rsdp*)p;
+		if(!compare(rsdp->signature,"RSD PTR ",8)) continue;
+		if(sum((const u_int8_t*)rsdp,20)) continue;
+		if( (rsdp->revision >= 2) && !(rsdp->xsdt>>32) && rsdp->xsdt ){
+			g_sdt = (paddr_t)rsdp->xsdt;
+			g_sdt_wide = 1;
+		}else{
+			g_sdt = rsdp->rsdt;
+			g_sdt_wide = 0;
+		}
+		break;
+	}
+	__i686_mp_unmap_range(ptr,len);
+	return g_sdt>1;
+}
+
+/*
+ * Search for the RSDP, which according to the spec is in one of the following
+ * two locations:
+ * 1) in the first KB of the EBDA;
+ * 2) in the BIOS ROM between 0xE0000 and 0xFFFFF.
+ */
+static void rsdpsearch(void)
+{
+	paddr_t addr[2];
+	_i686_get_mp(addr);
+	if(addr[0] && rsdpsearch1(addr[0], 1024)) return;
+	if(rsdpsearch1(0xE0000, 0x20000)) return;
+	g_sdt = 1;
+}
+
+/*
+ * Maps a table, and verifies it's checksum.
+ */
+static struct acpi_sdt* map_table(paddr_t pa, u_int32_t *len){
+	struct acpi_sdt* table;
+	u_int32_t length;
+	
+	table = (struct acpi_sdt*)__i686_mp_map_range(pa,sizeof(struct acpi_sdt));
+	if(!table) return 0;
+	length = table->length;
+	__i686_mp_unmap_range((u_intptr_t)table,sizeof(struct acpi_sdt));
+	if( (length < sizeof(struct acpi_sdt)) || (length > 0x100000) ) return 0;
+	
+	table = (struct acpi_sdt*)__i686_mp_map_range(pa,(int)length);
+	if(!table) return 0;
+	if(sum((const u_int8_t*)table,length)){
+		__i686_mp_unmap_range((u_intptr_t)table,(int)length);
+		return 0;
+	}
+	*len = length;
+	return table;
+}
+
+struct acpi_sdt* _i686_acpi_find(const char* sig, u_int32_t *len){
+	struct acpi_sdt *sdt,*table;
+	u_int32_t sdtlen,i,n;
+	u_int64_t pa;
+	const u_int8_t* entries;
+	
+	if(!g_sdt) rsdpsearch();
+	if(g_sdt<=1) return 0;
+	
+	sdt = map_table(g_sdt,&sdtlen);
+	if(!sdt) return 0;
+	
+	entries = (const u_int8_t*)(sdt+1);
+	n = (sdtlen - sizeof(struct acpi_sdt)) / (g_sdt_wide ? 8 : 4);
+	table = 0;
+	for(i=0;i<n;++i){
+		if(g_sdt_wide){
+			pa = *((const u_int64_t*)(entries+(i*8)));
+			if(pa>>32) continue;
+		}else
+			pa = *((const u_int32_t*)(entries+(i*4)));
+		table = map_table((paddr_t)pa,len);
+		if(!table) continue;
+		if(compare(table->signature,sig,4)) break;
+		_i686_acpi_unmap(table,*len);
+		table = 0;
+	}
+	__i686_mp_unmap_range((u_intptr_t)sdt,(int)sdtlen);
+	return table;
+}
+
+void _i686_acpi_unmap(struct acpi_sdt* table, u_int32_t len){
+	__i686_mp_unmap_range((u_intptr_t)table,(int)len);
+}
+
+int _i686_acpi_madt(){
+	struct acpi_madt*          madt;
+	struct acpi_madt_lapic*    lapic;
+	struct acpi_madt_ioapic*   ioapic;
+	struct acpi_madt_iso*      iso;
+	struct acpi_madt_lapicaddr* lapicaddr;
+	struct acpi_madt_x2apic*   x2apic;
+	u_int8_t *p,*e;
+	u_int32_t len,a,b,c,d,bootid;
+	
+	madt = (struct acpi_madt*)_i686_acpi_find("APIC",&len);
+	if(!madt) return 0;
+	
+	/*
+	 * The MADT has no boot flag. The boot CPU's local APIC id is in CPUID.1:EBX[31:24].
+	 */
+	cpuid(1,&a,&b,&c,&d);
+	bootid = b>>24;
+	
+	__i686_local_apic = (volatile u_int32_t*)(madt->lapicaddr);
+	
+	e = ((u_int8_t*)madt)+len;
+	for(p = (u_int8_t*)(madt+1);p+2<=e && p[1];p+=p[1]){
+		if(p+p[1] > e) break;
+		switch(p[0]){
+		case MADT_LAPIC:
+			lapic = (struct acpi_madt_lapic*)p;
+			if(!(lapic->flags & MADT_ENABLED)) break;
+			__i686_mp_addcpu(lapic->apicid,lapic->apicid==bootid);
+			break;
+		case MADT_X2APIC:
+			/* Only x2APIC ids, that fit into an xAPIC id, are usable. */
+			x2apic = (struct acpi_madt_x2apic*)p;
+			if(!(x2apic->flags & MADT_ENABLED)) break;
+			if(x2apic->x2apicid >= 255) break;
+			__i686_mp_addcpu((u_int8_t)x2apic->x2apicid,x2apic->x2apicid==bootid);
+			break;
+		case MADT_IOAPIC:
+			ioapic = (struct acpi_madt_ioapic*)p;
+			__i686_mp_addioapic(ioapic->ioapicid,ioapic->addr,ioapic->gsibase);
+			break;
+		case MADT_ISO:
+			iso = (struct acpi_madt_iso*)p;
+			if( (iso->bus == 0) && (iso->source < 16) ){
+				__i686_irq_gsi[iso->source]   = iso->gsi;
+				__i686_irq_flags[iso->source] = iso->flags;
+			}
+			break;
+		case MADT_LAPICADDR:
+			lapicaddr = (struct acpi_madt_lapicaddr*)p;
+			if(!(lapicaddr->addr>>32))
+				__i686_local_apic = (volatile u_int32_t*)(u_intptr_t)(lapicaddr->addr);
+			break;
+		}
+	}
+	
+	_i686_acpi_unmap(&(madt->header),len);
+	return 1;
+}
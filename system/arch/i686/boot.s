@@ -26,6 +26,7 @@
 .set FLAGS,    ALIGN | MEMINFO  # this is the Multiboot 'flag' field
 .set MAGIC,    0x1BADB002       # 'magic number' lets bootloader find the header
 .set CHECKSUM, -(MAGIC + FLAGS) # checksum of above, to prove we are multiboot
+.set MMAP_SIZE, 4096             # space for the copy of the memory map
 
 # Declare a multiboot header that marks the program as a kernel.
 .section .multiboot
@@ -68,6 +69,8 @@ _i686_multiboot_memdata:
 	.skip 4
 	.skip 8
 	.skip 8
+_i686_multiboot_mmap:
+	.skip MMAP_SIZE
 
 # Further page tables may be required if the kernel grows beyond 3 MiB.
 
@@ -128,6 +131,24 @@ _start:
 	movl $(_i686_multiboot_memdata + 16 - 0xC0000000), %esi
 	movl %edi, (%esi)
 	
+	# The memory map is not mapped, once paging is enabled. If flags[6] is set,
+	# copy up to MMAP_SIZE bytes of it to _i686_multiboot_mmap, and store the
+	# copied length at *(_i686_multiboot_memdata+12).
+	movl (%ebx), %edx
+	testl $0x40, %edx
+	jz 5f
+	movl 44(%ebx), %ecx
+	cmpl $MMAP_SIZE, %ecx
+	jbe 6f
+	movl $MMAP_SIZE, %ecx
+6:
+	movl %ecx, (_i686_multiboot_memdata + 12 - 0xC0000000)
+	movl 48(%ebx), %esi
+	movl $(_i686_multiboot_mmap - 0xC0000000), %edi
+	cld
+	rep movsb
+5:
+	
 	
 	# movl %ebx, %edi
 	# add $44,$edi
@@ -15,6 +15,7 @@ MKList.add "archdep", [
 	"system/arch/i686/crtn.s",
 	"system/arch/i686/interrupt.s",
 	"system/arch/i686/intvec.s",
+	"system/arch/i686/mpentry.s",
 	"system/arch/i686/switch.s"
 ]
 
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <sysarch/hal.h>
+#include <sys/clocksource.h>
+#include <x86/acpi.h>
+#include <x86/x86.h>
+
+/*
+ * The TSC is the clocksource. It is calibrated against the PIT, and against the
+ * HPET, if there is one. The HPET, being the more precise reference, is preferred.
+ */
+static struct clocksource tsc_clocksource = { "tsc", 0, 0 };
+
+/* The PIT calibration runs for a power of two microseconds (see __i686_microdelay). */
+#define PIT_CAL_SHIFT 13
+
+/* HPET registers (32 bit words). */
+#define HPET_PERIOD   (0x004/4)  /* Counter period in femtoseconds. */
+#define HPET_CONF     (0x010/4)  /* General configuration. */
+#define   HPET_ENABLE 0x00000001
+#define HPET_COUNTER  (0x0F0/4)  /* Main counter, low 32 bits. */
+
+/* Accepted counter periods: 1 ns (1 GHz) up to 100 ns, the longest one allowed. */
+#define HPET_MIN_PERIOD 1000000
+#define HPET_MAX_PERIOD 100000000
+
+void __i686_microdelay(u_int32_t us);
+int __i686_map_mmio(paddr_t pa);
+
+static u_int32_t calibrate_pit(){
+	u_int64_t t = rdtsc();
+	__i686_microdelay(1<<PIT_CAL_SHIFT);
+	t = rdtsc()-t;
+	
+	/* kHz = cycles * 1000 / 8192 = cycles * 125 / 1024 */
+	return (u_int32_t)((t*125) >> (PIT_CAL_SHIFT-3));
+}
+
+/*
+ * Maps the registers of the first HPET. Returns 0 if there is none.
+ */
+static volatile u_int32_t* hpet_map(){
+	struct acpi_hpet* table;
+	u_int32_t len;
+	u_int64_t pa;
+	
+	table = (struct acpi_hpet*)_i686_acpi_find("HPET",&len);
+	if(!table) return 0;
+	pa = table->addr;
+	if(table->addrspace) pa = 0;
+	_i686_acpi_unmap(&(table->header),len);
+	
+	if( (!pa) || (pa>>32) ) return 0;
+	if(!__i686_map_mmio((paddr_t)pa)) return 0;
+	return (volatile u_int32_t*)(u_intptr_t)pa;
+}
+
+static u_int32_t calibrate_hpet(){
+	volatile u_int32_t* hpet;
+	u_int32_t period,hpet_khz,shift,start,now,over;
+	u_int64_t t;
+	
+	hpet = hpet_map();
+	if(!hpet) return 0;
+	period = hpet[HPET_PERIOD];
+	if( (period < HPET_MIN_PERIOD) || (period > HPET_MAX_PERIOD) ) return 0;
+	
+	/* The counter runs, as long as the HPET is enabled. It stays enabled. */
+	hpet[HPET_CONF] |= HPET_ENABLE;
+	
+	/* Ticks per millisecond, from the period in picoseconds. */
+	hpet_khz = 1000000000 / (period/1000);
+	
+	/* Wait for a power of two ticks, at least 8 ms. */
+	for(shift=0; ((1U<<shift)/8) < hpet_khz; ++shift);
+	
+	/* Start at the beginning of a tick. */
+	start = hpet[HPET_COUNTER];
+	while((now = hpet[HPET_COUNTER]) == start);
+	start = now;
+	t = rdtsc();
+	while(((now = hpet[HPET_COUNTER]) - start) < (1U<<shift));
+	t = rdtsc()-t;
+	
+	/* Correct for the ticks, the loop overshot. */
+	over = (now - start) - (1U<<shift);
+	t -= (t >> shift) * over;
+	
+	/* kHz = cycles * hpet_khz / ticks */
+	return (u_int32_t)((t*hpet_khz) >> shift);
+}
+
+struct clocksource* hal_clocksource_init(){
+	u_int32_t pit_khz,hpet_khz;
+	
+	pit_khz  = calibrate_pit();
+	hpet_khz = calibrate_hpet();
+	
+	if(hpet_khz){
+		tsc_clocksource.cs_reference = "hpet";
+		tsc_clocksource.cs_khz = hpet_khz;
+	}else{
+		tsc_clocksource.cs_reference = "pit";
+		tsc_clocksource.cs_khz = pit_khz;
+	}
+	return &tsc_clocksource;
+}
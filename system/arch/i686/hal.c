@@ -23,6 +23,7 @@
  */
 #include <sysarch/hal.h>
 #include <sys/cpu.h>
+#include <sys/thread.h>
 #include <x86/cpu_arch.h>
 #include <x86/trapframe.h>
 #include <x86/x86.h>
@@ -48,6 +49,10 @@ void __i686_initthread(u_intptr_t sp, u_intptr_t func, u_intptr_t arg,u_intptr_t
 
 void __i686_lapiceoi();
 void __i686_piceoi(int irq);
+void __i686_lapicipi(u_int8_t apicid, int self, int vector);
+
+/* tlb.c */
+void __i686_tlb_ipi();
 
 struct cpu *kernel_get_current_cpu() {
 	return cpu_ptr;
@@ -85,6 +90,8 @@ void hal_after_thread_switch(){
 	 * forbids I/O instructions (e.g., inb and outb) from user space
 	 */
 	cpu_arch->tss.iomb = (u_int16_t) 0xFFFF;
+	/* ltr faults on a busy TSS, so mark it available again. */
+	cpu_arch->gdt[SEG_TSS].type = STS_T32A;
 	ltr(SEG_TSS << 3);
 }
 
@@ -106,6 +113,13 @@ void __i686_setup_idt(){
 	lidt((u_intptr_t)(void*)idt, sizeof(idt));
 }
 
+/*
+ * Loads the IDT, which has been set up by __i686_setup_idt(), on another CPU.
+ */
+void __i686_load_idt(){
+	lidt((u_intptr_t)(void*)idt, sizeof(idt));
+}
+
 void __i686_interrupt(struct trapframe* tf){
 	//(void)tf;
 	switch(tf->trapno){
@@ -114,19 +128,35 @@ void __i686_interrupt(struct trapframe* tf){
 	case T_IRQ0+IRQ_COM1:
 	case T_IRQ0+IRQ_IDE:
 	case T_IRQ0+7:
+	case T_IRQ0+IRQ_RESCHED:
+	case T_IRQ0+IRQ_TLB:
 	case T_IRQ0+IRQ_SPURIOUS:
 		__i686_lapiceoi();
 		break;
 	}
-	__i686_piceoi(tf->trapno);
+	/* Only the boot CPU receives interrupts from the PIC. */
+	if(!cpu_ptr->cpu_cpu_id)
+		__i686_piceoi(tf->trapno);
 	
 	switch(tf->trapno){
 	case T_IRQ0+IRQ_TIMER:
+	case T_IRQ0+IRQ_RESCHED:
 		__i686_switch();
 		break;
+	case T_IRQ0+IRQ_TLB:
+		__i686_tlb_ipi();
+		break;
 	}
 }
 
+void hal_thread_setup(struct thread* thread, u_intptr_t sp, void (*func)(void*), void* arg){
+	u_int32_t eflags = readeflags();
+	/* __i686_initthread() temporarily runs on the new stack. Don't get preempted there. */
+	cli();
+	__i686_initthread(sp,(u_intptr_t)func,(u_intptr_t)arg,&(thread->THREAD_LOCAL_CONTEXT));
+	if(eflags & FL_IF) sti();
+}
+
 void hal_induce_preemption(){
 	cli();
 	__i686_switch();
@@ -137,3 +167,13 @@ void hal_boot_start_int(){
 	sti();
 }
 
+void hal_cpu_kick(struct cpu* cpu){
+	struct cpu_arch *cpu_arch = cpu->cpu_arch;
+	if( (!cpu_arch) || (!cpu_arch->lapic) ) return;
+	__i686_lapicipi(cpu_arch->apicid, cpu == cpu_ptr, T_IRQ0+IRQ_RESCHED);
+}
+
+u_int64_t hal_cycles(){
+	return rdtsc();
+}
+
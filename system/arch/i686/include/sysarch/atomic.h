@@ -0,0 +1,42 @@
+/*
+ * 
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+
+#include <machine/types.h>
+
+/*
+ * Atomically replaces the 64-bit word '*ptr' with 'desired', if it equals '*expected'.
+ * Returns non-zero on success. On failure, '*expected' is updated to the current value.
+ *
+ * On i686, this is 'cmpxchg8b', available since the Pentium.
+ */
+inline static int arch_cas64(volatile u_int64_t* ptr, u_int64_t* expected, u_int64_t desired){
+	u_int64_t prev;
+	u_int8_t ok;
+	asm volatile("lock; cmpxchg8b %1; sete %0"
+		: "=q"(ok), "+m"(*ptr), "=A"(prev)
+		: "2"(*expected), "b"((u_int32_t)desired), "c"((u_int32_t)(desired>>32))
+		: "memory", "cc");
+	*expected = prev;
+	return ok;
+}
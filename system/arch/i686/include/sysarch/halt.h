@@ -27,3 +27,8 @@ inline static void arch_halt() {
 	for(;;) asm volatile("hlt");
 }
 
+/* Waits for the next interrupt. */
+inline static void arch_wait() {
+	asm volatile("hlt");
+}
+
@@ -0,0 +1,194 @@
+/*
+ * 
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+#include <sysarch/paddr.h>
+#include <machine/types.h>
+
+// See Advanced Configuration and Power Interface Specification, Chapter 5.2
+
+struct acpi_rsdp {      // root system description pointer
+  u_int8_t signature[8];           // "RSD PTR "
+  u_int8_t checksum;               // first 20 bytes must add up to 0
+  u_int8_t oemid[6];
+  u_int8_t revision;               // 0 (ACPI 1.0) or 2
+  u_int32_t rsdt;                  // phys addr of the RSDT
+  u_int32_t length;                // (revision >= 2)
+  u_int64_t xsdt;                  // phys addr of the XSDT (revision >= 2)
+  u_int8_t xchecksum;              // (revision >= 2)
+  u_int8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_sdt {       // system description table header
+  u_int8_t signature[4];
+  u_int32_t length;                // total table length, including the header
+  u_int8_t revision;
+  u_int8_t checksum;               // all bytes must add up to 0
+  u_int8_t oemid[6];
+  u_int8_t oemtable[8];
+  u_int32_t oemrevision;
+  u_int32_t creator;
+  u_int32_t creatorrevision;
+} __attribute__((packed));
+
+struct acpi_srat {      // system resource affinity table
+  struct acpi_sdt header;          // "SRAT"
+  u_int32_t reserved1;             // 1
+  u_int64_t reserved2;
+} __attribute__((packed));
+
+struct acpi_srat_cpu {  // processor local APIC affinity (0)
+  u_int8_t type;
+  u_int8_t length;                 // 16
+  u_int8_t domain_lo;              // proximity domain, bits 0-7
+  u_int8_t apicid;                 // local APIC id
+  u_int32_t flags;
+  u_int8_t sapiceid;
+  u_int8_t domain_hi[3];           // proximity domain, bits 8-31
+  u_int32_t clockdomain;
+} __attribute__((packed));
+
+struct acpi_srat_mem {  // memory affinity (1)
+  u_int8_t type;
+  u_int8_t length;                 // 40
+  u_int32_t domain;                // proximity domain
+  u_int16_t reserved1;
+  u_int64_t base;
+  u_int64_t size;
+  u_int32_t reserved2;
+  u_int32_t flags;
+  u_int64_t reserved3;
+} __attribute__((packed));
+
+struct acpi_srat_x2apic { // processor local x2APIC affinity (2)
+  u_int8_t type;
+  u_int8_t length;                 // 24
+  u_int16_t reserved1;
+  u_int32_t domain;                // proximity domain
+  u_int32_t x2apicid;
+  u_int32_t flags;
+  u_int32_t clockdomain;
+  u_int32_t reserved2;
+} __attribute__((packed));
+
+// SRAT entry types
+#define SRAT_CPU      0x00
+#define SRAT_MEM      0x01
+#define SRAT_X2APIC   0x02
+
+// SRAT flags
+#define SRAT_ENABLED  0x01
+
+struct acpi_slit {      // system locality distance information table
+  struct acpi_sdt header;          // "SLIT"
+  u_int64_t localities;            // number of localities (n)
+  u_int8_t entry[];                // n*n distances, row by row
+} __attribute__((packed));
+
+struct acpi_madt {      // multiple APIC description table
+  struct acpi_sdt header;          // "APIC"
+  u_int32_t lapicaddr;             // phys addr of the local APIC
+  u_int32_t flags;
+    #define MADT_PCAT_COMPAT 0x01 // Dual 8259 PICs installed.
+} __attribute__((packed));
+
+struct acpi_madt_lapic { // processor local APIC (0)
+  u_int8_t type;
+  u_int8_t length;                 // 8
+  u_int8_t procid;                 // ACPI processor UID
+  u_int8_t apicid;                 // local APIC id
+  u_int32_t flags;
+} __attribute__((packed));
+
+struct acpi_madt_ioapic { // I/O APIC (1)
+  u_int8_t type;
+  u_int8_t length;                 // 12
+  u_int8_t ioapicid;
+  u_int8_t reserved;
+  u_int32_t addr;                  // phys addr of the I/O APIC
+  u_int32_t gsibase;               // first global system interrupt
+} __attribute__((packed));
+
+struct acpi_madt_iso {  // interrupt source override (2)
+  u_int8_t type;
+  u_int8_t length;                 // 10
+  u_int8_t bus;                    // 0 (ISA)
+  u_int8_t source;                 // ISA IRQ
+  u_int32_t gsi;                   // global system interrupt
+  u_int16_t flags;                 // polarity and trigger mode (MPS INTI flags)
+} __attribute__((packed));
+
+struct acpi_madt_lapicaddr { // local APIC address override (5)
+  u_int8_t type;
+  u_int8_t length;                 // 12
+  u_int16_t reserved;
+  u_int64_t addr;
+} __attribute__((packed));
+
+struct acpi_madt_x2apic { // processor local x2APIC (9)
+  u_int8_t type;
+  u_int8_t length;                 // 16
+  u_int16_t reserved;
+  u_int32_t x2apicid;
+  u_int32_t flags;
+  u_int32_t procuid;
+} __attribute__((packed));
+
+// MADT entry types
+#define MADT_LAPIC     0x00
+#define MADT_IOAPIC    0x01
+#define MADT_ISO       0x02
+#define MADT_LAPICADDR 0x05
+#define MADT_X2APIC    0x09
+
+// MADT local APIC flags
+#define MADT_ENABLED   0x01
+
+struct acpi_hpet {      // high precision event timer table
+  struct acpi_sdt header;          // "HPET"
+  u_int32_t blockid;               // event timer block id
+  u_int8_t addrspace;              // 0 (system memory)
+  u_int8_t bitwidth;
+  u_int8_t bitoffset;
+  u_int8_t reserved;
+  u_int64_t addr;                  // phys addr of the registers
+  u_int8_t number;                 // HPET sequence number
+  u_int16_t mintick;               // minimum periodic clock tick
+  u_int8_t protection;             // page protection
+} __attribute__((packed));
+
+/*
+ * Enumerates the CPUs, I/O APICs and interrupt source overrides from the MADT into
+ * the variables declared in <x86/mp.h>. Returns 0 if there is no MADT.
+ */
+int _i686_acpi_madt();
+
+/*
+ * Finds an ACPI table by it's signature, maps it, and verifies it's checksum.
+ * Returns 0 if there is no such table. The length of the table is stored in 'len'.
+ */
+struct acpi_sdt* _i686_acpi_find(const char* sig, u_int32_t *len);
+
+/*
+ * Unmaps a table, returned by _i686_acpi_find().
+ */
+void _i686_acpi_unmap(struct acpi_sdt* table, u_int32_t len);
@@ -22,9 +22,15 @@
  */
 #pragma once
 #include <x86/gdt.h>
+#include <sys/clockevent.h>
 
 struct cpu_arch{
 	struct segdesc   gdt[NSEGS];
 	struct taskstate tss;
+	
+	u_int32_t          lapic;     /* Non-zero, if the local APIC is enabled and 'apicid' is valid. */
+	u_int32_t          apicid;    /* Local APIC ID. */
+	struct clock_event lapic_ce;  /* The local APIC timer. */
+	u_int32_t          tlb_flush; /* Set, while a TLB shootdown waits for this CPU (tlb.c). */
 };
 
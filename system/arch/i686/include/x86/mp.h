@@ -81,5 +81,32 @@ struct mpioapic {       // I/O APIC table entry
 #define MPIOINTR  0x03  // One per bus interrupt source
 #define MPLINTR   0x04  // One per system interrupt source
 
+// Known I/O APICs
+#define MAX_IOAPIC 8
+
+struct ioapic;
+
+struct ioapicinfo {
+  u_int8_t id;                     // I/O APIC id
+  u_int32_t addr;                  // phys addr of the I/O APIC
+  u_int32_t gsibase;               // first global system interrupt
+};
+
+// Results of the CPU and I/O APIC enumeration (mp.c)
+extern volatile u_int32_t*     __i686_local_apic;
+extern volatile u_int8_t       __i686_ioapic_id;
+extern volatile struct ioapic* __i686_ioapic;      // the first I/O APIC
+extern u_int32_t __i686_ncpu;
+extern u_int32_t __i686_boot_cpu;
+extern u_int8_t  __i686_cpu_apics[256];
+extern struct ioapicinfo __i686_ioapics[MAX_IOAPIC];
+extern u_int32_t __i686_nioapic;
+extern u_int32_t __i686_irq_gsi[16];               // global system interrupt of each ISA IRQ
+extern u_int16_t __i686_irq_flags[16];             // polarity and trigger mode of each ISA IRQ
+
+// Adds a CPU or an I/O APIC to the tables above.
+void __i686_mp_addcpu(u_int8_t apicid, int boot);
+void __i686_mp_addioapic(u_int8_t id, u_int32_t addr, u_int32_t gsibase);
+
 //PAGEBREAK!
 // Blank page.
\ No newline at end of file
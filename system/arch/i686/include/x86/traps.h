@@ -58,5 +58,7 @@
 #define IRQ_COM1         4
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_RESCHED     20      // reschedule IPI
+#define IRQ_TLB         21      // TLB shootdown IPI
 #define IRQ_SPURIOUS    31
 
@@ -70,6 +70,32 @@ sti(void)
   asm volatile("sti");
 }
 
+#define FL_IF           0x00000200      // Interrupt Enable
+
+static inline u_int32_t
+readeflags(void)
+{
+  u_int32_t eflags;
+  asm volatile("pushfl; popl %0" : "=r" (eflags));
+  return eflags;
+}
+
+static inline void
+cpuid(u_int32_t leaf, u_int32_t *a, u_int32_t *b, u_int32_t *c, u_int32_t *d)
+{
+  asm volatile("cpuid" : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d) : "a" (leaf), "c" (0));
+}
+
+#define CPUID_EDX_SSE2  0x04000000      // SSE2 (movnti)
+
+static inline u_int64_t
+rdtsc(void)
+{
+  u_int64_t val;
+  asm volatile("rdtsc" : "=A" (val));
+  return val;
+}
+
 static inline u_int32_t
 rcr2(void)
 {
@@ -23,6 +23,8 @@
  */
 #include <x86/x86.h>
 #include <x86/traps.h>
+#include <sysarch/paddr.h>
+#include <sys/clockevent.h>
 
 // Local APIC registers, divided by 4 for use as u_int32_t[] indices.
 #define ID      (0x0020/4)   // ID
@@ -39,6 +41,7 @@
   #define ASSERT     0x00004000   // Assert interrupt (vs deassert)
   #define DEASSERT   0x00000000
   #define LEVEL      0x00008000   // Level triggered
+  #define SELF       0x00040000   // Send to self.
   #define BCAST      0x00080000   // Send to all APICs, including self.
   #define BUSY       0x00001000
   #define FIXED      0x00000000
@@ -51,6 +54,8 @@
 #define LINT1   (0x0360/4)   // Local Vector Table 2 (LINT1)
 #define ERROR   (0x0370/4)   // Local Vector Table 3 (ERROR)
   #define MASKED     0x00010000   // Interrupt masked
+  #define NMI        0x00000400   // Delivery mode NMI
+  #define EXTINT     0x00000700   // Delivery mode ExtINT
 #define TICR    (0x0380/4)   // Timer Initial Count
 #define TCCR    (0x0390/4)   // Timer Current Count
 #define TDCR    (0x03E0/4)   // Timer Divide Configuration
@@ -58,6 +63,13 @@
 volatile u_int32_t*     __i686_local_apic;
 #define lapic __i686_local_apic
 
+// Spin for a given number of microseconds (irq_pic.c).
+void __i686_microdelay(u_int32_t us);
+#define microdelay(us) __i686_microdelay(us)
+
+u_intptr_t __i686_mp_map_range(paddr_t pa,int n);
+void __i686_mp_unmap_range(u_intptr_t va,int n);
+
 static void
 lapicw(int index, int value)
 {
@@ -73,13 +85,11 @@ void __i686_lapicinit()
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.
-	// If xv6 cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer stays off, until the tick code programs it
+	// through the clock event (__i686_lapic_clock_event).
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-	lapicw(TICR, 10000000);
+	lapicw(TIMER, MASKED);
+	lapicw(TICR, 0);
 
 	// Disable logical interrupt lines.
 	lapicw(LINT0, MASKED);
@@ -110,6 +120,27 @@ void __i686_lapicinit()
 	lapicw(TPR, 0);
 }
 
+/*
+ * Enables the local APIC of the boot CPU, so that it can send IPIs. Unlike
+ * __i686_lapicinit(), the PIC stays in charge: LINT0 delivers its interrupts
+ * (ExtINT, virtual wire mode), and the APIC timer stays masked.
+ */
+void __i686_lapicinit_bsp()
+{
+	if(!lapic)
+		return;
+
+	lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
+	lapicw(TIMER, MASKED);
+	lapicw(LINT0, EXTINT);
+	lapicw(LINT1, NMI);
+	lapicw(ERROR, T_IRQ0 + IRQ_ERROR);
+	lapicw(ESR, 0);
+	lapicw(ESR, 0);
+	lapicw(EOI, 0);
+	lapicw(TPR, 0);
+}
+
 
 #if 0
 int
@@ -147,26 +178,111 @@ void __i686_lapiceoi() {
 		lapicw(EOI, 0);
 }
 
-#if 0
-// Spin for a given number of microseconds.
-// On real hardware would want to tune this dynamically.
-void
-microdelay(int us)
+// Send a fixed interrupt to the CPU with the given APIC ID,
+// or to the current CPU, if 'self' is set.
+void __i686_lapicipi(u_int8_t apicid, int self, int vector)
 {
-	(void)us;
+	u_int32_t eflags = readeflags();
+	if(!lapic)
+		return;
+	// ICRHI and ICRLO must not be interleaved with another IPI.
+	cli();
+	while(lapic[ICRLO] & DELIVS)
+		;
+	if(self){
+		lapicw(ICRLO, SELF | FIXED | vector);
+	}else{
+		lapicw(ICRHI, apicid<<24);
+		lapicw(ICRLO, FIXED | vector);
+	}
+	if(eflags & FL_IF) sti();
+}
+
+// Timer ticks in LAPIC_CAL_US microseconds, as measured by
+// __i686_lapic_calibrate(). A power of two keeps the conversion
+// to ticks free of 64 bit divisions.
+#define LAPIC_CAL_SHIFT 13
+#define LAPIC_CAL_US    (1<<LAPIC_CAL_SHIFT)
+static u_int32_t lapic_cal;
+
+// Measure the timer frequency against the PIT (see __i686_microdelay).
+// Must be called on the boot CPU, before the timer is in use.
+// Returns 0 on failure.
+int __i686_lapic_calibrate()
+{
+	if(!lapic)
+		return 0;
+	lapicw(TDCR, X1);
+	lapicw(TIMER, MASKED);
+	lapicw(TICR, 0xFFFFFFFF);
+	microdelay(LAPIC_CAL_US);
+	lapic_cal = 0xFFFFFFFF - lapic[TCCR];
+	lapicw(TICR, 0);
+	return lapic_cal ? 1 : 0;
+}
+
+static u_int32_t
+lapic_ticks(u_int32_t us)
+{
+	u_int64_t ticks = (((u_int64_t)us) * lapic_cal) >> LAPIC_CAL_SHIFT;
+	if(ticks > 0xFFFFFFFFULL)
+		return 0xFFFFFFFF;
+	return ticks ? (u_int32_t)ticks : 1;
+}
+
+static void
+lapic_ce_periodic(struct clock_event* ce, u_int32_t us)
+{
+	(void)ce;
+	lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
+	lapicw(TICR, lapic_ticks(us));
+}
+
+static void
+lapic_ce_oneshot(struct clock_event* ce, u_int32_t us)
+{
+	(void)ce;
+	lapicw(TIMER, T_IRQ0 + IRQ_TIMER);
+	lapicw(TICR, lapic_ticks(us));
 }
-#endif
+
+static void
+lapic_ce_stop(struct clock_event* ce)
+{
+	(void)ce;
+	lapicw(TIMER, MASKED);
+	lapicw(TICR, 0);
+}
+
+// Set up the clock event of the local APIC timer, after
+// __i686_lapic_calibrate(). Returns 0, if the timer is unusable.
+int __i686_lapic_clock_event(struct clock_event* ce)
+{
+	u_int64_t max;
+	if(!lapic || !lapic_cal)
+		return 0;
+	max = ((u_int64_t)(0xFFFFFFFF / lapic_cal)) << LAPIC_CAL_SHIFT;
+	ce->ce_name     = "lapic";
+	ce->ce_features = CLOCK_EVENT_PERIODIC | CLOCK_EVENT_ONESHOT;
+	ce->ce_max_us   = (max > 0xFFFFFFFFULL) ? 0xFFFFFFFF : (u_int32_t)max;
+	ce->ce_mode     = 0;
+	ce->ce_periodic = lapic_ce_periodic;
+	ce->ce_oneshot  = lapic_ce_oneshot;
+	ce->ce_stop     = lapic_ce_stop;
+	return 1;
+}
+
 
 #define CMOS_PORT    0x70
 #define CMOS_RETURN  0x71
 
-#if 0
 // Start additional processor running entry code at addr.
 // See Appendix B of MultiProcessor Specification.
 void
-lapicstartap(u_int8_t apicid, u_int32_t addr)
+__i686_lapicstartap(u_int8_t apicid, u_int32_t addr)
 {
   int i;
+  u_intptr_t va;
   u_int16_t *wrv;
 
   // "The BSP must initialize CMOS shutdown code to 0AH
@@ -174,9 +290,13 @@ lapicstartap(u_int8_t apicid, u_int32_t addr)
   // the AP startup code prior to the [universal startup algorithm]."
   outb(CMOS_PORT, 0xF);  // offset 0xF is shutdown code
   outb(CMOS_PORT+1, 0x0A);
-  wrv = (u_int16_t*)P2V((0x40<<4 | 0x67));  // Warm reset vector
-  wrv[0] = 0;
-  wrv[1] = addr >> 4;
+  va = __i686_mp_map_range((0x40<<4 | 0x67),4);  // Warm reset vector
+  if(va){
+    wrv = (u_int16_t*)va;
+    wrv[0] = 0;
+    wrv[1] = addr >> 4;
+    __i686_mp_unmap_range(va,4);
+  }
 
   // "Universal startup algorithm."
   // Send INIT (level-triggered) interrupt to reset other CPU.
@@ -197,7 +317,6 @@ lapicstartap(u_int8_t apicid, u_int32_t addr)
     microdelay(200);
   }
 }
-#endif
 
 #define CMOS_STATA   0x0a
 #define CMOS_STATB   0x0b
@@ -74,6 +74,12 @@ picenable(int irq)
 	picsetmask(irqmask & ~(1<<irq));
 }
 
+// Masks an IRQ, for example the PIT, once the local APIC timer takes over.
+void __i686_picdisable(int irq)
+{
+	picsetmask(irqmask | (1<<irq));
+}
+
 
 // Initialize the 8259A interrupt controllers.
 void __i686_picinit()
@@ -135,6 +141,36 @@ void __i686_piceoi(int irq) {
 	outb(IO_PIC1,PIC_EOI);
 }
 
+/*
+ * Reads the current count of counter 0. It counts down from TIMER_DIV(50).
+ */
+static u_int32_t pit_read()
+{
+	u_int32_t lo,hi;
+	outb(TIMER_MODE, TIMER_SEL0); /* Counter latch command. */
+	lo = inb(IO_TIMER1);
+	hi = inb(IO_TIMER1);
+	return lo | (hi<<8);
+}
+
+/*
+ * Busy-waits for at least 'us' microseconds, by watching counter 0, which must
+ * have been set up by __i686_timerinit().
+ */
+void __i686_microdelay(u_int32_t us)
+{
+	u_int32_t reload = TIMER_DIV(50);
+	u_int32_t need = ((us*(TIMER_FREQ/1000))/1000) + 1;
+	u_int32_t elapsed = 0;
+	u_int32_t prev,now;
+	prev = pit_read();
+	while(elapsed < need){
+		now = pit_read();
+		elapsed += (prev >= now) ? (prev - now) : (prev + reload - now);
+		prev = now;
+	}
+}
+
 void __i686_timerinit()
 {
 	int time;
@@ -26,6 +26,21 @@
 #include <x86/cpu_arch.h>
 
 extern const u_int32_t  _i686_multiboot_memdata[5];
+extern const u_int8_t   _i686_multiboot_mmap[];
+
+/*
+ * An entry of the multiboot memory map. 'size' does not count itself.
+ */
+struct multiboot_mmap_entry {
+	u_int32_t size;
+	u_int64_t addr;
+	u_int64_t len;
+	u_int32_t type;
+} __attribute__((packed));
+
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
+#define MAX_MEMRANGE 32
 
 /*
  * A Pointer to the end of the Kernel.
@@ -34,17 +49,71 @@ extern const char _kernel_end[];
 
 static struct kernslice slice;
 static struct cpu cpu;
-static struct physmem_range memrange[2];
+static struct physmem_range memrange[MAX_MEMRANGE];
 static struct cpu_arch cpu_arch;
 
 void __i686_setup_idt();
 void _i686_initmp();
 void __i686_picinit();
-void __i686_lapicinit();
 void __i686_timerinit();
+void _i686_numa_init(struct kernslice* boot);
 
 void kernel_main(void);
 
+/*
+ * Adds the available memory [begin,end) to 'memrange', keeping it sorted. The range
+ * is shrinked to whole pages below 4 GB, and the first 32 KB (BIOS data area, AP
+ * trampoline and its page directory, see smp.c) as well as the kernel
+ * [1 MB,endkernel) are cut out of it.
+ */
+static void add_range(u_int64_t begin, u_int64_t end, u_int32_t endkernel){
+	u_intptr_t i,n;
+	
+	begin = (begin + 0xfff) & ~((u_int64_t)0xfff);
+	if(end > 0xfffff000ULL) end = 0xfffff000ULL;
+	end &= ~((u_int64_t)0xfff);
+	if(begin < 0x8000) begin = 0x8000;
+	
+	if( (begin < endkernel) && (end > 0x100000) ){
+		if(begin < 0x100000) add_range(begin,0x100000,endkernel);
+		begin = endkernel;
+	}
+	if(begin >= end) return;
+	
+	/* Read the count after the recursion, which may have added the low part. */
+	n = slice.ks_num_memory_ranges;
+	if(n >= MAX_MEMRANGE) return;
+	
+	/* Insertion-sort by address. Overlapping parts are dropped. */
+	for(i=n;i>0 && memrange[i-1].pm_begin > begin;--i)
+		memrange[i] = memrange[i-1];
+	if(i>0 && memrange[i-1].pm_end > begin) begin = memrange[i-1].pm_end;
+	if(i<n && end > memrange[i+1].pm_begin) end = memrange[i+1].pm_begin;
+	if(begin >= end){
+		/* Completely covered: undo the shift. */
+		for(;i<n;++i) memrange[i] = memrange[i+1];
+		return;
+	}
+	memrange[i].pm_begin = (paddr_t)begin;
+	memrange[i].pm_end   = (paddr_t)end;
+	slice.ks_num_memory_ranges = n+1;
+}
+
+/*
+ * Adds all available regions of the multiboot memory map to 'memrange'.
+ */
+static void parse_mmap(const u_int8_t* mmap, u_int32_t length, u_int32_t endkernel){
+	const struct multiboot_mmap_entry* entry;
+	u_int32_t pos = 0;
+	
+	while( (pos + sizeof(struct multiboot_mmap_entry)) <= length ){
+		entry = (const struct multiboot_mmap_entry*)(mmap+pos);
+		if( (entry->type == MULTIBOOT_MEMORY_AVAILABLE) && entry->len )
+			add_range(entry->addr,entry->addr+entry->len,endkernel);
+		pos += entry->size + 4;
+	}
+}
+
 static void _i686_init(){
 	u_int32_t endkernel = (u_int32_t)(const void*)_kernel_end;
 	endkernel -= 0xC0000000;
@@ -55,7 +124,14 @@ static void _i686_init(){
 	endkernel +=  0xfff;
 	endkernel &= ~0xfff;
 	
+	/*
+	 * If something bad happens - and 'endkernel' points below 1 MB, skip the first
+	 * 12 MB, the kernel is assumed to be small enough, to fit in.
+	 */
+	if(endkernel<=0x100000) endkernel = 0xC00000;
+	
 	u_int32_t flags = _i686_multiboot_memdata[0];
+	u_intptr_t i;
 	cpu.cpu_cpu_id = 0;
 	cpu.cpu_kernel_slice = &slice;
 	cpu.cpu_ks_next = 0;
@@ -68,39 +144,41 @@ static void _i686_init(){
 	cpu.CPU_LOCAL_SELF  = (u_intptr_t)&cpu;
 	
 	slice.ks_kernslice_id  = 0;
+	kernslice_register(&slice);
 	slice.ks_memory_ranges = memrange;
-	if(flags&1){
-		memrange[0].pm_begin = 0;
-		memrange[0].pm_end = _i686_multiboot_memdata[1]<<10;
-		/*
-		 * Round-Down the End-Of-Memory in order to align 4kb pages.
-		 */
-		memrange[0].pm_end &= ~0xfff;
-		
+	slice.ks_num_memory_ranges = 0;
+	if(flags&(1<<6)){
 		/*
-		 * The 'upper memory' begins after the first megabyte. The Kernel itself is also
-		 * located at this position - so that the usable memory starts after the kernel.
-		 * However, if something bad happens - and 'endkernel' points below 1 MB, this
-		 * check is going to catch it.
+		 * boot.s has copied the memory map into '_i686_multiboot_mmap', and stored
+		 * the copied length in '_i686_multiboot_memdata[3]'.
 		 */
-		if(endkernel>0x100000) /* If 'endkernel' is correct, skip the kernel. */
-			memrange[1].pm_begin = endkernel;
-		else /* Else skip the first 12 MB, the kernel is assumed to be small enough, to fit in. */
-			memrange[1].pm_begin = 0xC00000;
-		
-		memrange[1].pm_end = (_i686_multiboot_memdata[2]<<10)+0x100000;
-		/*
-		 * Round-Down the End-Of-Memory in order to align 4kb pages.
-		 */
-		memrange[1].pm_end &= ~0xfff;
-		slice.ks_num_memory_ranges = 2;
+		parse_mmap(_i686_multiboot_mmap,_i686_multiboot_memdata[3],endkernel);
+	}
+	if(!slice.ks_num_memory_ranges && (flags&1)){
+		add_range(0,((u_int64_t)_i686_multiboot_memdata[1])<<10,endkernel);
+		add_range(0x100000,(((u_int64_t)_i686_multiboot_memdata[2])<<10)+0x100000,endkernel);
 	}
 	
+	/*
+	 * Split the memory up into one kernel slice per NUMA domain.
+	 */
+	slice.ks_cpu_list = &cpu;
+	_i686_numa_init(&slice);
+	
+	/*
+	 * The raw memory allocator starts behind the kernel, where memory is mapped by
+	 * the kernel page table, and the memory below 1 MB is left for the BIOS and
+	 * the AP trampoline.
+	 */
+	for(i=0;i<slice.ks_num_memory_ranges;++i)
+		if(slice.ks_memory_ranges[i].pm_begin >= 0x100000) break;
+	slice.ks_raw_memory.range_idx = (i<slice.ks_num_memory_ranges) ? i : 0;
+	
 	hal_initcpu(&cpu);
 	__i686_setup_idt();
 	__i686_picinit();
-	//_i686_initmp();
-	// __i686_lapicinit(); LAPIC-INIT does not work. (CRASH).
+	_i686_initmp();
+	/* The local APIC is mapped and enabled later, by hal_start_cpus(). */
 	__i686_timerinit();
 }
 
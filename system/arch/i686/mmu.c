@@ -26,6 +26,7 @@
 #include <sys/cpu.h>
 #include <sys/kernslice.h>
 #include <sys/physmem_alloc.h>
+#include <vm/vm_page.h>
 
 //#include <stdio.h>
 
@@ -47,10 +48,8 @@ void  _i686_pmap_pdinit(paddr_t pa);
 void pmap_init(){
 	int i;
 	paddr_t phys;
-	struct physmem_bmaset* bmas;
 	
 	p_inst_kernel.slice = kernel_get_current_cpu()->cpu_kernel_slice;
-	bmas = p_inst_kernel.slice->ks_memory_allocator;
 	p_inst_kernel.pdir = ((u_intptr_t)_i686_kernel_page_dir)-0xC0000000;
 	p_inst_kernel.vab  = (u_intptr_t)0xC1000000;
 	/*p_inst_kernel.vae  = (u_intptr_t)0xFFFFFFFF;*/
@@ -58,8 +57,7 @@ void pmap_init(){
 	
 	/* We have already initialized the following page tables in boot.s: 768 .. 768+3 */
 	for(i = 768+4; i<1024; ++i){
-		if(vm_phys_alloc(bmas, &phys)){
-			pmap_zero_page(phys);
+		if(vm_page_grab_zeroed(p_inst_kernel.slice, &phys)){
 			phys |= PTE_PW;
 		}else phys = 0;
 		_i686_kernel_page_dir[i] = phys;
@@ -130,6 +128,18 @@ int pmap_enter(pmap_t pmap, vaddr_t va, paddr_t pa, vm_prot_t prot, vm_flags_t f
  * Unmap a certain range of virtual addresses from this address space.
  */
 int pmap_remove(pmap_t pmap, vaddr_t vab, vaddr_t vae){
+	paddr_t pta;
+	
+	if(pmap == &p_inst_kernel){
+		vab &= ~0xfff;
+		for(;vab<=vae;vab+=0x1000){
+			pta = _i686_kernel_page_dir[PDX(vab)];
+			if(!PTE_FLAGS(pta)) continue;
+			_i686_pmap_pte_set(PTE_ADDR(pta),PTX(vab),0);
+		}
+		return 0;
+	}
+	
 	return 0;
 }
 
@@ -148,6 +158,20 @@ int pmap_protect(pmap_t pmap, vaddr_t vab, vaddr_t vae, vm_prot_t prot){
 }
 
 
+/*
+ * Maps the device memory page at 'pa' uncached to the same virtual address. This
+ * is meant for memory mapped registers above the kernel address range, such as
+ * the local APIC. Returns 0 on failure.
+ */
+int __i686_map_mmio(paddr_t pa){
+	paddr_t pta = _i686_kernel_page_dir[PDX(pa)];
+	if(pa < 0xFE000000) return 0;
+	if(!PTE_FLAGS(pta)) return 0;
+	_i686_pmap_pte_set(PTE_ADDR(pta),PTX(pa),PTE_ADDR(pa)|PTE_PW|PTE_PCD|PTE_PWT);
+	invlpg((void*)(u_intptr_t)PTE_ADDR(pa));
+	return 1;
+}
+
 /*
  * ----------------------------------------------
  * | TLB management (local CPU/local CPU-core). |
@@ -23,8 +23,7 @@
  * SOFTWARE.
  */
 #include <x86/mp.h>
-
-struct ioapic;
+#include <x86/acpi.h>
 
 /* GLOBAL VARIABLES: */
 volatile u_int32_t*     __i686_local_apic = 0;
@@ -34,6 +33,10 @@ volatile struct ioapic* __i686_ioapic = 0;
 u_int32_t __i686_ncpu;
 u_int32_t __i686_boot_cpu;
 u_int8_t  __i686_cpu_apics[256];
+struct ioapicinfo __i686_ioapics[MAX_IOAPIC];
+u_int32_t __i686_nioapic;
+u_int32_t __i686_irq_gsi[16];
+u_int16_t __i686_irq_flags[16];
 
 
 void _i686_get_mp(paddr_t *addrs);
@@ -196,19 +199,12 @@ static int mpinit(){
 		switch(*p){
 			case MPPROC:
 				proc = (struct mpproc *)p;
-				if(__i686_ncpu<256){
-					__i686_cpu_apics[__i686_ncpu] = proc->apicid;
-					if((proc->flags)&MPBOOT)
-						__i686_boot_cpu = __i686_ncpu;
-				}
-				__i686_ncpu++;
+				__i686_mp_addcpu(proc->apicid,(proc->flags)&MPBOOT);
 				p += sizeof(struct mpproc);
 				continue;
 			case MPIOAPIC:
 				ioapic = (struct mpioapic*)p;
-				__i686_ioapic_has = 0;
-				__i686_ioapic_id  = ioapic->apicno;
-				__i686_ioapic     = (struct ioapic*)(ioapic->addr);
+				__i686_mp_addioapic(ioapic->apicno,(u_int32_t)(ioapic->addr),0);
 				p += sizeof(struct mpioapic);
 				continue;
 			case MPBUS:
@@ -225,28 +221,73 @@ static int mpinit(){
 	return ismp;
 }
 
+void __i686_mp_addcpu(u_int8_t apicid, int boot){
+	if(__i686_ncpu<256){
+		__i686_cpu_apics[__i686_ncpu] = apicid;
+		if(boot)
+			__i686_boot_cpu = __i686_ncpu;
+	}
+	__i686_ncpu++;
+}
+
+void __i686_mp_addioapic(u_int8_t id, u_int32_t addr, u_int32_t gsibase){
+	if(!__i686_nioapic){
+		__i686_ioapic_has = 0;
+		__i686_ioapic_id  = id;
+		__i686_ioapic     = (struct ioapic*)addr;
+	}
+	if(__i686_nioapic<MAX_IOAPIC){
+		__i686_ioapics[__i686_nioapic].id      = id;
+		__i686_ioapics[__i686_nioapic].addr    = addr;
+		__i686_ioapics[__i686_nioapic].gsibase = gsibase;
+		__i686_nioapic++;
+	}
+}
+
 #define P2I(x) ((u_intptr_t)(x))
 
+/*
+ * Enumerates the CPUs and I/O APICs. The ACPI MADT is preferred, the MP tables
+ * are the fallback.
+ */
 void _i686_initmp(){
-	int ismp;
+	int ismp,i;
 	struct mp* mp;
 	struct mpconf *conf;
 	g_mpptr = 0;
 	g_mplen = 0;
 	
-	conf = mpconfig(&mp);
-	
+	__i686_ncpu = 0;
+	__i686_nioapic = 0;
 	__i686_ioapic_has = 0;
 	__i686_ioapic = 0;
+	__i686_local_apic = 0;
 	__i686_boot_cpu = 256;
-	if(conf){
-		ismp = mpinit();
-		__i686_local_apic = conf->lapicaddr;
+	
+	/* ISA IRQs are identity mapped, unless overridden. */
+	for(i=0;i<16;++i){
+		__i686_irq_gsi[i] = i;
+		__i686_irq_flags[i] = 0;
+	}
+	
+	if(_i686_acpi_madt()){
+		ismp = 1;
+		if(__i686_ncpu<1) ismp = 0;
+	}else{
+		conf = mpconfig(&mp);
+		if(conf){
+			ismp = mpinit();
+			__i686_local_apic = conf->lapicaddr;
+		}else ismp = 0;
+	}
+	
+	if(ismp){
 		if(!__i686_ioapic    ) ismp = 0;
 		if(!__i686_local_apic) ismp = 0;
 		if(P2I(__i686_ioapic    )<0xfe000000) ismp = 0;
 		if(P2I(__i686_local_apic)<0xfe000000) ismp = 0;
-	}else ismp = 0;
+		if(__i686_boot_cpu >= __i686_ncpu) __i686_boot_cpu = 0;
+	}
 	
 	if(!ismp){
 		__i686_local_apic = 0;
@@ -254,6 +295,6 @@ void _i686_initmp(){
 		__i686_ncpu = 1;
 		__i686_ioapic_has = 0;
 		__i686_ioapic = 0;
+		__i686_nioapic = 0;
 	}
 }
-
@@ -0,0 +1,115 @@
+/*
+ * 
+ * Copyright (c) 2006-2016 Frans Kaashoek, Robert Morris, Russ Cox,
+ *                         Massachusetts Institute of Technology
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+# Startup code of the application processors (xv6: entryother.S).
+#
+# The code is copied to MPENTRY_ADDR (below 1 MB, page aligned), where the AP
+# starts in real mode after the STARTUP IPI. It switches to protected mode,
+# enables paging with the page directory from the parameter block, and calls
+# 'func(arg)' on 'stack'. The page directory must map the first 4 MB identically
+# (as a 4 MB page) and the kernel at 0xC0000000.
+
+.set MPENTRY_ADDR, 0x7000
+
+.text
+.global __i686_mpentry_start
+.global __i686_mpentry_params
+.global __i686_mpentry_end
+
+.code16
+__i686_mpentry_start:
+	cli
+	cld
+	xorw %ax, %ax
+	movw %ax, %ds
+	movw %ax, %es
+	movw %ax, %ss
+	
+	lgdtl (mpentry_gdtdesc - __i686_mpentry_start + MPENTRY_ADDR)
+	movl %cr0, %eax
+	orl $0x1, %eax # CR0_PE
+	movl %eax, %cr0
+	
+	ljmpl $(1<<3), $(mpentry_32 - __i686_mpentry_start + MPENTRY_ADDR)
+
+.code32
+mpentry_32:
+	movw $(2<<3), %ax
+	movw %ax, %ds
+	movw %ax, %es
+	movw %ax, %ss
+	xorw %ax, %ax
+	movw %ax, %fs
+	movw %ax, %gs
+	
+	# Enable 4 MB pages (CR4_PSE), for the identity mapping.
+	movl %cr4, %eax
+	orl $0x10, %eax
+	movl %eax, %cr4
+	
+	movl (mpentry_pgdir - __i686_mpentry_start + MPENTRY_ADDR), %eax
+	movl %eax, %cr3
+	
+	# Enable paging and the write-protect bit.
+	movl %cr0, %eax
+	orl $0x80010000, %eax
+	movl %eax, %cr0
+	
+	movl (mpentry_stack - __i686_mpentry_start + MPENTRY_ADDR), %esp
+	movl (mpentry_arg - __i686_mpentry_start + MPENTRY_ADDR), %eax
+	pushl %eax
+	movl (mpentry_func - __i686_mpentry_start + MPENTRY_ADDR), %eax
+	call *%eax
+	
+	# 'func' should not return.
+1:
+	cli
+	hlt
+	jmp 1b
+
+# Flat code and data segments, as SEG_KCODE and SEG_KDATA.
+.p2align 3
+mpentry_gdt:
+	.quad 0
+	.quad 0x00CF9A000000FFFF
+	.quad 0x00CF92000000FFFF
+
+mpentry_gdtdesc:
+	.word (3*8)-1
+	.long (mpentry_gdt - __i686_mpentry_start + MPENTRY_ADDR)
+
+# Parameter block, filled in by the boot CPU (struct mpentry_params).
+.p2align 2
+__i686_mpentry_params:
+mpentry_pgdir:
+	.long 0
+mpentry_stack:
+	.long 0
+mpentry_func:
+	.long 0
+mpentry_arg:
+	.long 0
+__i686_mpentry_end:
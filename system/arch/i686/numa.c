@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <x86/acpi.h>
+#include <x86/x86.h>
+#include <sys/kernslice.h>
+
+/* As in kerninit.c. */
+#define MAX_MEMRANGE 32
+
+static struct kernslice     numa_slice[KS_MAX_SLICES];
+static struct physmem_range numa_range[KS_MAX_SLICES][MAX_MEMRANGE];
+static u_int32_t            numa_domain[KS_MAX_SLICES]; /* Proximity domain of each slice. */
+static u_int32_t            numa_count = 0;
+
+/* The slice of every local APIC id. */
+static struct kernslice*    numa_apic_slice[256];
+
+static struct kernslice*    numa_boot = 0;
+
+/*
+ * Returns the index of a proximity domain in 'numa_domain', adding it, if it is new.
+ * Returns KS_MAX_SLICES, if there are too many domains.
+ */
+static u_int32_t domain_index(u_int32_t domain){
+	u_int32_t i;
+	for(i=0;i<numa_count;++i)
+		if(numa_domain[i] == domain) return i;
+	if(numa_count >= KS_MAX_SLICES) return KS_MAX_SLICES;
+	numa_domain[numa_count] = domain;
+	return numa_count++;
+}
+
+static void add_range(u_int32_t idx, paddr_t begin, paddr_t end){
+	struct kernslice* slice = &numa_slice[idx];
+	if(slice->ks_num_memory_ranges >= MAX_MEMRANGE) return;
+	numa_range[idx][slice->ks_num_memory_ranges].pm_begin = begin;
+	numa_range[idx][slice->ks_num_memory_ranges].pm_end   = end;
+	slice->ks_num_memory_ranges++;
+}
+
+/*
+ * Finds the enabled memory affinity entry, that contains 'addr'. If there is none,
+ * 'next' is set to the begin of the next entry above 'addr' (or 0 if there is none).
+ */
+static struct acpi_srat_mem* find_mem(struct acpi_srat* srat, u_int32_t len, u_int64_t addr, u_int64_t *next){
+	u_int8_t *p = (u_int8_t*)(srat+1);
+	u_int8_t *e = ((u_int8_t*)srat)+len;
+	struct acpi_srat_mem* mem;
+	*next = 0;
+	for(;p+2<=e && p[1];p+=p[1]){
+		if(p[0] != SRAT_MEM) continue;
+		mem = (struct acpi_srat_mem*)p;
+		if( (p+sizeof(struct acpi_srat_mem)) > e ) break;
+		if( !(mem->flags & SRAT_ENABLED) || !mem->size ) continue;
+		if( (mem->base <= addr) && (addr < (mem->base+mem->size)) ) return mem;
+		if( (mem->base > addr) && ((!*next) || (mem->base < *next)) ) *next = mem->base;
+	}
+	return 0;
+}
+
+/*
+ * Builds one kernel slice per proximity domain, from the ACPI SRAT (and the SLIT).
+ * The ranges of 'boot' are split up by their affinity, and 'boot' becomes the slice
+ * of the boot CPU's domain. Memory without affinity stays in 'boot'.
+ * Does nothing, if there is no SRAT.
+ */
+void _i686_numa_init(struct kernslice* boot){
+	struct acpi_srat*       srat;
+	struct acpi_slit*       slit;
+	struct acpi_srat_cpu*   acpu;
+	struct acpi_srat_x2apic* x2cpu;
+	struct acpi_srat_mem*   mem;
+	struct physmem_range*   ranges;
+	struct kernslice*       slice;
+	u_int8_t *p,*e;
+	u_int32_t len,i,j,idx,bspidx,a,b,c,d;
+	u_int64_t pos,end,next;
+	u_int8_t  dom_of_apic[256];
+	
+	for(i=0;i<256;++i) numa_apic_slice[i] = boot;
+	numa_boot = boot;
+	
+	srat = (struct acpi_srat*)_i686_acpi_find("SRAT",&len);
+	if(!srat) return;
+	
+	/*
+	 * Collect the proximity domains of all enabled CPUs and memory ranges.
+	 */
+	for(i=0;i<256;++i) dom_of_apic[i] = KS_MAX_SLICES;
+	e = ((u_int8_t*)srat)+len;
+	for(p = (u_int8_t*)(srat+1);p+2<=e && p[1];p+=p[1]){
+		switch(p[0]){
+		case SRAT_CPU:
+			acpu = (struct acpi_srat_cpu*)p;
+			if(!(acpu->flags & SRAT_ENABLED)) continue;
+			d = acpu->domain_lo | (acpu->domain_hi[0]<<8) | (acpu->domain_hi[1]<<16) | (acpu->domain_hi[2]<<24);
+			idx = domain_index(d);
+			if(idx < KS_MAX_SLICES) dom_of_apic[acpu->apicid] = idx;
+			break;
+		case SRAT_X2APIC:
+			x2cpu = (struct acpi_srat_x2apic*)p;
+			if(!(x2cpu->flags & SRAT_ENABLED)) continue;
+			idx = domain_index(x2cpu->domain);
+			if( (idx < KS_MAX_SLICES) && (x2cpu->x2apicid < 256) ) dom_of_apic[x2cpu->x2apicid] = idx;
+			break;
+		case SRAT_MEM:
+			mem = (struct acpi_srat_mem*)p;
+			if(!(mem->flags & SRAT_ENABLED)) continue;
+			domain_index(mem->domain);
+			break;
+		}
+	}
+	if(!numa_count){
+		_i686_acpi_unmap(&(srat->header),len);
+		return;
+	}
+	
+	/*
+	 * The boot CPU's local APIC id is in CPUID.1:EBX[31:24].
+	 */
+	cpuid(1,&a,&b,&c,&d);
+	bspidx = dom_of_apic[b>>24];
+	if(bspidx >= KS_MAX_SLICES) bspidx = 0;
+	
+	/*
+	 * Split the memory ranges.
+	 */
+	ranges = boot->ks_memory_ranges;
+	for(i=0;i<boot->ks_num_memory_ranges;++i){
+		pos = ranges[i].pm_begin;
+		while(pos < ranges[i].pm_end){
+			mem = find_mem(srat,len,pos,&next);
+			if(mem){
+				idx = domain_index(mem->domain);
+				end = mem->base+mem->size;
+			}else{
+				idx = bspidx;
+				end = next ? next : ranges[i].pm_end;
+			}
+			if(end > ranges[i].pm_end) end = ranges[i].pm_end;
+			add_range(idx < KS_MAX_SLICES ? idx : bspidx,(paddr_t)pos,(paddr_t)end);
+			pos = end;
+		}
+	}
+	
+	/*
+	 * Set up the slices. The slice of the boot CPU takes the place of 'boot'.
+	 */
+	for(i=0;i<numa_count;++i){
+		slice = (i==bspidx) ? boot : &numa_slice[i];
+		if(slice != boot) kernslice_register(slice);
+		slice->ks_kernslice_id      = numa_domain[i];
+		slice->ks_memory_ranges     = numa_range[i];
+		slice->ks_num_memory_ranges = numa_slice[i].ks_num_memory_ranges;
+	}
+	for(i=0;i<256;++i)
+		if(dom_of_apic[i] < KS_MAX_SLICES)
+			numa_apic_slice[i] = (dom_of_apic[i]==bspidx) ? boot : &numa_slice[dom_of_apic[i]];
+	
+	_i686_acpi_unmap(&(srat->header),len);
+	
+	/*
+	 * Record the distances between the slices.
+	 */
+	slit = (struct acpi_slit*)_i686_acpi_find("SLIT",&len);
+	if(!slit) return;
+	for(i=0;i<numa_count;++i){
+		for(j=0;j<numa_count;++j){
+			if( (numa_domain[i] >= slit->localities) || (numa_domain[j] >= slit->localities) ) continue;
+			if( (sizeof(struct acpi_slit) + (numa_domain[i]*slit->localities) + numa_domain[j]) >= len ) continue;
+			kernslice_set_distance(
+				(i==bspidx) ? boot : &numa_slice[i],
+				(j==bspidx) ? boot : &numa_slice[j],
+				slit->entry[(numa_domain[i]*slit->localities) + numa_domain[j]]
+			);
+		}
+	}
+	_i686_acpi_unmap(&(slit->header),len);
+}
+
+/*
+ * Returns the kernel slice of a CPU, by it's local APIC id.
+ */
+struct kernslice* _i686_numa_slice(u_int32_t apicid){
+	if(apicid >= 256) return numa_boot;
+	return numa_apic_slice[apicid];
+}
@@ -85,6 +85,24 @@ static void unmap_page(u_intptr_t va){
 	//kernlock_lock(&map_sl);
 }
 
+/*
+ * Below KPTMIN, the kernel page table maps physical memory at 0xC0000000+pa. Memory
+ * in this area is mapped there, everything else goes into the mapping window.
+ */
+vaddr_t pmap_bootstrap_map(paddr_t pa, paddr_t npages){
+	paddr_t i;
+	if(!npages) return 0;
+	if( (pa>>12) + npages > KPTMIN )
+		return (npages <= (KPTMAX-KPTMIN)) ? map_page_range(pa,(int)npages) : 0;
+	kernlock_lock(&map_sl);
+	for(i=0;i<npages;++i){
+		_i686_kernel_page_table[(pa>>12)+i] = PTE_ADDR(pa+(i<<12)) | PTE_PW;
+		invlpg((void*)(0xC0000000 + (u_intptr_t)(pa+(i<<12))));
+	}
+	kernlock_unlock(&map_sl);
+	return 0xC0000000 + (vaddr_t)pa;
+}
+
 /*
  * Search for the MP Floating Pointer Structure, which according to the
  * spec is in one of the following three locations:
@@ -120,13 +138,42 @@ void __i686_mp_unmap_range(u_intptr_t va,int n){
 		unmap_page(i);
 }
 
+static int zero_nontemporal = -1;
+
+/*
+ * Zeroes a page with non-temporal stores, so that it doesn't evict the cache.
+ */
+static void zero_page_nt(u_int32_t* p){
+	u_int32_t* end = p+1024;
+	for(;p<end;p+=4){
+		asm volatile(
+			"movnti %1,(%0)\n\t"
+			"movnti %1,4(%0)\n\t"
+			"movnti %1,8(%0)\n\t"
+			"movnti %1,12(%0)"
+			: : "r"(p), "r"(0) : "memory");
+	}
+	asm volatile("sfence" : : : "memory");
+}
+
+static void zero_page_stos(u_int32_t* p){
+	u_int32_t n = 1024;
+	asm volatile("rep stosl" : "+D"(p), "+c"(n) : "a"(0) : "memory");
+}
+
 /*
  * This function zeroes out a Memory Page.
  */
 void pmap_zero_page(paddr_t pa){
+	u_int32_t a,b,c,d;
 	u_intptr_t va = map_page(pa);
 	if(!va)panic("Cannot map Physical page.");
-	memset((void*)va,0,4096);
+	if(zero_nontemporal<0){
+		cpuid(1,&a,&b,&c,&d);
+		zero_nontemporal = (d & CPUID_EDX_SSE2) ? 1 : 0;
+	}
+	if(zero_nontemporal) zero_page_nt((u_int32_t*)va);
+	else                 zero_page_stos((u_int32_t*)va);
 	unmap_page(va);
 }
 
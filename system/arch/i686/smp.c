@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <sysarch/hal.h>
+#include <sys/cpu.h>
+#include <sys/kernslice.h>
+#include <x86/cpu_arch.h>
+#include <x86/mp.h>
+#include <x86/mmu.h>
+#include <x86/x86.h>
+#include <x86/traps.h>
+#include <kern/kmalloc.h>
+#include <kern/ktime.h>
+#include <vm/vm_top.h>
+#include <string.h>
+
+/*
+ * The AP trampoline (mpentry.s) is copied to MPENTRY_ADDR. It's page directory,
+ * which maps the first 4 MB identically, lives in the page below. kerninit.c keeps
+ * both pages out of the physical memory allocator.
+ */
+#define MPENTRY_ADDR  0x7000
+#define MPENTRY_PGDIR 0x6000
+
+#define AP_STACK_SIZE (1<<14) /* 16K */
+
+/* Parameter block of the trampoline. The layout matches mpentry.s. */
+struct mpentry_params{
+	u_int32_t pgdir;
+	u_int32_t stack;
+	u_int32_t func;
+	u_int32_t arg;
+};
+
+/* mpentry.s */
+extern const char __i686_mpentry_start[];
+extern const char __i686_mpentry_params[];
+extern const char __i686_mpentry_end[];
+
+extern pte_t _i686_kernel_page_dir[];
+
+u_intptr_t __i686_mp_map_range(paddr_t pa,int n);
+void __i686_mp_unmap_range(u_intptr_t va,int n);
+void  _i686_pmap_pte_set(paddr_t pa,int i,pte_t pte);
+void  _i686_pmap_pdinit(paddr_t pa);
+int __i686_map_mmio(paddr_t pa);
+
+void __i686_load_idt();
+void __i686_lapicinit();
+void __i686_lapicinit_bsp();
+void __i686_lapicstartap(u_int8_t apicid, u_int32_t addr);
+void __i686_microdelay(u_int32_t us);
+void __i686_picdisable(int irq);
+int __i686_lapic_calibrate();
+int __i686_lapic_clock_event(struct clock_event* ce);
+struct kernslice* _i686_numa_slice(u_int32_t apicid);
+
+/* tlb.c */
+void __i686_tlb_block();
+void __i686_tlb_unblock();
+void __i686_tlb_add_cpu();
+
+/* init_main.c */
+void kernel_cpu_prepare(struct cpu* cpu);
+void kernel_ap_main();
+
+/* Set by the AP, once it runs on it's own GDT, IDT and local APIC. */
+static volatile u_int32_t ap_started;
+
+/*
+ * The first C function of an AP, called by the trampoline.
+ */
+static void _i686_ap_entry(void* arg){
+	struct cpu* cpu = arg;
+	
+	/* Leave the trampoline's page directory. */
+	lcr3(((u_intptr_t)_i686_kernel_page_dir)-0xC0000000);
+	
+	hal_initcpu(cpu);
+	__i686_load_idt();
+	__i686_lapicinit();
+	cpu->cpu_arch->lapic = 1;
+	
+	/* hal_start_cpus() has made sure, that the timer is calibrated. */
+	if(__i686_lapic_clock_event(&(cpu->cpu_arch->lapic_ce)))
+		cpu->cpu_clock_event = &(cpu->cpu_arch->lapic_ce);
+	
+	ap_started = 1;
+	
+	/* Align the TSC with the boot CPU, which waits for that. */
+	ktime_sync_cpu();
+	
+	kernel_ap_main();
+}
+
+/*
+ * Sets up the AP page directory and copies the trampoline to MPENTRY_ADDR. Returns
+ * a pointer to the parameter block of the copy, which stays mapped.
+ */
+static struct mpentry_params* install_trampoline(u_intptr_t* va, int* len){
+	*len = (int)(__i686_mpentry_end - __i686_mpentry_start);
+	
+	/* Kernel half as the kernel page directory, plus the first 4 MB identically. */
+	_i686_pmap_pdinit(MPENTRY_PGDIR);
+	_i686_pmap_pte_set(MPENTRY_PGDIR,0,PTE_PS|PTE_PW);
+	
+	*va = __i686_mp_map_range(MPENTRY_ADDR,*len);
+	if(!*va) return 0;
+	memcpy((void*)*va,__i686_mpentry_start,*len);
+	return (struct mpentry_params*)(*va + (__i686_mpentry_params - __i686_mpentry_start));
+}
+
+static struct cpu* allocate_cpu(u_intptr_t id, u_int8_t apicid){
+	struct cpu* cpu;
+	struct cpu* boot = kernel_get_current_cpu();
+	struct kernslice* slice;
+	
+	cpu = kmalloc(sizeof(struct cpu));
+	if(!cpu) return 0;
+	memset(cpu,0,sizeof(struct cpu));
+	cpu->cpu_arch = kmalloc(sizeof(struct cpu_arch));
+	if(!cpu->cpu_arch){
+		kfree(cpu);
+		return 0;
+	}
+	memset(cpu->cpu_arch,0,sizeof(struct cpu_arch));
+	
+	/* The CPU takes it's memory from it's NUMA domain, if that has any. */
+	slice = _i686_numa_slice(apicid);
+	if( (!slice) || (!slice->ks_memory_allocator) ) slice = boot->cpu_kernel_slice;
+	
+	cpu->cpu_cpu_id = id;
+	cpu->cpu_kernel_slice = slice;
+	cpu->cpu_arch->apicid = apicid;
+	cpu->CPU_LOCAL_SELF = (u_intptr_t)cpu;
+	return cpu;
+}
+
+int hal_start_cpus(){
+	struct mpentry_params* params;
+	struct cpu* boot = kernel_get_current_cpu();
+	struct cpu* cpu;
+	u_intptr_t tva;
+	int tlen;
+	vaddr_t stack,size;
+	u_int32_t i,j,ncpu;
+	u_intptr_t next_id = 1;
+	int started = 1;
+	
+	if(!__i686_local_apic) return started;
+	if(!__i686_map_mmio((paddr_t)(u_intptr_t)__i686_local_apic)) return started;
+	__i686_lapicinit_bsp();
+	boot->cpu_arch->apicid = __i686_cpu_apics[__i686_boot_cpu];
+	boot->cpu_arch->lapic  = 1;
+	
+	/*
+	 * The local APIC timer replaces the PIT as the tick of the boot CPU. The PIT
+	 * keeps running for __i686_microdelay(). Without a calibrated timer, the other
+	 * CPUs would have no tick at all, so they are not started.
+	 */
+	if(!__i686_lapic_calibrate()) return started;
+	if(__i686_lapic_clock_event(&(boot->cpu_arch->lapic_ce))){
+		__i686_picdisable(IRQ_TIMER);
+		boot->cpu_clock_event = &(boot->cpu_arch->lapic_ce);
+	}
+	
+	if(__i686_ncpu < 2) return started;
+	
+	params = install_trampoline(&tva,&tlen);
+	if(!params) return started;
+	
+	/* __i686_mp_addcpu() keeps counting CPUs it has no APIC id slot for. */
+	ncpu = __i686_ncpu;
+	if(ncpu > sizeof(__i686_cpu_apics)) ncpu = sizeof(__i686_cpu_apics);
+	
+	for(i=0;i<ncpu;++i){
+		if(i == __i686_boot_cpu) continue;
+	
+		/*
+		 * Allocate the stack first: kernel_cpu_prepare() can't be undone, so
+		 * nothing may fail after it.
+		 */
+		size = AP_STACK_SIZE;
+		if(!vm_kalloc_ll(&stack,&size)) break;
+		cpu = allocate_cpu(next_id,__i686_cpu_apics[i]);
+		if(!cpu){
+			vm_kfree_ll(stack);
+			break;
+		}
+		kernel_cpu_prepare(cpu);
+	
+		params->pgdir = MPENTRY_PGDIR;
+		params->stack = stack+size;
+		params->func  = (u_int32_t)(u_intptr_t)_i686_ap_entry;
+		params->arg   = (u_int32_t)(u_intptr_t)cpu;
+		ap_started = 0;
+	
+		/*
+		 * No TLB shootdown may happen, until the AP is on the CPU list. Otherwise
+		 * it would miss it. The AP is counted even if it doesn't come up in time,
+		 * as it might still start later.
+		 */
+		__i686_tlb_block();
+		__i686_tlb_add_cpu();
+		__i686_lapicstartap(__i686_cpu_apics[i],MPENTRY_ADDR);
+	
+		/* Wait up to one second. */
+		for(j=0;j<1000 && !ap_started;++j)
+			__i686_microdelay(1000);
+	
+		/*
+		 * A CPU that did not come up might still start later, so neither it's
+		 * structures nor the trampoline can be reused. Give up here.
+		 */
+		if(!ap_started){
+			__i686_tlb_unblock();
+			break;
+		}
+		ktime_sync_boot();
+	
+		cpu->cpu_ks_next = cpu->cpu_kernel_slice->ks_cpu_list;
+		cpu->cpu_kernel_slice->ks_cpu_list = cpu;
+		__i686_tlb_unblock();
+		next_id++;
+		started++;
+	}
+	
+	__i686_mp_unmap_range(tva,tlen);
+	return started;
+}
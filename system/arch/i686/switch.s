@@ -70,6 +70,7 @@ __i686_initthread:
 	popl %edx
 	sti
 	call *%edx # Call 2nd(3rd)
+	call thread_exit
 2:
 	hlt
 	jmp 2
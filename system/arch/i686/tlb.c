@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <sysarch/hal.h>
+#include <sys/cpu.h>
+#include <sys/kernslice.h>
+#include <sys/kspinlock.h>
+#include <vm/tlb_cache.h>
+#include <x86/cpu_arch.h>
+#include <x86/x86.h>
+#include <x86/traps.h>
+
+/*
+ * Cross-CPU TLB shootdown for the kernel's page-mappings.
+ *
+ * One CPU at a time (the holder of 'tlb_lock') publishes a range, sets the
+ * 'tlb_flush' flag of every other online CPU and interrupts it. Each of them
+ * flushes the range and acknowledges by decrementing 'tlb_pending'. A CPU that
+ * spins for 'tlb_lock' serves it's own flag meanwhile, so two CPUs starting a
+ * shootdown with interrupts disabled can't wait for each other.
+ */
+
+/* Ranges of more pages than that are flushed entirely. */
+#define TLB_RANGE_MAX  64
+
+/* The local CPU structure pointer. */
+extern struct cpu *cpu_ptr asm("%gs:0");
+
+void __i686_lapicipi(u_int8_t apicid, int self, int vector);
+
+static kspinlock_t tlb_lock;
+static vaddr_t tlb_begin,tlb_end;
+static u_int32_t tlb_pending;
+
+/* The number of CPUs, that might hold kernel mappings in their TLB. */
+static u_int32_t tlb_ncpu = 1;
+
+static void tlb_flush_local(vaddr_t begin, vaddr_t end){
+	if(((end-begin)>>12) >= TLB_RANGE_MAX)
+		mmu_tlb_flush_all();
+	else
+		mmu_tlb_flush_range(begin,end);
+}
+
+/*
+ * Performs the flush, this CPU has been asked for, if any. Must be called with
+ * interrupts disabled.
+ */
+static void tlb_serve(){
+	struct cpu_arch *cpu_arch = cpu_ptr->cpu_arch;
+	if(!__atomic_exchange_n(&(cpu_arch->tlb_flush),0,__ATOMIC_ACQUIRE)) return;
+	tlb_flush_local(tlb_begin,tlb_end);
+	__atomic_sub_fetch(&tlb_pending,1,__ATOMIC_RELEASE);
+}
+
+static void tlb_lock_acquire(){
+	while(kernlock_try_lock(&tlb_lock))
+		tlb_serve();
+}
+
+/*
+ * The handler of the T_IRQ0+IRQ_TLB interrupt.
+ */
+void __i686_tlb_ipi(){
+	tlb_serve();
+}
+
+/*
+ * Keeps other CPUs from starting a shootdown, while hal_start_cpus() brings up
+ * an AP, that isn't on it's kernel slice's CPU list yet.
+ */
+void __i686_tlb_block(){
+	u_int32_t eflags = readeflags();
+	cli();
+	tlb_lock_acquire();
+	if(eflags & FL_IF) sti();
+}
+	
+void __i686_tlb_unblock(){
+	kernlock_unlock(&tlb_lock);
+}
+	
+/*
+ * Counts an AP, that is about to be started. Call it between __i686_tlb_block()
+ * and __i686_tlb_unblock().
+ */
+void __i686_tlb_add_cpu(){
+	__atomic_add_fetch(&tlb_ncpu,1,__ATOMIC_RELAXED);
+}
+	
+void hal_tlb_shootdown(u_intptr_t begin, u_intptr_t end){
+	u_int32_t eflags;
+	u_int32_t i,n;
+	struct cpu* self;
+	struct cpu* cpu;
+	
+	/* Nothing to shoot down, as long as the APs are not started. */
+	if(__atomic_load_n(&tlb_ncpu,__ATOMIC_RELAXED) < 2){
+		tlb_flush_local(begin,end);
+		return;
+	}
+	
+	/* Stay on this CPU, while the others are waited for. */
+	eflags = readeflags();
+	cli();
+	tlb_lock_acquire();
+	self = cpu_ptr;
+	
+	tlb_begin = begin;
+	tlb_end   = end;
+	for(i=0,n=kernslice_count();i<n;++i){
+		for(cpu = kernslice_get(i)->ks_cpu_list; cpu; cpu = cpu->cpu_ks_next){
+			if( (cpu == self) || (!cpu->cpu_arch) || (!cpu->cpu_arch->lapic) ) continue;
+			/* Count the CPU first, it might see the flag before the IPI. */
+			__atomic_add_fetch(&tlb_pending,1,__ATOMIC_RELAXED);
+			__atomic_store_n(&(cpu->cpu_arch->tlb_flush),1,__ATOMIC_RELEASE);
+			__i686_lapicipi(cpu->cpu_arch->apicid,0,T_IRQ0+IRQ_TLB);
+		}
+	}
+	
+	tlb_flush_local(begin,end);
+	while(__atomic_load_n(&tlb_pending,__ATOMIC_ACQUIRE))
+		;
+	
+	kernlock_unlock(&tlb_lock);
+	if(eflags & FL_IF) sti();
+}
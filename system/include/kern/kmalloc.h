@@ -0,0 +1,47 @@
+/*
+ * 
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+#include <machine/types.h>
+#include <machine/stdtypes.h>
+
+/*
+ * A general-purpose allocator for variable sized memory. Small requests are served
+ * from a set of zones ("size classes"), large requests go to vm_kalloc_ll().
+ */
+
+/* Requests larger than this are served by the page-level allocator. */
+#define KMALLOC_MAX_SMALL  1984
+
+void kmalloc_init();
+
+/* Allocates 'size' bytes. Returns 0 on failure. */
+void* kmalloc(size_t size);
+
+/* Frees memory, that was returned by kmalloc(). */
+void  kfree(void* ptr);
+
+/*
+ * Boot-time check: Allocates, touches and frees buffers of one page and more, so a
+ * broken large allocation path panics right away. Called after kmalloc_init().
+ */
+void kmalloc_check();
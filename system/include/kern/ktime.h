@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+
+#include <machine/types.h>
+
+/*
+ * Monotonic kernel time, in nanoseconds since ktime_init(). It is derived from the
+ * clocksource of the HAL (sys/clocksource.h). The counters of the other CPUs are
+ * corrected by a per-CPU offset, so that all CPUs share the boot CPU's time.
+ */
+
+/*
+ * Calibrates the clocksource and sets up the conversion. Must be called on the
+ * boot CPU, before any other ktime function.
+ */
+void ktime_init();
+
+/*
+ * Returns the clocksource counter of the current CPU, corrected to the boot CPU.
+ * Cheaper than ktime_get_ns(), for measuring short intervals.
+ */
+u_int64_t ktime_cycles();
+
+/*
+ * Converts a number of cycles into nanoseconds.
+ */
+u_int64_t ktime_cycles_to_ns(u_int64_t cycles);
+
+/*
+ * Returns the current time in nanoseconds.
+ */
+u_int64_t ktime_get_ns();
+
+/*
+ * Measures the offset of the current CPU's counter against the boot CPU, which
+ * calls ktime_sync_boot() at the same time. Called by the HAL on a started CPU,
+ * before it enters kernel_ap_main().
+ */
+void ktime_sync_cpu();
+
+/*
+ * The boot CPU's side of ktime_sync_cpu().
+ */
+void ktime_sync_boot();
@@ -28,18 +28,32 @@
 
 #define SCHED_NRQS 32
 
+/* Number of preemptions between two balancing passes of a CPU. */
+#define SCHED_BALANCE_INTERVAL 64
+
+/* A CPU pulls a thread, if the busiest CPU has this many threads more than itself. */
+#define SCHED_IMBALANCE 2
+
 struct thread;
 struct cpu;
 
 struct scheduler{
 	linked_ring_s       sched_run_ring[SCHED_NRQS];   /* one queue for each priority */
-	signed int          sched_run_decay[SCHED_NRQS];  /* one decay value for each priority */
+	u_int32_t           sched_run_deadline[SCHED_NRQS]; /* tick, when the decay value reaches 0 */
+	u_int32_t           sched_run_bits;               /* bit (i) set: sched_run_ring[i] is non-empty */
+	u_int32_t           sched_tick;                   /* number of scheduling decisions */
 	struct thread*      sched_idle;                   /* idle thread */
 	
 	linked_ring_s       sched_blocked;                /* A 'queue' for blocked/suspended threads. */
 	
 	u_intptr_t          sched_thread_count;           /* Number of threads on this core. */
 	
+	u_int32_t           sched_preempts;               /* Preemptions since the last balancing pass. */
+	u_intptr_t          sched_migrated_in;            /* Threads pulled from other CPUs. */
+	u_intptr_t          sched_migrated_out;           /* Threads pulled away by other CPUs. */
+	
+	u_int32_t           sched_tick_mode;              /* TICK_* mode of the CPU (kern/tick.h). */
+	
 	kspinlock_t         sched_lock;                   /* lock for all the fields */
 };
 
@@ -70,3 +84,27 @@ void sched_actualize(struct thread* thread);
  */
 void sched_preempt();
 
+/*
+ * Returns the CPU, a new thread should be placed on: the least loaded CPU of the
+ * current CPU's kernel slice, unless another CPU has significantly less threads.
+ */
+struct cpu* sched_select_cpu();
+
+/*
+ * Pulls one runnable thread from the busiest CPU, preferably from the same kernel
+ * slice, if it has SCHED_IMBALANCE threads more than 'cpu'. This is called by the
+ * idle loop, and periodically by sched_preempt(). Returns 0 if nothing was pulled.
+ */
+int sched_balance(struct cpu* cpu);
+
+/*
+ * Prints the number of threads and migrations of every CPU.
+ */
+void sched_print_stats();
+
+/*
+ * Measures the cost of selecting the next thread and reenqueueing the previous one,
+ * with 1, 8 and 32 populated priorities, and prints the results. main() runs it at
+ * boot, if the kernel was built with KERN_BENCHMARK.
+ */
+void sched_benchmark();
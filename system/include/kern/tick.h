@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+
+#include <machine/types.h>
+
+struct cpu;
+struct thread;
+
+/* Length of a periodic tick (50 Hz). */
+#define TICK_US 20000
+
+/*
+ * Tick modes. A CPU with more than one runnable thread ticks periodically. With a
+ * single runnable thread, the tick is stretched to the next timer expiry, and an
+ * idle CPU without timers doesn't tick at all.
+ */
+#define TICK_PERIODIC  0
+#define TICK_STRETCHED 1
+#define TICK_STOPPED   2
+
+/*
+ * Starts the periodic tick on the current CPU. Must be called before interrupts are
+ * enabled. Without a clock event, the HAL provides the tick by other means.
+ */
+void tick_start(struct cpu* cpu);
+
+/*
+ * Returns the tick mode for 'cpu', when 'next' runs next. Called by the scheduler,
+ * under its lock.
+ */
+u_int32_t tick_select_mode(struct cpu* cpu, struct thread* next);
+
+/*
+ * Programs the clock event of the current CPU for the given mode. Called with
+ * interrupts disabled.
+ */
+void tick_program(struct cpu* cpu, u_int32_t mode);
+
+/*
+ * A thread became runnable on 'cpu'. If the CPU isn't ticking periodically, it is
+ * interrupted, so that it reevaluates its run-queue.
+ */
+void tick_wakeup(struct cpu* cpu);
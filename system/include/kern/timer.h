@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+
+#include <machine/types.h>
+#include <kern/ring.h>
+
+struct cpu;
+struct timer_wheel;
+
+/* Expiry of a CPU without pending timers. */
+#define TIMER_NEVER (~((u_int64_t)0))
+
+/*
+ * A timer calls 'tm_func' once, after its expiry time has passed. Each CPU has a
+ * wheel of timers, which is processed by sched_preempt(), so the function runs in
+ * the timer interrupt, with interrupts disabled. It may wake threads up and add
+ * timers, but must not block.
+ */
+struct timer{
+	linked_ring_s       tm_entry;    /* Entry in a slot of the wheel. */
+	u_int64_t           tm_expires;  /* Expiry time, in ktime nanoseconds. */
+	void              (*tm_func)(struct timer* timer);
+	void*               tm_arg;
+	struct timer_wheel* tm_wheel;    /* The wheel, the timer has been added to. */
+	u_int16_t           tm_level;    /* Position within the wheel (private). */
+	u_int16_t           tm_slot;
+};
+
+/*
+ * Allocates and initializes the timer wheel of a CPU. Must be called after
+ * ktime_init().
+ */
+void timer_wheel_init(struct cpu* cpu);
+
+void timer_init(struct timer* timer, void (*func)(struct timer* timer), void* arg);
+
+/*
+ * Adds a timer, which is not pending, to the current CPU, to expire at the ktime
+ * 'expires' (in nanoseconds). This is O(1).
+ */
+void timer_add(struct timer* timer, u_int64_t expires);
+
+/*
+ * Removes a pending timer. This is O(1). Returns 1, if the timer was pending, or
+ * 0, if it has already expired, in which case its function has returned, once
+ * timer_cancel() returns. Must not be called from the timer's own function.
+ */
+int timer_cancel(struct timer* timer);
+
+/*
+ * Calls the functions of all expired timers of the current CPU. Called from
+ * sched_preempt().
+ */
+void timer_run(struct cpu* cpu);
+
+/*
+ * Returns the earliest expiry time of the timers of 'cpu', or TIMER_NEVER. The
+ * result may be earlier than the actual expiry, but never later.
+ */
+u_int64_t timer_next_expiry(struct cpu* cpu);
@@ -21,8 +21,16 @@
  * SOFTWARE.
  */
 #pragma once
+#include <machine/types.h>
 #include <sys/kspinlock.h>
 
 struct wait_queue;
 
 void waitqueue_wait(kspinlock_t* lock,struct wait_queue* queue,int after);
+
+/*
+ * Like waitqueue_wait(), but gives up after 'ns' nanoseconds. Returns 1, if the
+ * thread has been removed from the queue by waitqueue_get_first(), or 0, if the
+ * time ran out.
+ */
+int waitqueue_wait_timeout(kspinlock_t* lock,struct wait_queue* queue,int after,u_int64_t ns);
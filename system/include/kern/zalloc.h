@@ -36,6 +36,11 @@ typedef struct zone *zone_t;
 
 #define ZONE_AUTO_REFILL   1
 #define ZONE_AR_CRITICAL   2
+#define ZONE_NOCACHE       4  /* Bypass the per-CPU magazine layer. */
+#define ZONE_LOCKFREE      8  /* Keep freed objects on a lock-free stack. The zone never shrinks. */
+#define ZONE_SIZECLASS    16  /* The size is a size class: Round it to 16 bytes only. */
+
+struct cpu;
 
 
 void zone_bootstrap();
@@ -43,12 +48,47 @@ void zone_bootstrap();
 /* Initialize a zone. */
 zone_t zinit(size_t size, unsigned int memtype, const char* name);
 
+typedef void (*zone_ctor_t)(void* obj);
+typedef void (*zone_dtor_t)(void* obj);
+
+/*
+ * Initialize a zone with an object constructor and destructor.
+ *
+ * The constructor is called once for every object, when the zone obtains new memory.
+ * The destructor is called, before that memory is given back by zgc(). In between,
+ * objects keep their constructed state: zalloc() returns a constructed object, and
+ * objects must be passed to zfree() in their constructed state.
+ *
+ * The constructor is called with the zone lock held. It must not allocate from the
+ * same zone.
+ */
+zone_t zinit_ctor(size_t size, unsigned int memtype, const char* name,
+		zone_ctor_t ctor, zone_dtor_t dtor);
+
+/*
+ * Destroys an uncached zone (ZONE_NOCACHE), and gives its memory back. All objects
+ * must have been freed, and nobody may use the zone any more. May block.
+ */
+void zdestroy(zone_t zone);
+
 /* Allocate an object from a zone. */
 void*  zalloc(zone_t zone);
 
 /* Free an object, that was allocated from a zone. */
 void   zfree(void* object);
 
+/*
+ * Allocates up to 'n' objects from a zone into 'out', taking the zone lock only once.
+ * Returns the number of objects allocated. The per-CPU magazines are bypassed.
+ */
+u_int32_t zalloc_bulk(zone_t zone, u_int32_t n, void** out);
+
+/*
+ * Frees 'n' objects. Null pointers are skipped. Consecutive objects of the same
+ * zone are freed under a single lock acquisition.
+ */
+void   zfree_bulk(void** objs, u_int32_t n);
+
 /* Cram new memory into the zone. */
 void   zcram(zone_t zone, void* mem, size_t size);
 
@@ -59,5 +99,89 @@ u_int32_t zcount(zone_t zone);
 
 size_t zbufsize(zone_t zone);
 
+/*
+ * Synchronously adds at least 'num' objects, if less than 'min' objects are free.
+ */
 void zrefill(zone_t zone, u_int32_t min, u_int32_t num);
 
+/*
+ * Sets the watermarks of an auto-refilled zone (ZONE_AUTO_REFILL). If fewer than
+ * 'low' objects are free, the zone is refilled up to 'high' by the refill thread.
+ * If fewer than 'minimum' objects are free, zalloc() refills the zone itself.
+ */
+void zone_set_watermarks(zone_t zone, u_int32_t minimum, u_int32_t low, u_int32_t high);
+
+/*
+ * Starts the zone refill thread on the current CPU.
+ */
+void zone_refill_start();
+
+/*
+ * Attaches a per-CPU magazine cache to the given CPU. Must be called on every CPU
+ * before it uses the zone allocator. The boot CPU is set up by 'zone_bootstrap()'.
+ */
+void zone_cpu_init(struct cpu* cpu);
+
+/*
+ * Retrieves the magazine layer statistics of a zone, summed over all CPUs.
+ * 'hits' counts operations served by a CPU's magazines without touching the zone,
+ * 'misses' counts operations, that had to go to the depot or to the free list.
+ */
+void zcachestats(zone_t zone, u_int64_t* hits, u_int64_t* misses);
+
+/*
+ * A snapshot of a zone's statistics.
+ */
+struct zone_info {
+	const char* zi_name;
+	size_t      zi_objsize;       /* Requested object size. */
+	size_t      zi_bufsize;       /* Object size, as rounded by the zone. */
+	u_int32_t   zi_free;          /* Free objects in the slabs and the lock-free stack. */
+	u_int32_t   zi_inuse;         /* Objects taken from the slabs, and not freed. */
+	u_int32_t   zi_lf_free;       /* Free objects on the lock-free stack. */
+	u_int32_t   zi_peak_inuse;
+	u_int32_t   zi_slabs;
+	u_int32_t   zi_slabs_empty;
+	u_int64_t   zi_allocs;
+	u_int64_t   zi_frees;
+	u_int32_t   zi_refills;
+	u_int32_t   zi_refill_fails;
+	u_int32_t   zi_lock_spins;    /* Spin iterations on the zone lock. */
+	size_t      zi_wasted;        /* Bytes lost due to rounding of the object size. */
+	u_int64_t   zi_cache_hits;    /* See zcachestats(). */
+	u_int64_t   zi_cache_misses;
+};
+
+/*
+ * Retrieves the statistics of a zone.
+ */
+void zone_info(zone_t zone, struct zone_info* info);
+
+/*
+ * Prints the statistics of all zones onto the kernel terminal.
+ */
+void zprint();
+
+/*
+ * Measures zalloc() and zfree() from one thread per CPU at once, on a ZONE_LOCKFREE
+ * zone and on a locked zone, and prints the results. Needs the other CPUs running.
+ */
+void zalloc_benchmark(u_int32_t ncpus);
+
+
+/*
+ * Returns the empty slabs of all zones to the kernel, and flushes the magazine
+ * depots. Zones, that are busy, are skipped. Must not be called with a zone lock held.
+ */
+void zgc();
+
+/*
+ * Requests a zgc() run. This is called under memory pressure, where zgc() itself
+ * can't be called. The run is done by the next call to zgc_consider().
+ */
+void zgc_request();
+
+/*
+ * Runs zgc(), if it had been requested. Called from a context without locks held.
+ */
+void zgc_consider();
@@ -23,6 +23,9 @@
 #pragma once
 #include <kern/zalloc.h>
 #include <sys/kspinlock.h>
+#include <sysarch/pages.h>
+#include <utils/list.h>
+#include <sysarch/atomic.h>
 /*
  * A zone is a collection of fixed size memory buffers, that can be allocated
  * efficiently. All buffers have the same size, as the same type is assumed.
@@ -31,12 +34,146 @@
  * This code is largely inspired by the MACH operating system by the CMU.
  */
 
+/*
+ * The per-CPU caching layer is modeled after Bonwick's magazines ("Magazines and
+ * Vmem", USENIX 2001): Every CPU holds a 'loaded' and a 'previous' magazine for
+ * each zone. Objects are allocated from and freed into these magazines without
+ * touching any shared state. Only if both magazines are empty (or full), the CPU
+ * exchanges a magazine with the zone's depot, which is protected by 'zn_lock'.
+ */
+#define ZMAG_ROUNDS      16   /* Number of objects a magazine can hold. */
+#define ZONE_NCPUCACHE   64   /* Maximum number of zones, that can be cached. */
+
+struct zmag {
+	struct zmag* zm_next;     /* Next magazine in the depot. */
+	u_int32_t    zm_rounds;   /* Number of objects in the magazine. */
+	void*        zm_objs[ZMAG_ROUNDS];
+};
+
+struct zone_cpu {
+	struct zmag* zc_loaded;   /* The magazine, we allocate from/free into. */
+	struct zmag* zc_previous; /* The previously loaded magazine. Either full or empty. */
+	u_int32_t    zc_hits;     /* Operations served by the magazines. */
+	u_int32_t    zc_misses;   /* Operations, that had to go to the zone. */
+	u_int32_t    zc_allocs;   /* Objects allocated from the magazines. */
+	u_int32_t    zc_frees;    /* Objects freed into the magazines. */
+};
+
+/* Per-CPU part of the zone allocator, hung off 'struct cpu'. */
+struct zone_cpu_cache {
+	struct zone_cpu_cache* zcc_next; /* All caches, for statistics. */
+	struct zone_cpu        zcc_zones[ZONE_NCPUCACHE];
+};
+
+/*
+ * The backing store of a zone is a set of slabs. A slab is a single page, that is
+ * carved into objects. The slab descriptor lives at the end of the page, so the
+ * slab of an object is found by masking its address; no per-object header is needed.
+ * A slab, whose objects are all free, can be returned to the kernel by zgc().
+ */
+struct zslab {
+	list_node_s  zs_link;     /* Entry in one of the zone's slab lists. */
+	zone_t       zs_zone;
+	void*        zs_freelist; /* A 'Linked Stack' of free objects in this slab. */
+	u_int16_t    zs_free;     /* Number of free objects. */
+	u_int16_t    zs_total;    /* Number of objects. */
+	u_int16_t    zs_flags;
+	u_int16_t    zs_magic;
+};
+
+/*
+ * Zones with ZONE_LOCKFREE put a lock-free 'Linked Stack' (a Treiber stack) in front
+ * of their slabs: zfree() pushes onto it and zalloc() pops from it without taking
+ * 'zn_lock'. The head carries a generation count, and both are swapped at once with
+ * a 64-bit compare-and-swap, so a pop can't succeed on a top, that was popped and
+ * pushed again in the meantime (ABA).
+ *
+ * A pop reads the link of an object, that may have been popped by another CPU right
+ * before. So the slabs of such a zone are never given back to the kernel.
+ */
+union zlf_head {
+	struct {
+		void*        zh_top;
+		u_int32_t    zh_gen;
+	};
+	u_int64_t        zh_raw;
+} __attribute__((aligned(8)));
+
+#define ZSLAB_STATIC   1      /* The slab was crammed into the zone. Never free it. */
+#define ZSLAB_MAGIC    0x51AB
+
+#define ZSLAB_USABLE   (SYSARCH_PAGESIZE - sizeof(struct zslab))
+#define ZSLAB_PAGE(obj) ( ((u_intptr_t)(obj)) & ~((u_intptr_t)(SYSARCH_PAGESIZE-1)) )
+#define ZSLAB_OF(obj)   ( (struct zslab*)(ZSLAB_PAGE(obj) + ZSLAB_USABLE) )
+
+/*
+ * Default watermarks of auto-refilled zones. Below the low watermark, the zone gets
+ * queued for the refill thread, which tops it up to the high watermark. Only below
+ * the hard minimum, zalloc() refills the zone synchronously.
+ */
+#define ZONE_WM_MIN    8
+#define ZONE_WM_LOW    32
+#define ZONE_WM_HIGH   64
+
+#define ZONE_REFILL_PRIORITY 4
+
 struct zone {
+	size_t       zn_objsize;  /* The requested size of elements. */
 	size_t       zn_bufsize;  /* The buffer size of elements. */
-	void*        zn_freelist; /* A 'Linked Stack' of free objects. */
 	const char*  zn_name;
-	u_int32_t    zn_count;    /* Number of free elements. */
+	u_int32_t    zn_count;    /* Number of free elements (in slabs). */
 	unsigned int zn_memtype;
+	int          zn_cpu_idx;  /* Index into 'zcc_zones', or -1 if not cached. */
+	zone_t       zn_next;     /* All zones. */
+	zone_ctor_t  zn_ctor;
+	zone_dtor_t  zn_dtor;
+	size_t       zn_link_off; /* Offset of the freelist link within a free object. */
+	
+	/* The slab layer. */
+	list_node_s  zn_slabs_partial; /* Slabs with free and used objects. */
+	list_node_s  zn_slabs_full;    /* Slabs without free objects. */
+	list_node_s  zn_slabs_empty;   /* Slabs without used objects. */
+	u_int32_t    zn_slab_objs;     /* Number of objects per slab. */
+	u_int32_t    zn_nslabs;
+	u_int32_t    zn_nslabs_empty;
+	
+	/*
+	 * Statistics of the slab layer, protected by 'zn_lock'. Objects, that are held
+	 * in magazines, count as in use. The magazine layer keeps it's own statistics.
+	 */
+	u_int32_t    zn_allocs;
+	u_int32_t    zn_frees;
+	u_int32_t    zn_refills;       /* Refills, that had to allocate memory. */
+	u_int32_t    zn_refill_fails;  /* Refills, that failed to allocate memory. */
+	u_int32_t    zn_inuse;
+	u_int32_t    zn_peak_inuse;
+	u_int32_t    zn_lock_spins;    /* Failed attempts to acquire 'zn_lock'. */
+	
+	/* Refill. */
+	u_int32_t    zn_minimum;       /* Hard minimum. */
+	u_int32_t    zn_lowat;         /* Low watermark. */
+	u_int32_t    zn_hiwat;         /* High watermark. */
+	int          zn_refill_queued; /* Queued for the refill thread. */
+	void*        zn_refiller;      /* The thread, that is refilling the zone. */
+	kspinlock_t  zn_refill_lock;   /* Serializes refills. */
+	
+	/*
+	 * The lock-free stack (ZONE_LOCKFREE). It's statistics are updated atomically.
+	 * Objects on the stack still count as in use by the slab layer, zone_info()
+	 * moves them over to the free objects. 'zn_lf_count' is raised before a push
+	 * and lowered after a pop, so it never drops below the real count.
+	 */
+	union zlf_head zn_lf_head;
+	u_int32_t    zn_lf_count;      /* Objects on the stack. */
+	u_int32_t    zn_lf_allocs;     /* Objects popped by zalloc(). */
+	u_int32_t    zn_lf_frees;      /* Objects pushed by zfree(). */
+	
+	/* The magazine depot. */
+	struct zmag* zn_depot_full;   /* Linked stack of full magazines. */
+	struct zmag* zn_depot_empty;  /* Linked stack of empty magazines. */
+	u_int32_t    zn_depot_nfull;
+	u_int32_t    zn_depot_nempty;
+	
 	kspinlock_t  zn_lock;
 };
 
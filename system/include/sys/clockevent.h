@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+
+#include <machine/types.h>
+
+/* Capabilities of a clock event device. */
+#define CLOCK_EVENT_PERIODIC  0x1
+#define CLOCK_EVENT_ONESHOT   0x2
+
+/*
+ * A per-CPU timer, that raises the CPU's timer interrupt. It is provided by the HAL
+ * (in 'cpu->cpu_clock_event'), and programmed by the tick code (kern/tick.h).
+ * The operations must be called on the CPU, the device belongs to, with interrupts
+ * disabled. Times are in microseconds.
+ */
+struct clock_event{
+	const char* ce_name;
+	u_int32_t   ce_features;  /* CLOCK_EVENT_* */
+	u_int32_t   ce_max_us;    /* Longest possible one-shot delay. */
+	u_int32_t   ce_mode;      /* Current TICK_* mode, maintained by the tick code. */
+	
+	/* Interrupts every 'us' microseconds. */
+	void (*ce_periodic)(struct clock_event* ce, u_int32_t us);
+	
+	/* Interrupts once, after 'us' microseconds. */
+	void (*ce_oneshot)(struct clock_event* ce, u_int32_t us);
+	
+	/* Stops the timer. */
+	void (*ce_stop)(struct clock_event* ce);
+};
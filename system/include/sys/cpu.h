@@ -31,6 +31,18 @@ struct cpu_arch;
 /* Scheduler's run_queue. */
 struct scheduler;
 
+/* Per-CPU magazines of the zone allocator. */
+struct zone_cpu_cache;
+
+/* Per-CPU free page list of the physical allocator. */
+struct physmem_cpu_cache;
+
+/* Per-CPU timer. */
+struct clock_event;
+
+/* Per-CPU timer wheel. */
+struct timer_wheel;
+
 struct cpu{
 	u_intptr_t        cpu_cpu_id;         /* The ID of this CPU. */
 	struct kernslice* cpu_kernel_slice;   /* The kernel slice, this CPU belongs to. */
@@ -42,6 +54,12 @@ struct cpu{
 	struct cpu_arch*  cpu_arch;           /* Architecture specific part */
 	
 	struct scheduler* cpu_scheduler;      /* CPU scheduler. */
+	
+	struct zone_cpu_cache* cpu_zone_cache; /* Zone allocator magazines. */
+	struct physmem_cpu_cache* cpu_page_cache; /* Free page list. */
+	struct clock_event* cpu_clock_event;  /* Timer for the tick, or 0 if the HAL ticks otherwise. */
+	struct timer_wheel* cpu_timer_wheel;  /* Pending timers (kern/timer.h). */
+	u_int64_t         cpu_cycles_offset;  /* Added to hal_cycles(), to get the boot CPU's count. */
 };
 
 #define CPU_LOCAL_SELF   cpu_local[0]   /* struct cpu-instance. */
@@ -30,6 +30,17 @@
 
 struct cpu;
 struct physmem_bmaset;
+struct vm_page;
+
+/* Size of the pool of pre-zeroed pages. */
+#define KS_ZERO_POOL 64
+
+/* Maximum number of kernel slices. */
+#define KS_MAX_SLICES 8
+
+/* NUMA distances, as in the ACPI SLIT. */
+#define KS_DISTANCE_LOCAL  10
+#define KS_DISTANCE_REMOTE 20
 
 /*
  * A kernel Slice represent a Set of CPUs and resources, that belong together.
@@ -60,5 +71,47 @@ struct kernslice{
 	
 	u_intptr_t             ks_memory_free_count;
 	u_intptr_t             ks_memory_fic_count;
+	
+	/* vm_page structures of all page frames, indexed by (PFN - ks_page_pfn). */
+	struct vm_page*        ks_page_array;
+	paddr_t                ks_page_pfn;           /* First page frame number in the array. */
+	paddr_t                ks_page_count;         /* Length of the array. */
+	
+	/* Pre-zeroed pages, filled by the idle thread. */
+	kspinlock_t            ks_zero_lock;
+	u_int32_t              ks_zero_count;
+	u_int32_t              ks_zero_hits;
+	u_int32_t              ks_zero_misses;
+	paddr_t                ks_zero_pages[KS_ZERO_POOL];
+	
+	/* NUMA. */
+	u_int32_t              ks_index;              /* Index in the table of kernel slices. */
+	u_int8_t               ks_distance[KS_MAX_SLICES]; /* Distance to the other slices (by index). */
+	u_int32_t              ks_numa_hits;          /* Pages served here, as requested. */
+	u_int32_t              ks_numa_misses;        /* Requests for this slice, it couldn't serve. */
+	u_int32_t              ks_numa_fallbacks;     /* Pages served here, for another slice. */
 };
 
+/*
+ * Adds a kernel slice to the table of kernel slices. The distance to all other
+ * slices is initialized to KS_DISTANCE_REMOTE. Returns 0 if the table is full.
+ */
+int kernslice_register(struct kernslice* slice);
+
+/*
+ * Returns the number of kernel slices, and the slice at a given index.
+ */
+u_int32_t kernslice_count();
+struct kernslice* kernslice_get(u_int32_t idx);
+
+/*
+ * Gets or sets the NUMA distance between two kernel slices.
+ */
+u_int32_t kernslice_distance(struct kernslice* from, struct kernslice* to);
+void kernslice_set_distance(struct kernslice* from, struct kernslice* to, u_int32_t distance);
+
+/*
+ * Returns the kernel slice, a physical address belongs to, or 0 if there is none.
+ */
+struct kernslice* kernslice_find(paddr_t addr);
+
@@ -25,13 +25,34 @@
 #include <sys/physmem.h>
 #include <sys/kspinlock.h>
 
+/* The largest buddy block has 1<<PMB_MAX_ORDER pages (4 MiB on i686). */
+#define PMB_MAX_ORDER  10
+#define PMB_NORDERS    (PMB_MAX_ORDER+1)
+
 /*
  * A page-allocation-Bitmap.
+ *
+ * On top of the bitmap, every range runs a binary buddy allocator. Blocks of order
+ * 'k' are 1<<k pages large, and aligned to their size in the physical address space.
+ * Instead of linked free lists (the free pages are not mapped), the free blocks of
+ * each order are kept in a bitmap, with bit 'i' representing the block
+ * '(pmb_pfn>>k)+i'. Only whole free blocks, whose buddy is not free, are marked.
+ *
+ * Each free bitmap has a summary bitmap with one bit per word, that is set, if the
+ * word has any free block. A search starts at the word, where the last one ended
+ * (next-fit), and skips 32 empty words per summary word.
  */
 struct physmem_bmalloc {
 	struct physmem_range  pmb_range;
-	u_int32_t*            pmb_bitmap;
-	paddr_t               pmb_length;
+	u_int32_t*            pmb_bitmap;                    /* Allocated pages. */
+	u_int32_t*            pmb_cached;                    /* Allocated pages on a per-CPU list. */
+	paddr_t               pmb_length;                    /* Number of managed pages. */
+	paddr_t               pmb_pfn;                       /* First page frame number. */
+	u_int32_t*            pmb_free_map[PMB_NORDERS];     /* Free blocks, per order. */
+	u_int32_t             pmb_free_words[PMB_NORDERS];   /* Size of 'pmb_free_map[k]'. */
+	u_int32_t             pmb_free_count[PMB_NORDERS];   /* Free blocks, per order. */
+	u_int32_t*            pmb_free_summary[PMB_NORDERS]; /* Non-empty words of 'pmb_free_map[k]'. */
+	u_int32_t             pmb_free_hint[PMB_NORDERS];    /* Next-fit: Word to search first. */
 };
 
 struct physmem_bmaset {
@@ -40,10 +61,136 @@ struct physmem_bmaset {
 	kspinlock_t              pmb_lock;
 };
 
+/*
+ * Allocates a single page. Equivalent to 'vm_phys_alloc_order(pmas,0,res)'.
+ */
 int vm_phys_alloc(struct physmem_bmaset* pmas,paddr_t *res);
 
+/*
+ * Frees a single page. Equivalent to 'vm_phys_free_order(pmas,page,0)'.
+ */
 int vm_phys_free(struct physmem_bmaset* pmas,paddr_t page);
 
+/*
+ * Allocates 1<<order physically contiguous pages, aligned to their size.
+ */
+int vm_phys_alloc_order(struct physmem_bmaset* pmas,u_int32_t order,paddr_t *res);
+
+/*
+ * Frees a block, that was allocated using vm_phys_alloc_order() with the same order.
+ * The block is coalesced with its free buddies.
+ */
+int vm_phys_free_order(struct physmem_bmaset* pmas,paddr_t page,u_int32_t order);
+
+/*
+ * Allocates 'npages' physically contiguous pages, aligned to 'align' bytes (a power
+ * of two). The run is carved from a buddy block; the unused tail is freed again.
+ * At most 1<<PMB_MAX_ORDER pages can be allocated at once.
+ */
+int vm_phys_alloc_contig(struct physmem_bmaset* pmas,paddr_t npages,paddr_t align,paddr_t *res);
+
+/*
+ * Frees a run of pages, that was allocated using vm_phys_alloc_contig().
+ */
+int vm_phys_free_contig(struct physmem_bmaset* pmas,paddr_t page,paddr_t npages);
+
+/*
+ * Frees the pages [begin,begin+npages*PAGESIZE), which must all be allocated, and
+ * lie within one range.
+ */
+int vm_phys_free_range(struct physmem_bmaset* pmas,paddr_t begin,paddr_t npages);
+
+/*
+ * Allocates up to 'n' single pages into 'res', under a single lock hold.
+ * Returns the number of pages allocated.
+ */
+u_int32_t vm_phys_alloc_batch(struct physmem_bmaset* pmas,paddr_t *res,u_int32_t n);
+
+/*
+ * Frees 'n' single pages, under a single lock hold. The array is sorted in place.
+ * Runs of consecutive pages are freed as whole blocks.
+ */
+void vm_phys_free_batch(struct physmem_bmaset* pmas,paddr_t *pages,u_int32_t n);
+
+/*
+ * Every CPU keeps a small list of free pages in front of the allocator of it's
+ * kernel slice. vm_phys_alloc() and vm_phys_free() take and put single pages there,
+ * without locking. An empty list is refilled to 'pcc_low' pages, a list reaching
+ * 'pcc_high' pages is drained down to 'pcc_low', both in one batch.
+ */
+#define PCC_MAX_PAGES  64
+#define PCC_LOW        16
+#define PCC_HIGH       48
+
+struct physmem_cpu_cache {
+	struct physmem_bmaset* pcc_pmas;    /* The allocator, the pages belong to. */
+	u_int32_t              pcc_count;
+	u_int32_t              pcc_low;
+	u_int32_t              pcc_high;
+	u_int32_t              pcc_hits;    /* Served from the list. */
+	u_int32_t              pcc_misses;  /* Had to refill or drain the list. */
+	paddr_t                pcc_pages[PCC_MAX_PAGES];
+};
+
+struct cpu;
+
+/*
+ * Attaches a free page list to the given CPU. Must be called after the allocator of
+ * the CPU's kernel slice is set up.
+ */
+void vm_phys_cpu_init(struct cpu* cpu);
+
+/*
+ * Sets the batch tunables of a CPU's free page list. 'low' must be below 'high', and
+ * 'high' must not exceed PCC_MAX_PAGES. Returns 0 on invalid values.
+ */
+int vm_phys_cpu_tune(struct cpu* cpu,u_int32_t low,u_int32_t high);
+
+/*
+ * Internal: The per-CPU part of vm_phys_alloc() and vm_phys_free(). Return 0, if
+ * the request has to go to the allocator.
+ */
+int vm_phys_cpu_alloc(struct physmem_bmaset* pmas,paddr_t *res);
+int vm_phys_cpu_free(struct physmem_bmaset* pmas,paddr_t page);
+
+/*
+ * Retrieves the hit and miss counts of a CPU's free page list.
+ */
+void vm_phys_cpu_stats(struct cpu* cpu,u_int32_t* hits,u_int32_t* misses);
+
+/*
+ * Prints the free page list statistics of every CPU.
+ */
+void vm_phys_cpu_print();
+
+/*
+ * Internal: Marks an allocated page as being on a per-CPU list. Returns 0, if 'page'
+ * isn't a page-aligned address within one of the allocator's ranges, isn't
+ * allocated, or is on a list already (a double free). vm_phys_page_uncache() clears
+ * the mark again. The allocator refuses to free pages, that are marked.
+ */
+int  vm_phys_page_cache(struct physmem_bmaset* pmas,paddr_t page);
+void vm_phys_page_uncache(struct physmem_bmaset* pmas,paddr_t page);
+
+/*
+ * Returns the number of words, the buddy bitmaps and the 'pmb_cached' bitmap of a
+ * range need.
+ */
+paddr_t vm_phys_bm_buddywords(paddr_t pfn, paddr_t npages);
+
+/*
+ * Sets up the buddy allocator of a range, whose 'pmb_pfn', 'pmb_length' and zeroed
+ * 'pmb_bitmap' are set. The buddy bitmaps and 'pmb_cached' are taken from 'storage',
+ * and all pages are marked free. Returns the end of the used storage.
+ */
+u_int32_t* vm_phys_bm_buddyinit(struct physmem_bmalloc* pmbm, u_int32_t* storage);
+
+/*
+ * Measures vm_phys_alloc() and vm_phys_free() on a synthetic range, at different
+ * levels of occupancy, and prints the results.
+ */
+void vm_phys_benchmark();
+
 /*
  * 'vm_phys_bm_bootinit()' initializes a physical memory allocator, without actually
  * allocating any page of memory. This function is called even before initializing
@@ -57,3 +204,31 @@ int vm_phys_bm_bootinit(
 		struct physmem_bmaset** Pbma
 );
 
+/*
+ * Returns the number of bytes, vm_phys_bm_init() needs to manage the given ranges.
+ */
+paddr_t vm_phys_bm_bootsize(struct physmem_range *rng, u_intptr_t n_ranges);
+
+/*
+ * Initializes a physical memory allocator for all given ranges, taking the bitmaps
+ * and range descriptors from 'storage', which must hold vm_phys_bm_bootsize() bytes.
+ * Unlike vm_phys_bm_bootinit(), there is no limit on the size or number of ranges.
+ */
+int vm_phys_bm_init(
+		struct physmem_range *rng,
+		u_intptr_t n_ranges,
+		void* storage,
+		paddr_t size,
+		struct physmem_bmaset** Pbma
+);
+
+struct kernslice;
+
+/*
+ * The raw memory allocator hands out physical memory at boot, before there is any
+ * other allocator. It cuts pages from the front of the memory ranges of a slice,
+ * beginning with the range 'ks_raw_memory.range_idx', so that the allocators set
+ * up later never see them. Raw memory can't be freed.
+ */
+int vm_phys_raw_alloc(struct kernslice* slice, paddr_t npages, paddr_t *res);
+
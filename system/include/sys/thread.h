@@ -58,11 +58,27 @@ struct thread{
 #define THREAD_SF_PREEMPT         0x0002   /* If set, thread is preempted. */
 #define THREAD_SF_LOCK_SCHED      0x0004   /* If set, this thread is modifying the run-queue. */
 #define THREAD_SF_QUEUE_WAIT      0x0008   /* If set, thread may be on the wait-queue. */
+#define THREAD_SF_DEAD            0x0010   /* If set, thread has exited. */
 
 void thread_init();
 
 struct thread* thread_allocate();
 
+struct thread* thread_create_kernel(void (*func)(void*), void* arg, unsigned int priority);
+
+/*
+ * Terminates the current thread. It must not hold any lock, nor be on a wait-queue.
+ * The scheduler drops the thread, once it has switched away from it, and hands it
+ * to thread_release(); thread_allocate() reuses it, stacks included.
+ */
+void thread_exit();
+
+/*
+ * Internal: Called by the scheduler, with a thread, that has exited and will never
+ * run again.
+ */
+void thread_release(struct thread* thread);
+
 struct thread* kernel_get_current_thread();
 
 void kernel_set_current_thread(struct thread* thread);
@@ -71,3 +87,7 @@ void thread_enter_syscall();
 
 void thread_exit_syscall();
 
+/*
+ * Blocks the current thread for at least 'ns' nanoseconds.
+ */
+void thread_sleep(u_int64_t ns);
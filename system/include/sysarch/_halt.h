@@ -25,3 +25,5 @@
 
 /* Default HALT implementation. */
 inline static void arch_halt() { for(;;); }
+
+inline static void arch_wait() { }
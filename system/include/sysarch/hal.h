@@ -21,8 +21,11 @@
  * SOFTWARE.
  */
 #pragma once
+#include <machine/types.h>
 
 struct cpu;
+struct thread;
+struct clocksource;
 
 void hal_initcpu(struct cpu* cpu);
 
@@ -37,8 +40,43 @@ int hal_stack_grows_downward();
 
 void hal_induce_preemption();
 
+/*
+ * Prepares the context of a new thread, so that it calls 'func(arg)' on the stack
+ * 'sp', once it gets scheduled for the first time.
+ */
+void hal_thread_setup(struct thread* thread, u_intptr_t sp, void (*func)(void*), void* arg);
+
 /*
  * This function starts the interrupt handling.
  */
 void hal_boot_start_int();
 
+/*
+ * Returns a free-running CPU cycle counter. Only differences are meaningful.
+ */
+u_int64_t hal_cycles();
+
+/*
+ * Calibrates the counter of hal_cycles(), and returns it's description. Called
+ * once by ktime_init(), on the boot CPU.
+ */
+struct clocksource* hal_clocksource_init();
+
+/*
+ * Starts the other CPUs of the system. Each one gets its own 'struct cpu', and
+ * enters kernel_ap_main(). Returns the number of CPUs, that have been started.
+ */
+int hal_start_cpus();
+
+/*
+ * Interrupts a CPU (or the current one), so that it reevaluates its run-queue.
+ * Does nothing, if the HAL can't interrupt that CPU.
+ */
+void hal_cpu_kick(struct cpu* cpu);
+
+/*
+ * Flushes the kernel's page-mappings from 'begin' to 'end' (inclusive) from the
+ * TLB of every CPU, and returns once all of them are done. A range of 0 to ~0
+ * flushes everything.
+ */
+void hal_tlb_shootdown(u_intptr_t begin, u_intptr_t end);
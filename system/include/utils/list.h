@@ -42,6 +42,10 @@ static inline int list_is_in_list(list_node_t node){
 	return ((node->prev!=0) && (node->next!=0));
 }
 
+static inline int list_is_empty(list_node_t lst){
+	return lst->next==lst;
+}
+
 static inline void list_add_after(list_node_t a, list_node_t b){
 	/* Before: a<->c */
 	list_node_t c = a->next;
@@ -58,7 +62,7 @@ static inline void list_add_after(list_node_t a, list_node_t b){
 
 static inline void list_add_before(list_node_t c, list_node_t b){
 	/* Before: a<->c */
-	list_node_t a = c->next;
+	list_node_t a = c->prev;
 	
 	/* a->b->c */
 	a->next = b;
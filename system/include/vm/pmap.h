@@ -52,6 +52,12 @@ struct kernslice;
  */
 void pmap_init();
 
+/*
+ * Permanently maps 'npages' pages of physical memory, starting at 'pa', into the
+ * kernel address space. Can be used before pmap_init(). Returns 0 on failure.
+ */
+vaddr_t pmap_bootstrap_map(paddr_t pa, paddr_t npages);
+
 /*
  * This function returns the kernels address space instance. Don't 'pmap_destroy()' it.
  */
@@ -46,6 +46,7 @@
 #define VMM_IS_PGADDR  1
 #define VMM_IS_PGOBJ   2
 #define VMM_IS_PMRANGE 3
+#define VMM_IS_EXTENT  4  /* A run of physically contiguous pages. */
 
 struct vm_mem {
 	/* The Physical Memory. */
@@ -53,9 +54,13 @@ struct vm_mem {
 		paddr_t    mem_pgaddr;
 		vm_page_t  mem_pgobj;
 		vm_range_t mem_pmrange;
+		struct {
+			paddr_t mem_extent;       /* First page of the run. */
+			paddr_t mem_extent_pages; /* Length of the run in pages. */
+		};
 	};
 	unsigned int
-		mem_phys_type  : 2, /* The type of the physical memory. */
+		mem_phys_type  : 3, /* The type of the physical memory. */
 		mem_default_ro : 1, /* Default to Read-only, when mapped. */
 		mem_default_nx : 1, /* Default to non-executable, when mapped. (x) */
 		mem_accessed   : 1, /* The memory has been read or written to. (f) */
@@ -66,8 +71,6 @@ struct vm_mem {
 
 void vm_mem_init();
 
-void vm_mem_refill();
-
 int vm_mem_lookup(struct vm_mem* mem, vaddr_t rva, paddr_t *pag, vm_prot_t *prot);
 
 struct vm_mem* vm_mem_alloc(int kernel);
@@ -0,0 +1,59 @@
+/*
+ * 
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#pragma once
+#include <sysarch/paddr.h>
+#include <machine/types.h>
+
+struct kernslice;
+
+/*
+ * NUMA page allocation policies. The home slice of an allocation is the kernel slice
+ * of the current CPU.
+ */
+#define VM_NUMA_LOCAL      0  /* The home slice first, then the others, nearest first. */
+#define VM_NUMA_STRICT     1  /* The home slice only. */
+#define VM_NUMA_INTERLEAVE 2  /* Round-robin over all slices, then fall back like VM_NUMA_LOCAL. */
+#define VM_NUMA_DEFAULT    3  /* The system-wide default policy. */
+
+/*
+ * Gets or sets the system-wide default policy. Returns 0 on an invalid policy.
+ */
+int  vm_numa_get_policy();
+int  vm_numa_set_policy(int policy);
+
+/*
+ * Allocates a single page, according to the policy. If 'owner' is not 0, the slice,
+ * the page was taken from, is stored there.
+ */
+int  vm_numa_alloc(int policy, paddr_t *res, struct kernslice** owner);
+
+/*
+ * Allocates 'npages' physically contiguous pages, according to the policy.
+ * See vm_phys_alloc_contig().
+ */
+int  vm_numa_alloc_contig(int policy, paddr_t npages, paddr_t align, paddr_t *res, struct kernslice** owner);
+
+/*
+ * Prints the per-slice hit, miss and fallback counters.
+ */
+void vm_numa_print();
@@ -29,6 +29,7 @@
 
 #pragma once
 #include <sysarch/paddr.h>
+#include <sysarch/pages.h>
 #include <vm/vm_types.h>
 #include <sys/kernslice.h>
 #include <sys/kspinlock.h>
@@ -113,11 +114,64 @@ struct vm_page {
 };
 typedef struct vm_page *vm_page_t;
 
+/*
+ * Every kernel slice has an array of vm_page structures, one per page frame in
+ * the span of it's memory ranges, indexed by the page frame number. Frames in the
+ * holes between the ranges are marked 'is_private' and never handed out.
+ *
+ * PHYS_TO_VM_PAGE() does no bounds checking, use vm_page_lookup() for addresses,
+ * that may lie outside of the slice.
+ */
+#define PHYS_TO_VM_PAGE(slice,pa) \
+	(&((slice)->ks_page_array[((pa)/SYSARCH_PAGESIZE)-((slice)->ks_page_pfn)]))
+#define VM_PAGE_TO_PHYS(page) ((page)->phys_addr)
+
+/*
+ * The free list of a kernel slice holds pages, that have been taken from the
+ * physical allocator. An empty list is refilled with VM_PAGE_FREE_BATCH pages,
+ * and released pages go back to the physical allocator, once the list holds
+ * VM_PAGE_FREE_HIGH pages.
+ */
+#define VM_PAGE_FREE_BATCH  16
+#define VM_PAGE_FREE_LOW    32
+#define VM_PAGE_FREE_HIGH   128
+
+/*
+ * Allocates and initializes the vm_page array of a kernel slice, and populates
+ * the free list with VM_PAGE_FREE_LOW pages. Must be called after vm_init().
+ */
+void      vm_page_init(struct kernslice* slice);
+
+/*
+ * Returns the vm_page of a physical address, or 0 if the address does not belong
+ * to the slice.
+ */
+vm_page_t vm_page_lookup(struct kernslice* slice, paddr_t addr);
+
 
 void      vm_page_free(struct kernslice* slice, paddr_t addr);
+void      vm_page_free_contig(struct kernslice* slice, paddr_t addr, paddr_t npages);
+void      vm_page_free_batch(struct kernslice* slice, paddr_t *addrs, u_int32_t n);
 void      vm_page_release(vm_page_t page);
 void      vm_page_drop(vm_page_t page);
 vm_page_t vm_page_grab(struct kernslice* slice);
 vm_page_t vm_page_grab_fictitious(struct kernslice* slice);
 void      vm_page_zero_fill(vm_page_t page);
 
+/*
+ * Allocates a zeroed page frame. The frame is taken from the slice's pool of
+ * pre-zeroed pages, or zeroed on the spot, if the pool is empty.
+ */
+int       vm_page_grab_zeroed(struct kernslice* slice, paddr_t *res);
+
+/*
+ * Zeroes one page for the pool, if it isn't full. Called by the idle thread.
+ * Returns 0 if there was nothing to do.
+ */
+int       vm_page_zero_idle(struct kernslice* slice);
+
+/*
+ * Prints the statistics of the pool of pre-zeroed pages.
+ */
+void      vm_page_zero_print(struct kernslice* slice);
+
@@ -34,6 +34,7 @@ struct vm_seg *vm_seg_alloc_critical();
 struct vm_mem *vm_mem_alloc_critical();
 
 struct vm_range *vm_range_alloc_critical(struct kernslice* slice);
+struct vm_range *vm_range_alloc_chain_critical(struct kernslice* slice, u_int32_t n);
 
 /* Mach */
 struct vm_object;
@@ -49,12 +49,22 @@ typedef struct vm_range *vm_range_t;
 
 void vm_range_init();
 
-void vm_range_refill();
-
 int vm_range_bmlkup(vm_range_t range, int i);
 int vm_range_get   (vm_range_t range, vaddr_t rva, paddr_t *pag, vm_prot_t *prot);
 void vm_range_bmset(vm_range_t range, int i);
 void vm_range_bmclr(vm_range_t range, int i);
 vm_range_t vm_range_alloc(int kernel, struct kernslice* slice);
 
+/*
+ * Allocates a chain of 'n' ranges, linked through 'rang_next', with a single lock
+ * round-trip per batch. Returns 0 if not all of them could be allocated.
+ */
+vm_range_t vm_range_alloc_chain(int kernel, struct kernslice* slice, u_int32_t n);
+
+/*
+ * Frees a chain of ranges, as allocated by vm_range_alloc_chain(), without
+ * touching it's pages.
+ */
+void vm_range_free_chain(vm_range_t range);
+
 void vm_range_drop(vm_range_t range);
@@ -67,8 +67,6 @@ typedef struct vm_seg *vm_seg_t;
 
 void vm_seg_init();
 
-void vm_seg_refill();
-
 vm_seg_t vm_seg_alloc(int kernel);
 
 void vm_seg_initobj(vm_seg_t seg);
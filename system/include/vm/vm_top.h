@@ -34,9 +34,10 @@ void vm_init();
 int vm_kalloc_ll(vaddr_t *addr /* [out] */,vaddr_t *size /* [in/out]*/);
 
 /*
- * Refills the critical kernel-vm object zones, if necessary. Do this after vm_alloc_critical().
+ * Frees a chunk of kernel-memory, that was allocated using vm_kalloc_ll() or
+ * vm_alloc_critical(). 'addr' must be the address, that was returned.
  */
-void vm_refill();
+int vm_kfree_ll(vaddr_t addr);
 
 /*
  * Allocates a critical chunk of memory. Used for the vm_seg_t, vm_mem_t and vm_range_t -zones.
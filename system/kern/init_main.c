@@ -31,12 +31,19 @@
 #include <stdio.h>
 #include <kern/stacks.h>
 #include <kern/sched.h>
+#include <kern/tick.h>
+#include <kern/timer.h>
+#include <kern/ktime.h>
 #include <vm/vm_top.h>
+#include <kern/zalloc.h>
+#include <kern/kmalloc.h>
 
 #include <vm/vm_page.h>
+#include <vm/vm_numa.h>
 #include <vm/vm_object.h>
 
 #include <vm/vm_map.h>
+#include <vm/pmap.h>
 
 #include <utils/list.h>
 
@@ -44,12 +51,56 @@
 
 void kern_prove_alive();
 
+/*
+ * Sets up the physical memory allocator of a kernel slice. The bitmaps are taken
+ * from the raw memory of 'raw', so that they fit all memory ranges.
+ */
+static int kern_initmem_slice(struct kernslice* kern, struct kernslice* raw){
+	paddr_t                size,pa;
+	vaddr_t                va;
+	struct physmem_bmaset* bmas;
+	
+	size = vm_phys_bm_bootsize(kern->ks_memory_ranges,kern->ks_num_memory_ranges);
+	size = (size + SYSARCH_PAGESIZE - 1)/SYSARCH_PAGESIZE;
+	if(!vm_phys_raw_alloc(raw,size,&pa)) return 0;
+	va = pmap_bootstrap_map(pa,size);
+	if(!va) return 0;
+	if(!vm_phys_bm_init(
+		kern->ks_memory_ranges,
+		kern->ks_num_memory_ranges,
+		(void*)va,
+		size*SYSARCH_PAGESIZE,
+		&bmas
+	)) return 0;
+	kern->ks_memory_allocator = bmas;
+	return 1;
+}
+
 static void kern_initmem(){
 	u_intptr_t             Pi;
 	paddr_t                Pt;
+	u_int32_t              i;
 	struct kernslice*      kern;
+	struct kernslice*      other;
 	struct physmem_bmaset* bmas;
 	kern = kernel_get_current_cpu()->cpu_kernel_slice;
+	
+	/*
+	 * The other slices (NUMA domains) take their bitmaps from the boot CPU's slice,
+	 * whose memory is the easiest to map at this point.
+	 */
+	for(i=0;i<kernslice_count();++i){
+		other = kernslice_get(i);
+		if(other == kern) continue;
+		if(!kern_initmem_slice(other,kern))
+			printf("kern_initmem: slice %u has no memory allocator\n",(unsigned)i);
+	}
+	
+	/*
+	 * Fall back to the statically allocated bitmaps, if that fails.
+	 */
+	if(kern_initmem_slice(kern,kern)) return;
+	
 	vm_phys_bm_bootinit(
 		kern->ks_memory_ranges,
 		kern->ks_num_memory_ranges,
@@ -64,6 +115,52 @@ void kern_printmem();
 
 static void main();
 
+/*
+ * Sets up the per-CPU state of another CPU, before it gets started: the CPU stack,
+ * the allocator caches, the scheduler, the timer wheel and the idle thread.
+ */
+void kernel_cpu_prepare(struct cpu* cpu){
+	struct thread* thread;
+	
+	kernel_cpu_init_stack(cpu);
+	zone_cpu_init(cpu);
+	vm_phys_cpu_init(cpu);
+	sched_instanciate(cpu);
+	timer_wheel_init(cpu);
+	
+	thread = thread_allocate();
+	if(!thread) panic("Couldn't allocate the Idle thread for CPU %d!",(int)cpu->cpu_cpu_id);
+	thread->t_current_cpu = cpu;
+	cpu->cpu_scheduler->sched_idle = thread;
+}
+
+/*
+ * The main function of the other CPUs. It is called by the HAL, once the CPU runs
+ * on it's own GDT and interrupt controller.
+ */
+void kernel_ap_main(){
+	struct cpu* cpu = kernel_get_current_cpu();
+	
+	kernel_set_current_thread(cpu->cpu_scheduler->sched_idle);
+	
+	tick_start(cpu);
+	hal_boot_start_int();
+	
+	/* Idle-process. */
+	for(;;){
+		/*
+		 * Steal a thread from a busy CPU, and run it. Also run threads, that
+		 * have been inserted, while the tick was stopped.
+		 */
+		if(sched_balance(cpu) || cpu->cpu_scheduler->sched_run_bits){
+			hal_induce_preemption();
+			continue;
+		}
+		vm_page_zero_idle(cpu->cpu_kernel_slice);
+		arch_wait();
+	}
+}
+
 void kernel_main(void) {
 	int caps = platform_get_cap_stage();
 	switch(caps){
@@ -98,8 +195,25 @@ void kernel_main(void) {
 
 #define DIET_OF(x) printf("size of %s = %d\n", #x,sizeof(x))
 
+/*
+ * Prints the statistics, that the allocators and the scheduler gathered during boot.
+ */
+static void kern_print_stats(){
+	u_int32_t i;
+	
+	zprint();
+	vm_phys_cpu_print();
+	sched_print_stats();
+	for(i=0;i<kernslice_count();++i)
+		if(kernslice_get(i)->ks_memory_allocator)
+			vm_page_zero_print(kernslice_get(i));
+	vm_numa_print();
+}
+
 static void main(){
 	struct thread* thread;
+	u_int32_t i;
+	int ncpus;
 	
 	//printf("Hello...\n");
 	
@@ -111,10 +225,25 @@ static void main(){
 	
 	/* Initialize the bitmap physical memory allocator.  */
 	kern_initmem();
+	vm_phys_cpu_init(kernel_get_current_cpu());
 	
 	/* Initialize the VM system. */
 	vm_init();
 	
+	/* Set up the vm_page arrays and the free page lists. */
+	for(i=0;i<kernslice_count();++i)
+		if(kernslice_get(i)->ks_memory_allocator)
+			vm_page_init(kernslice_get(i));
+	
+	/* Initialize the general-purpose allocator. */
+	kmalloc_init();
+	kmalloc_check();
+	
+#ifdef KERN_BENCHMARK
+	/* Boot-time benchmarks. */
+	vm_phys_benchmark();
+#endif
+	
 	/* Allocate the 'cpu->CPU_LOCAL_STACK' stack. */
 	kernel_cpu_init_stack(kernel_get_current_cpu());
 	
@@ -134,8 +263,32 @@ static void main(){
 	
 	kernel_get_current_cpu()->cpu_scheduler->sched_idle = thread;
 	
+	/* Start the kernel clock and the timers of the current cpu. */
+	ktime_init();
+	timer_wheel_init(kernel_get_current_cpu());
+	
+#ifdef KERN_BENCHMARK
+	/* Scheduler benchmark. It needs the current thread and the scheduler zone. */
+	sched_benchmark();
+#endif
+	
+	/* Start the zone refill thread. */
+	zone_refill_start();
+	
+	/* Start the other CPUs. */
+	ncpus = hal_start_cpus();
+	printf("CPUs online: %d\n",ncpus);
+	
+	/* Start the tick on the boot CPU. */
+	tick_start(kernel_get_current_cpu());
+	
 	hal_boot_start_int();
 	
+#ifdef KERN_BENCHMARK
+	/* Zone contention benchmark. It needs all CPUs and the tick running. */
+	zalloc_benchmark(ncpus);
+#endif
+	
 	DIET_OF(struct vm_page);
 	//printf("vm_page_t->page_queue_flags = %d\n",offsetof(struct vm_page,page_queue_flags));
 	//printf("vm_page_t->object_flags = %d\n",offsetof(struct vm_page,object_flags));
@@ -147,9 +300,26 @@ static void main(){
 	DIET_OF(struct vm_map);
 	DIET_OF(struct vm_map_entry);
 	
+	kern_print_stats();
+	
 	printf("Hey, we need to do more!\n");
 	/* TODO: do more initilalization. */
 	
 	/* Idle-process. */
-	arch_halt();
+	for(;;){
+		/* Give empty slabs back, if the VM ran out of memory. */
+		zgc_consider();
+		/*
+		 * Steal a thread from a busy CPU, and run it. Also run threads, that
+		 * have been inserted, while the tick was stopped.
+		 */
+		if( sched_balance(kernel_get_current_cpu()) ||
+		    kernel_get_current_cpu()->cpu_scheduler->sched_run_bits ){
+			hal_induce_preemption();
+			continue;
+		}
+		/* Zero one page for the pool, then sleep until the next interrupt. */
+		vm_page_zero_idle(kernel_get_current_cpu()->cpu_kernel_slice);
+		arch_wait();
+	}
 }
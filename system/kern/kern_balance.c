@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <kern/sched.h>
+#include <sys/cpu.h>
+#include <sys/kernslice.h>
+#include <sys/thread.h>
+#include <stdio.h>
+
+/*
+ * The load of a CPU is the 'sched_thread_count' of its scheduler. It is read without
+ * the scheduler lock, as the balancer only needs an estimate.
+ *
+ * A thread is only ever moved by the CPU, that receives it: it is taken out with
+ * sched_remove() and put in with sched_insert(), so no two scheduler locks are held
+ * at the same time.
+ */
+
+static inline u_intptr_t sched_load(struct cpu* cpu){
+	return __atomic_load_n(&(cpu->cpu_scheduler->sched_thread_count),__ATOMIC_RELAXED);
+}
+
+/*
+ * Finds the least (least=1) or the most (least=0) loaded CPU with a scheduler, within
+ * a kernel slice, or within all slices, if 'slice' is 0. 'skip' is not considered.
+ */
+static struct cpu* sched_find(struct kernslice* slice, struct cpu* skip, int least){
+	struct cpu* cpu;
+	struct cpu* best = 0;
+	u_intptr_t load,bload = 0;
+	u_int32_t i,n;
+	
+	for(i=0,n=kernslice_count();i<n;++i){
+		if(slice && (kernslice_get(i) != slice)) continue;
+		for(cpu = kernslice_get(i)->ks_cpu_list; cpu; cpu = cpu->cpu_ks_next){
+			if( (cpu == skip) || !(cpu->cpu_scheduler) ) continue;
+			load = sched_load(cpu);
+			if( best && (least ? (load >= bload) : (load <= bload)) ) continue;
+			best  = cpu;
+			bload = load;
+		}
+	}
+	return best;
+}
+
+struct cpu* sched_select_cpu(){
+	struct cpu* self = kernel_get_current_cpu();
+	struct cpu* best;
+	struct cpu* other;
+	
+	best = sched_find(self->cpu_kernel_slice,0,1);
+	if(!best) best = self;
+	
+	/* Leave the kernel slice only, if that pays off. */
+	other = sched_find(0,0,1);
+	if( other && (sched_load(best) >= (sched_load(other) + SCHED_IMBALANCE)) )
+		best = other;
+	return best;
+}
+
+int sched_balance(struct cpu* cpu){
+	struct cpu* victim;
+	struct thread* thread;
+	u_intptr_t load;
+	
+	if(!(cpu->cpu_scheduler)) return 0;
+	load = sched_load(cpu);
+	
+	/* Prefer the busiest CPU of the own kernel slice. */
+	victim = sched_find(cpu->cpu_kernel_slice,cpu,0);
+	if( (!victim) || (sched_load(victim) < (load + SCHED_IMBALANCE)) )
+		victim = sched_find(0,cpu,0);
+	if( (!victim) || (sched_load(victim) < (load + SCHED_IMBALANCE)) )
+		return 0;
+	
+	/* The victim might have no runnable thread, only running or blocked ones. */
+	thread = sched_remove(victim);
+	if(!thread) return 0;
+	sched_insert(cpu,thread);
+	
+	__atomic_fetch_add(&(cpu->cpu_scheduler->sched_migrated_in),1,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&(victim->cpu_scheduler->sched_migrated_out),1,__ATOMIC_RELAXED);
+	return 1;
+}
+
+void sched_print_stats(){
+	struct cpu* cpu;
+	u_int32_t i,n;
+	for(i=0,n=kernslice_count();i<n;++i){
+		for(cpu = kernslice_get(i)->ks_cpu_list; cpu; cpu = cpu->cpu_ks_next){
+			if(!(cpu->cpu_scheduler)) continue;
+			printf("cpu %u (slice %u): %u threads, %u migrated in, %u migrated out\n",
+				(unsigned)cpu->cpu_cpu_id,
+				(unsigned)i,
+				(unsigned)sched_load(cpu),
+				(unsigned)cpu->cpu_scheduler->sched_migrated_in,
+				(unsigned)cpu->cpu_scheduler->sched_migrated_out);
+		}
+	}
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <kern/ktime.h>
+#include <libkern/panic.h>
+#include <sys/clocksource.h>
+#include <sys/cpu.h>
+#include <sys/thread.h>
+#include <sysarch/hal.h>
+#include <stdio.h>
+
+/*
+ * Cycles are converted into nanoseconds with a fixed point factor:
+ *
+ *   ns = (cycles * ktime_mult) >> KTIME_SHIFT
+ *
+ * The product would overflow after a few seconds, so the cycles are split into a
+ * high and a low part, each of which is multiplied separately.
+ */
+#define KTIME_SHIFT 24
+#define KTIME_MASK  ((((u_int64_t)1)<<KTIME_SHIFT)-1)
+
+/*
+ * The offset of a CPU is measured KTIME_SYNC_ROUNDS times. The round with the
+ * shortest round trip gives the most accurate result.
+ */
+#define KTIME_SYNC_ROUNDS 16
+
+static struct clocksource* ktime_cs;
+static u_int64_t ktime_base; /* ktime_cycles() at ktime_init(). */
+static u_int32_t ktime_mult; /* Nanoseconds per cycle, << KTIME_SHIFT. */
+
+/* Handshake of ktime_sync_cpu() and ktime_sync_boot(). */
+static u_int32_t ktime_sync_req;
+static u_int32_t ktime_sync_ack;
+static u_int64_t ktime_sync_time;
+
+/*
+ * Returns (a << shift) / b, using 32-bit operations only.
+ */
+static u_int32_t ktime_div_shift(u_int32_t a, u_int32_t b, int shift){
+	u_int64_t rem = a % b;
+	u_int32_t q = a / b;
+	
+	while(shift--){
+		rem <<= 1;
+		q <<= 1;
+		if(rem >= b){
+			rem -= b;
+			q |= 1;
+		}
+	}
+	return q;
+}
+
+void ktime_init(){
+	ktime_cs = hal_clocksource_init();
+	if( (!ktime_cs) || (!ktime_cs->cs_khz) ) panic("ktime: the clocksource is not calibrated!");
+	
+	printf("ktime: %s at %u kHz, calibrated against %s\n",
+		ktime_cs->cs_name,(unsigned)ktime_cs->cs_khz,ktime_cs->cs_reference);
+	
+	ktime_mult = ktime_div_shift(1000000,ktime_cs->cs_khz,KTIME_SHIFT);
+	ktime_base = ktime_cycles();
+}
+
+u_int64_t ktime_cycles(){
+	struct thread* thread = kernel_get_current_thread();
+	u_int64_t cycles;
+	
+	/* Don't move to another CPU, between reading the counter and the offset. */
+	if(thread) thread->t_nonpreempt++;
+	cycles = hal_cycles() + kernel_get_current_cpu()->cpu_cycles_offset;
+	if(thread) thread->t_nonpreempt--;
+	return cycles;
+}
+
+u_int64_t ktime_cycles_to_ns(u_int64_t cycles){
+	return
+		((cycles >> KTIME_SHIFT) * ktime_mult) +
+		(((cycles & KTIME_MASK) * ktime_mult) >> KTIME_SHIFT);
+}
+
+u_int64_t ktime_get_ns(){
+	return ktime_cycles_to_ns(ktime_cycles()-ktime_base);
+}
+
+/*
+ * The CPU sends a request, and the boot CPU answers with it's counter. Assuming,
+ * that both ways take the same time, the boot CPU read it's counter half way
+ * through the round trip.
+ */
+void ktime_sync_cpu(){
+	struct cpu* cpu = kernel_get_current_cpu();
+	u_int64_t t0,t1,best = ~((u_int64_t)0);
+	u_int32_t i;
+	
+	for(i=1;i<=KTIME_SYNC_ROUNDS;++i){
+		t0 = hal_cycles();
+		__atomic_store_n(&ktime_sync_req,i,__ATOMIC_RELEASE);
+		while(__atomic_load_n(&ktime_sync_ack,__ATOMIC_ACQUIRE) != i);
+		t1 = hal_cycles();
+		
+		if((t1-t0) >= best) continue;
+		best = t1-t0;
+		cpu->cpu_cycles_offset = ktime_sync_time - (t0 + (best>>1));
+	}
+}
+
+void ktime_sync_boot(){
+	u_int32_t i;
+	
+	for(i=1;i<=KTIME_SYNC_ROUNDS;++i){
+		while(__atomic_load_n(&ktime_sync_req,__ATOMIC_ACQUIRE) != i);
+		ktime_sync_time = hal_cycles();
+		__atomic_store_n(&ktime_sync_ack,i,__ATOMIC_RELEASE);
+	}
+	
+	/*
+	 * Both counters stay at KTIME_SYNC_ROUNDS, which doesn't match the first
+	 * round of the next CPU. Resetting them here could hide the last answer.
+	 */
+}
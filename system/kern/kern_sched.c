@@ -20,6 +20,8 @@
  * SOFTWARE.
  */
 #include <kern/sched.h>
+#include <kern/tick.h>
+#include <kern/timer.h>
 #include <kern/zalloc.h>
 #include <libkern/panic.h>
 #include <sys/cpu.h>
@@ -99,6 +101,7 @@ static inline linked_ring_t sched_elem(struct thread* thread){
 }
 
 static inline int sched_is_suspended(struct thread* thread){
+	if(thread->t_stateflags & THREAD_SF_DEAD) return 1;
 	return (
 		(thread->t_stateflags & THREAD_SF_QUEUE_WAIT) &&
 		(thread->t_wait_queue)
@@ -110,83 +113,83 @@ static inline int sched_is_suspended(struct thread* thread){
  * other priority queues, the queues themself have priorities themself, expressed
  * as decaying values.
  *
- * The scheduler-function essentially performs two steps:
+ * Every scheduling decision decreases ('decays') the 'decaying values' of all
+ * priorities with non-empty run-queues, and picks the one with the lowest value,
+ * among those. The 'decaying value' of the chosen priority is reset to
+ * sched_prios[i], as is the value of a run-queue, that becomes non-empty.
  *
- * The first step is to 'reset' the 'decaying values' of all priorities with their
- * run-queues empty; and to decrease ('decay') the 'decaying values' of all other
- * priority.
+ * Instead of decaying all values on every decision, the scheduler counts its
+ * decisions in 'sched_tick', and stores the tick at which the 'decaying value'
+ * reaches zero:
  *
- * for(i=0; i<SCHED_NRQS; ++i)
- *     if( ! sched_runnable(scheduler,i) )
- *        scheduler->sched_run_decay[i] = sched_prios[i];
- *     else
- *        scheduler->sched_run_decay[i] --;
+ *   decaying value (i) = sched_run_deadline[i] - sched_tick
  *
- * The second step is to find, among the priorities with non-empty run-queues,
- * the priority with the lowest 'decaying value'.
- *
- * for(i=0; i<SCHED_NRQS; ++i)
- *     if( sched_runnable(scheduler,i) )
- *        find_the_lowest( scheduler->sched_run_decay[i] );
- *
- * Finally, if any value as been found, reset it's 'decaying value':
- *
- *   scheduler->sched_run_decay[i] = sched_prios[i];
+ * Thus, the lowest 'decaying value' is the earliest deadline, and only the
+ * non-empty run-queues, as found in the 'sched_run_bits' bitmap, need to be looked
+ * at.
+ */
+
+#define sched_runnable(scheduler,i) ((scheduler)->sched_run_bits & (1U<<(i)))
+#define sched_ring_empty(ring) ((ring)->next == (ring))
+
+static inline void sched_run_reset(struct scheduler* scheduler, int i){
+	scheduler->sched_run_deadline[i] = scheduler->sched_tick + sched_prios[i];
+}
+
+/*
+ * Removes a thread from its queue. Clears the bit of the run-queue, if the thread
+ * was the last one on it.
  */
+static void sched_unlink(struct scheduler* scheduler, struct thread* thread){
+	linked_ring_t next = thread->t_queue_entry.next;
+	linked_ring_remove(&(thread->t_queue_entry));
+	
+	/* If 'next' is an empty list head, the thread was the last one on it. */
+	if(!sched_ring_empty(next)) return;
+	if(next < scheduler->sched_run_ring) return;
+	if(next >= (scheduler->sched_run_ring + SCHED_NRQS)) return;
+	scheduler->sched_run_bits &= ~(1U<<(next - scheduler->sched_run_ring));
+}
 
-#define sched_runnable(scheduler,i) linked_ring_empty(&(scheduler->sched_run_ring[i]))
 static struct thread* sched_schedule_next(struct scheduler* scheduler){
 	threadp_t current;
 	int i;
 	int mi;
-	signed int mdecay = 0; /* Initialized becaus of warnings. */
+	u_int32_t bits;
+	linked_ring_t ring;
 	linked_ring_t elem;
 	
 restart:
 	
-	mi = -1;
+	bits = scheduler->sched_run_bits;
+	
+	/* If there is no runnable thread, return. */
+	if(!bits) return 0;
+	
+	/* This decision decays all non-empty priorities. */
+	scheduler->sched_tick++;
 	
 	/*
-	 * The algorithm is implemented as one single loop.
-	 * For every priority (i) do:
+	 * Find the earliest deadline among the non-empty run-queues. On equal
+	 * deadlines, the lower priority number wins.
 	 */
-	for(i=0; i<SCHED_NRQS; ++i){
-		/*
-		 * If run-queue of the priority (i) is empty, then reset the
-		 * 'decaying value', and skip to the rest of the loop-body!
-		 */
-		if(!sched_runnable(scheduler,i)){
-			scheduler->sched_run_decay[i] = sched_prios[i];
-			continue;
-		}
-		
-		/*
-		 * If we get here, the priority has a non-empty run-queue.
-		 *
-		 * We decrease the 'decaying value'.
-		 */
-		scheduler->sched_run_decay[i] --;
-		
-		/*
-		 * If we didn't find the any priority yet (mi<0), or if the
-		 * priority has a lower 'decaying value' than the last one, we
-		 * found; Then choose that one over the previous one.
-		 */
-		if( (mi<0) || (scheduler->sched_run_decay[i] < mdecay)) {
-			mdecay = scheduler->sched_run_decay[i];
+	mi = __builtin_ctz(bits);
+	bits &= bits-1;
+	while(bits){
+		i = __builtin_ctz(bits);
+		bits &= bits-1;
+		if( ((signed int)(scheduler->sched_run_deadline[i] - scheduler->sched_run_deadline[mi])) < 0 )
 			mi = i;
-		}
 	}
 	
-	/* If we din't find any one, return. */
-	if(mi<0) return 0;
-	
 	/* Reset the 'decaying value' of the found priority. */
-	scheduler->sched_run_decay[mi] = sched_prios[mi];
+	sched_run_reset(scheduler,mi);
 	
 	/* Remove an Element from the end of the queue. */
-	elem = scheduler->sched_run_ring[mi].prev;
+	ring = &(scheduler->sched_run_ring[mi]);
+	elem = ring->prev;
 	linked_ring_remove(elem);
+	if(sched_ring_empty(ring)) scheduler->sched_run_bits &= ~(1U<<mi);
 	current = (struct thread*)(elem->data);
 	
 	/*
@@ -218,7 +221,10 @@ static void sched_reenqueue(struct scheduler* scheduler, struct thread* thread){
 	int i = (thread->t_priority) % SCHED_NRQS;
 	
 	/* Empty run-queues get reseted. */
-	if(!sched_runnable(scheduler,i)) scheduler->sched_run_decay[i] = sched_prios[i];
+	if(!sched_runnable(scheduler,i)){
+		sched_run_reset(scheduler,i);
+		scheduler->sched_run_bits |= (1U<<i);
+	}
 	
 	/* Insert at the begin of the list. */
 	linked_ring_insert( &(scheduler->sched_run_ring[i]), sched_elem(thread), /*after=*/ 1 );
@@ -250,11 +256,12 @@ void sched_instanciate(struct cpu* cpu){
 	/* For the first thread, that initializes this scheduler. */
 	scheduler->sched_thread_count = 1;
 	
-	/* Initialize sched_run_decay-variables. */
+	/* Initialize the run-queues. All are empty, so 'sched_run_bits' is 0. */
 	for(i=0; i<SCHED_NRQS; ++i){
-		scheduler->sched_run_decay[i] = sched_prios[i];
+		sched_run_reset(scheduler,i);
 		linked_ring_init(&(scheduler->sched_run_ring[i]));
 	}
+	linked_ring_init(&(scheduler->sched_blocked));
 	
 	/* Assign the instance. */
 	cpu->cpu_scheduler = scheduler;
@@ -269,11 +276,6 @@ void sched_insert(struct cpu* cpu, struct thread* thread){
 	myself = kernel_get_current_thread();
 	scheduler = cpu->cpu_scheduler;
 	
-	/*
-	 * Set the thread's current cpu.
-	 */
-	thread->t_current_cpu = cpu;
-	
 	/*
 	 * Set the THREAD_SF_LOCK_SCHED-flag and lock the scheduler.
 	 */
@@ -281,6 +283,12 @@ void sched_insert(struct cpu* cpu, struct thread* thread){
 	LOCAL_ACQUIRE;
 	kernlock_lock(&(scheduler->sched_lock));
 	
+	/*
+	 * Set the thread's current cpu. This is done under the lock, so sched_actualize()
+	 * never finds the thread on a CPU, before it is in that CPU's queues.
+	 */
+	thread->t_current_cpu = cpu;
+	
 	/*
 	 * Insert the thread into the run-queue.
 	 */
@@ -297,6 +305,11 @@ void sched_insert(struct cpu* cpu, struct thread* thread){
 	kernlock_unlock(&(scheduler->sched_lock));
 	LOCAL_RELEASE;
 	ORDERED_APPLY(myself->t_stateflags, & ~THREAD_SF_LOCK_SCHED);
+	
+	/*
+	 * Wake the CPU up, if it doesn't tick.
+	 */
+	tick_wakeup(cpu);
 }
 
 /*
@@ -321,9 +334,13 @@ struct thread* sched_remove(struct cpu* cpu){
 	thread = sched_schedule_next(scheduler);
 	
 	/*
-	 * Decrement the thread count. (If thread is a valid pointer.)
+	 * Decrement the thread count, and clear the thread's current cpu, while still
+	 * holding the lock. (If thread is a valid pointer.)
 	 */
-	if(thread) scheduler->sched_thread_count --;
+	if(thread){
+		scheduler->sched_thread_count --;
+		thread->t_current_cpu = 0;
+	}
 	
 	/*
 	 * Unlock the scheduler, and get rid of the THREAD_SF_LOCK_SCHED-flag.
@@ -332,10 +349,6 @@ struct thread* sched_remove(struct cpu* cpu){
 	LOCAL_RELEASE;
 	ORDERED_APPLY(myself->t_stateflags, & ~THREAD_SF_LOCK_SCHED);
 	
-	/*
-	 * Clear the thread's current cpu. (If thread is a valid pointer.)
-	 */
-	if(thread) thread->t_current_cpu = 0;
 	return thread;
 }
 
@@ -344,17 +357,35 @@ struct thread* sched_remove(struct cpu* cpu){
  */
 void sched_actualize(struct thread* thread){
 	struct thread* myself;
-	struct cpu* cpu = thread->t_current_cpu;
-	if(!cpu)return;
-	struct scheduler* scheduler = cpu->cpu_scheduler;
+	struct cpu* cpu;
+	struct scheduler* scheduler;
 	myself = kernel_get_current_thread();
 	
-	/*
-	 * Set the THREAD_SF_LOCK_SCHED-flag and lock the scheduler.
-	 */
-	ORDERED_APPLY(myself->t_stateflags, | THREAD_SF_LOCK_SCHED);
-	LOCAL_ACQUIRE;
-	kernlock_lock(&(scheduler->sched_lock));
+	for(;;){
+		/*
+		 * A thread without a cpu is being migrated. sched_insert() will enqueue it
+		 * according to it's current state.
+		 */
+		cpu = __atomic_load_n(&(thread->t_current_cpu),__ATOMIC_ACQUIRE);
+		if(!cpu)return;
+		scheduler = cpu->cpu_scheduler;
+		
+		/*
+		 * Set the THREAD_SF_LOCK_SCHED-flag and lock the scheduler.
+		 */
+		ORDERED_APPLY(myself->t_stateflags, | THREAD_SF_LOCK_SCHED);
+		LOCAL_ACQUIRE;
+		kernlock_lock(&(scheduler->sched_lock));
+		
+		/*
+		 * sched_balance() may have moved the thread away, while we were waiting for
+		 * the lock. In this case, unlock and try again.
+		 */
+		if(thread->t_current_cpu == cpu) break;
+		kernlock_unlock(&(scheduler->sched_lock));
+		LOCAL_RELEASE;
+		ORDERED_APPLY(myself->t_stateflags, & ~THREAD_SF_LOCK_SCHED);
+	}
 	
 	/*
 	 * If the thread isn't running right now:
@@ -364,7 +395,7 @@ void sched_actualize(struct thread* thread){
 		 * Remove the thread from it's containing queue.
 		 * And then reenqueue it.
 		 */
-		linked_ring_remove(&(thread->t_queue_entry));
+		sched_unlink(scheduler,thread);
 		sched_reenqueue(scheduler,thread);
 	}
 	/*
@@ -373,6 +404,11 @@ void sched_actualize(struct thread* thread){
 	kernlock_unlock(&(scheduler->sched_lock));
 	LOCAL_RELEASE;
 	ORDERED_APPLY(myself->t_stateflags, & ~THREAD_SF_LOCK_SCHED);
+	
+	/*
+	 * Wake the CPU up, if it doesn't tick.
+	 */
+	tick_wakeup(cpu);
 }
 
 /*
@@ -383,26 +419,35 @@ void sched_actualize(struct thread* thread){
  */
 void sched_preempt(){
 	threadp_t othr,nthr;
+	struct cpu* cpu;
 	struct scheduler* scheduler;
+	u_int32_t mode;
 	
 	/* Get scheduler. */
-	scheduler = kernel_get_current_cpu()->cpu_scheduler;
+	cpu = kernel_get_current_cpu();
+	scheduler = cpu->cpu_scheduler;
 	
 	/* Current thread. */
 	othr = kernel_get_current_thread();
 	
-	if((othr->t_stateflags) & THREAD_SF_LOCK_SCHED)
+	if( ((othr->t_stateflags) & THREAD_SF_LOCK_SCHED) || (othr->t_nonpreempt) ){
 		/*
 		 * Ooops. This thread is currently modifying this (or another)
-		 * scheduler. So, don't even touch the scheduler.
+		 * scheduler, or it is non-preemptible at this point. So, don't
+		 * even touch the scheduler, but keep ticking, to try again.
 		 */
+		tick_program(cpu,TICK_PERIODIC);
 		return;
+	}
 	
-	if(othr->t_nonpreempt)
-		/*
-		 * This thread is non-preemptible at this point.
-		 */
-		return;
+	/* Expired timers may wake threads up, so run them first. */
+	timer_run(cpu);
+	
+	/* Periodically pull work from overloaded CPUs. */
+	if( (++(scheduler->sched_preempts)) >= SCHED_BALANCE_INTERVAL ){
+		scheduler->sched_preempts = 0;
+		sched_balance(cpu);
+	}
 	
 	/* Synchronized{ */
 	kernlock_lock(&(scheduler->sched_lock));
@@ -428,11 +473,27 @@ void sched_preempt(){
 		kernel_set_current_thread(nthr);
 		othr->t_stateflags |= THREAD_SF_PREEMPT;
 		
-		/* Enqueue the old thread to the runnable queue. */
-		sched_reenqueue(scheduler,othr);
+		if(othr->t_stateflags & THREAD_SF_DEAD){
+			/*
+			 * The old thread has exited. We run on the CPU stack, not on its
+			 * stack, so it can be handed over for reuse right away.
+			 */
+			scheduler->sched_thread_count --;
+			othr->t_current_cpu = 0;
+			thread_release(othr);
+		}else{
+			/* Enqueue the old thread to the runnable queue. */
+			sched_reenqueue(scheduler,othr);
+		}
 	}
 	
+	/* Stop or stretch the tick, if there is nothing to time-slice. */
+	mode = tick_select_mode(cpu,nthr);
+	scheduler->sched_tick_mode = mode;
+	
 	kernlock_unlock(&(scheduler->sched_lock));
 	/* } */
+	
+	tick_program(cpu,mode);
 }
 
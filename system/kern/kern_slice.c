@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <sys/kernslice.h>
+
+static struct kernslice* ks_table[KS_MAX_SLICES];
+static u_int32_t         ks_count = 0;
+
+int kernslice_register(struct kernslice* slice){
+	u_int32_t i;
+	if(ks_count >= KS_MAX_SLICES) return 0;
+	slice->ks_index = ks_count;
+	for(i=0;i<KS_MAX_SLICES;++i)
+		slice->ks_distance[i] = KS_DISTANCE_REMOTE;
+	slice->ks_distance[ks_count] = KS_DISTANCE_LOCAL;
+	for(i=0;i<ks_count;++i)
+		ks_table[i]->ks_distance[ks_count] = KS_DISTANCE_REMOTE;
+	ks_table[ks_count++] = slice;
+	return -1;
+}
+
+u_int32_t kernslice_count(){
+	return ks_count;
+}
+
+struct kernslice* kernslice_get(u_int32_t idx){
+	if(idx >= ks_count) return 0;
+	return ks_table[idx];
+}
+
+u_int32_t kernslice_distance(struct kernslice* from, struct kernslice* to){
+	if(from == to) return KS_DISTANCE_LOCAL;
+	return from->ks_distance[to->ks_index];
+}
+
+void kernslice_set_distance(struct kernslice* from, struct kernslice* to, u_int32_t distance){
+	if(distance > 255) distance = 255;
+	from->ks_distance[to->ks_index] = (u_int8_t)distance;
+}
+
+struct kernslice* kernslice_find(paddr_t addr){
+	struct kernslice* slice;
+	u_int32_t  i;
+	u_intptr_t j;
+	
+	/* With only one slice, there is no need to look. */
+	if(ks_count == 1) return ks_table[0];
+	
+	for(i=0;i<ks_count;++i){
+		slice = ks_table[i];
+		for(j=0;j<slice->ks_num_memory_ranges;++j)
+			if( (slice->ks_memory_ranges[j].pm_begin <= addr) && (addr < slice->ks_memory_ranges[j].pm_end) )
+				return slice;
+	}
+	return 0;
+}
@@ -24,6 +24,9 @@
 #include <sys/cpu.h>
 #include <kern/zalloc.h>
 #include <kern/stacks.h>
+#include <kern/sched.h>
+#include <kern/wait_queue.h>
+#include <kern/wait.h>
 
 #define loop(i,n) for(i=0;i<n;++i)
 
@@ -31,9 +34,20 @@ static zone_t thread_zone; /* Thread zone */
 
 struct thread thread_template;
 
+/* Threads, that have exited. Their stacks are kept, to be reused. */
+static linked_ring_s thread_dead;
+static kspinlock_t   thread_dead_lock;
+
+/*
+ * Threads are kept constructed in the thread zone. They must be freed in that state.
+ */
+static void thread_ctor(void* obj){
+	struct thread* thr = obj;
+	*thr = thread_template;
+	linked_ring_init(&(thr->t_queue_entry));
+}
+
 void thread_init(){
-	thread_zone = zinit(sizeof(struct thread),ZONE_AUTO_REFILL,"threads");
-	
 	/* thread_template.t_queue_entry (later) */
 	thread_template.t_current_cpu = 0;
 	/* thread_template.t_storage[] (later) */
@@ -44,13 +58,65 @@ void thread_init(){
 	thread_template.t_nonpreempt  = 0;
 	/* thread_template.t_wait_entry (later) */
 	thread_template.t_wait_queue  = 0;
+	
+	thread_zone = zinit_ctor(sizeof(struct thread),ZONE_AUTO_REFILL,"threads",thread_ctor,0);
+	
+	linked_ring_init(&thread_dead);
+	kernlock_init(&thread_dead_lock);
+}
+
+/*
+ * Takes a thread, that has exited, and resets it, keeping its stacks.
+ * The scheduler takes 'thread_dead_lock' from within a preemption, so we must not
+ * be preempted, while holding it.
+ */
+static struct thread* thread_reuse(){
+	struct thread* self = kernel_get_current_thread();
+	struct thread* thr = 0;
+	struct kernel_stack* istobjs[2];
+	u_intptr_t istacks[2];
+	int i;
+	
+	if(self) self->t_nonpreempt++;
+	kernlock_lock(&thread_dead_lock);
+	if(!linked_ring_empty(&thread_dead)){
+		thr = thread_dead.next->data;
+		linked_ring_remove(&(thr->t_queue_entry));
+	}
+	kernlock_unlock(&thread_dead_lock);
+	if(self) self->t_nonpreempt--;
+	if(!thr) return 0;
+	
+	loop(i,2) istobjs[i] = thr->t_istobjs[i];
+	loop(i,2) istacks[i] = thr->t_istacks[i];
+	thread_ctor(thr);
+	loop(i,2) thr->t_istobjs[i] = istobjs[i];
+	loop(i,2) thr->t_istacks[i] = istacks[i];
+	thr->THREAD_LOCAL_INT_STACK = thr->t_istacks[0];
+	return thr;
+}
+
+void thread_release(struct thread* thread){
+	kernlock_lock(&thread_dead_lock);
+	thread->t_queue_entry.data = thread;
+	linked_ring_insert(&thread_dead,&(thread->t_queue_entry),1);
+	kernlock_unlock(&thread_dead_lock);
+}
+
+void thread_exit(){
+	struct thread* thread = kernel_get_current_thread();
+	thread->t_stateflags |= THREAD_SF_DEAD;
+	
+	/* Preemption might be deferred, so try again, until we are gone. */
+	for(;;) hal_induce_preemption();
 }
 
 struct thread* thread_allocate(){
 	int i;
-	struct thread* thr = zalloc(thread_zone);
+	struct thread* thr = thread_reuse();
+	if(thr) return thr;
+	thr = zalloc(thread_zone);
 	if(thr==0) return 0;
-	*thr = thread_template;
 	
 	/* thr->t_istobjs[] */
 	loop(i,2) thr->t_istobjs[i] = kernel_stack_allocate();
@@ -62,15 +128,32 @@ struct thread* thread_allocate(){
 	/* thr->t_storage[] */
 	thr->THREAD_LOCAL_INT_STACK = thr->t_istacks[0];
 	
-	linked_ring_init(&(thr->t_queue_entry));
-	
 	return thr;
 failure:
 	loop(i,2) if(thr->t_istobjs[i]) kernel_stack_release(thr->t_istobjs[i]);
+	loop(i,2) thr->t_istobjs[i] = 0;
 	zfree(thr);
 	return 0;
 }
 
+/*
+ * Creates a kernel thread, that runs 'func(arg)', and puts it onto the CPU chosen by
+ * sched_select_cpu().
+ * Kernel threads never enter user mode, so they run on their first interrupt stack.
+ * If 'func' returns, the thread exits (see thread_exit()).
+ */
+struct thread* thread_create_kernel(void (*func)(void*), void* arg, unsigned int priority){
+	struct cpu* cpu = sched_select_cpu();
+	struct thread* thr = thread_allocate();
+	if(!thr) return 0;
+	thr->t_priority = priority;
+	thr->t_current_cpu = cpu;
+	thr->t_stateflags |= THREAD_SF_PREEMPT;
+	hal_thread_setup(thr,thr->t_istacks[0],func,arg);
+	sched_insert(cpu,thr);
+	return thr;
+}
+
 struct thread* kernel_get_current_thread(){
 	return kernel_get_current_cpu()->cpu_current_thread;
 }
@@ -104,3 +187,15 @@ void thread_exit_syscall(){
 	hal_after_thread_switch();
 }
 
+void thread_sleep(u_int64_t ns){
+	kspinlock_t lock;
+	struct wait_queue queue;
+	
+	/* Wait on a private queue, that nobody else ever wakes up. */
+	kernlock_init(&lock);
+	linked_ring_init(&(queue.wq_threads));
+	
+	kernlock_lock(&lock);
+	waitqueue_wait_timeout(&lock,&queue,0,ns);
+	kernlock_unlock(&lock);
+}
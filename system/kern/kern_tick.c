@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <kern/tick.h>
+#include <kern/sched.h>
+#include <kern/timer.h>
+#include <kern/ktime.h>
+#include <sys/clockevent.h>
+#include <sys/cpu.h>
+#include <sys/thread.h>
+#include <sysarch/hal.h>
+
+/*
+ * The desired tick mode of a CPU is 'sched_tick_mode' of its scheduler. It is set
+ * under the scheduler lock, so that a CPU, which inserts a thread, sees, whether it
+ * has to wake the target CPU up. The mode, the clock event is actually programmed
+ * for, is 'ce_mode', which is only touched by the CPU itself.
+ */
+
+/*
+ * Returns the delay until the next timer expiry on 'cpu', but at most 'max'.
+ */
+static u_int32_t tick_next_expiry(struct cpu* cpu, u_int32_t max){
+	u_int64_t next,now;
+	u_int32_t us;
+	
+	/*
+	 * A non-preemptible thread might hold the lock of the timer wheel, so
+	 * don't look at it, but come back soon.
+	 */
+	if(kernel_get_current_thread()->t_nonpreempt) return (max < TICK_US) ? max : TICK_US;
+	
+	next = timer_next_expiry(cpu);
+	if(next == TIMER_NEVER) return max;
+	now = ktime_get_ns();
+	if(next <= now) return 1;
+	if((next-now) > 0xFFFFF000ULL) return max;
+	
+	/* Round up, so that the timer has expired, when the interrupt comes. */
+	us = ((u_int32_t)(next-now) + 999)/1000;
+	return (us < max) ? us : max;
+}
+
+void tick_start(struct cpu* cpu){
+	struct clock_event* ce = cpu->cpu_clock_event;
+	cpu->cpu_scheduler->sched_tick_mode = TICK_PERIODIC;
+	if(!ce) return;
+	ce->ce_periodic(ce,TICK_US);
+	ce->ce_mode = TICK_PERIODIC;
+}
+
+u_int32_t tick_select_mode(struct cpu* cpu, struct thread* next){
+	struct scheduler* scheduler = cpu->cpu_scheduler;
+	struct clock_event* ce = cpu->cpu_clock_event;
+	
+	if( (!ce) || !(ce->ce_features & CLOCK_EVENT_ONESHOT) ) return TICK_PERIODIC;
+	
+	/* Other runnable threads need the tick, for time slicing. */
+	if(scheduler->sched_run_bits) return TICK_PERIODIC;
+	
+	/* An idle CPU still has to wake up for its timers. */
+	if( (next == scheduler->sched_idle) && (timer_next_expiry(cpu) == TIMER_NEVER) )
+		return TICK_STOPPED;
+	return TICK_STRETCHED;
+}
+
+void tick_program(struct cpu* cpu, u_int32_t mode){
+	struct clock_event* ce = cpu->cpu_clock_event;
+	if(!ce) return;
+	switch(mode){
+	case TICK_PERIODIC:
+		/*
+		 * With a one-shot capable device, the periodic tick is made of
+		 * one-shots, so that timers, that expire within a tick, are served
+		 * on time.
+		 */
+		if(ce->ce_features & CLOCK_EVENT_ONESHOT)
+			ce->ce_oneshot(ce,tick_next_expiry(cpu,TICK_US));
+		else if(ce->ce_mode != TICK_PERIODIC)
+			ce->ce_periodic(ce,TICK_US);
+		break;
+	case TICK_STRETCHED:
+		/* The one-shot timer has fired, or is reset to the new expiry. */
+		ce->ce_oneshot(ce,tick_next_expiry(cpu,ce->ce_max_us));
+		break;
+	case TICK_STOPPED:
+		if(ce->ce_mode != TICK_STOPPED) ce->ce_stop(ce);
+		break;
+	}
+	ce->ce_mode = mode;
+}
+
+void tick_wakeup(struct cpu* cpu){
+	if(__atomic_load_n(&(cpu->cpu_scheduler->sched_tick_mode),__ATOMIC_RELAXED) != TICK_PERIODIC)
+		hal_cpu_kick(cpu);
+}
@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <kern/timer.h>
+#include <kern/ktime.h>
+#include <kern/kmalloc.h>
+#include <libkern/panic.h>
+#include <sys/cpu.h>
+#include <sys/kspinlock.h>
+#include <sys/thread.h>
+#include <sysarch/hal.h>
+
+/*
+ * Every CPU has a hierarchical timer wheel. The time is divided into granules of
+ * 2^TW_GRAN_SHIFT nanoseconds. Level 0 has one slot per granule, for the next
+ * TW_SLOTS granules; each further level has slots TW_SLOTS times as large. A timer
+ * is put into the slot of the lowest level, that reaches its expiry, so adding and
+ * removing a timer is a ring operation, plus a bit in the 'tw_pending' bitmap of
+ * the level.
+ *
+ * When the wheel reaches the start of a slot of a higher level, the timers of that
+ * slot are 'cascaded': they are reinserted, and thereby move to lower levels. The
+ * timers of a level 0 slot are compared to the exact time, before they expire, so
+ * the resolution is not limited to a granule.
+ *
+ * 'tw_clk' is the first granule, that has not been processed completely. Timers,
+ * that are already overdue, are put into its slot. The bitmaps let the wheel skip
+ * over empty slots, after the tick had been stopped or stretched.
+ *
+ * Threads, that hold the lock of a wheel, are non-preemptible, so that
+ * sched_preempt() doesn't process the wheel of the CPU meanwhile.
+ */
+#define TW_LEVELS      5
+#define TW_SLOT_BITS   6
+#define TW_SLOTS       (1<<TW_SLOT_BITS)
+#define TW_SLOT_MASK   (TW_SLOTS-1)
+#define TW_GRAN_SHIFT  16   /* 65.536 us */
+
+/* 'tm_level' of timers, that are not in a slot. */
+#define TW_NONE        0xFFFF  /* Not pending. */
+#define TW_EXPIRED     0xFFFE  /* On 'tw_expired', about to be called. */
+
+#define tw_shift(level)   ((level)*TW_SLOT_BITS)
+#define tw_span(level)    (((u_int64_t)TW_SLOTS) << tw_shift(level))
+
+struct timer_wheel{
+	linked_ring_s  tw_slots[TW_LEVELS][TW_SLOTS];
+	u_int64_t      tw_pending[TW_LEVELS];  /* bit (s) set: tw_slots[level][s] is non-empty */
+	linked_ring_s  tw_expired;             /* Expired timers, not yet called. */
+	u_int64_t      tw_clk;                 /* Current granule. */
+	u_intptr_t     tw_count;               /* Number of timers in the slots. */
+	struct timer*  tw_running;             /* The timer, whose function is running. */
+	kspinlock_t    tw_lock;
+};
+
+/* Lowest set bit of a non-zero bitmap, without a libgcc call on 32-bit CPUs. */
+static inline u_int32_t tw_ctz(u_int64_t bits){
+	u_int32_t lo = (u_int32_t)bits;
+	return lo ? __builtin_ctz(lo) : 32+__builtin_ctz((u_int32_t)(bits>>32));
+}
+
+static inline linked_ring_t timer_elem(struct timer* timer){
+	linked_ring_t ring = &(timer->tm_entry);
+	ring->data = timer;
+	return ring;
+}
+
+static void tw_enqueue(struct timer_wheel* tw, struct timer* timer){
+	u_int64_t e = timer->tm_expires >> TW_GRAN_SHIFT;
+	u_int32_t level,slot;
+	
+	if(e < tw->tw_clk) e = tw->tw_clk;
+	
+	for(level=0; level<(TW_LEVELS-1); ++level)
+		if((e - tw->tw_clk) < tw_span(level)) break;
+	
+	/*
+	 * Timers beyond the last level wait in its farthest slot, and get reinserted,
+	 * when it is cascaded.
+	 */
+	if((e - tw->tw_clk) >= tw_span(level)) e = tw->tw_clk + tw_span(level) - 1;
+	
+	slot = (u_int32_t)(e >> tw_shift(level)) & TW_SLOT_MASK;
+	linked_ring_insert(&(tw->tw_slots[level][slot]),timer_elem(timer),1);
+	tw->tw_pending[level] |= ((u_int64_t)1) << slot;
+	tw->tw_count++;
+	timer->tm_level = level;
+	timer->tm_slot  = slot;
+}
+
+static void tw_dequeue(struct timer_wheel* tw, struct timer* timer){
+	linked_ring_remove(&(timer->tm_entry));
+	if(timer->tm_level < TW_LEVELS){
+		if(linked_ring_empty(&(tw->tw_slots[timer->tm_level][timer->tm_slot])))
+			tw->tw_pending[timer->tm_level] &= ~(((u_int64_t)1) << timer->tm_slot);
+		tw->tw_count--;
+	}
+	timer->tm_level = TW_NONE;
+}
+
+/*
+ * Moves all timers of a slot to 'ring'.
+ */
+static void tw_take_slot(struct timer_wheel* tw, u_int32_t level, u_int32_t slot, linked_ring_t ring){
+	linked_ring_t head = &(tw->tw_slots[level][slot]);
+	linked_ring_t elem;
+	
+	linked_ring_init(ring);
+	while(head->next != head){
+		elem = head->next;
+		linked_ring_remove(elem);
+		linked_ring_insert(ring,elem,1);
+		tw->tw_count--;
+	}
+	tw->tw_pending[level] &= ~(((u_int64_t)1) << slot);
+}
+
+/*
+ * Returns the next granule, at which a slot has to be processed: either a level 0
+ * slot, that expires, or the start of a higher level slot, that is cascaded. The
+ * level is stored into '*plevel'. The wheel must not be empty.
+ */
+static u_int64_t tw_next_clk(struct timer_wheel* tw, u_int32_t* plevel){
+	u_int64_t best = TIMER_NEVER;
+	u_int64_t bits,next,rotation;
+	u_int32_t level,first,slot;
+	
+	for(level=0; level<TW_LEVELS; ++level){
+		bits = tw->tw_pending[level];
+		if(!bits) continue;
+		
+		/*
+		 * The current slot of a higher level has already been cascaded, so
+		 * anything in it belongs to the next rotation.
+		 */
+		rotation = tw->tw_clk >> tw_shift(level+1);
+		first = ((u_int32_t)(tw->tw_clk >> tw_shift(level)) & TW_SLOT_MASK) + (level?1:0);
+		if( (first < TW_SLOTS) && (bits >> first) ){
+			slot = first + tw_ctz(bits >> first);
+		}else{
+			slot = tw_ctz(bits);
+			rotation++;
+		}
+		next = (rotation << tw_shift(level+1)) + (((u_int64_t)slot) << tw_shift(level));
+		if(next < best){
+			best = next;
+			*plevel = level;
+		}
+	}
+	return best;
+}
+
+/*
+ * Advances the wheel to 'now', and moves the expired timers to 'tw_expired'.
+ */
+static void tw_advance(struct timer_wheel* tw, u_int64_t now){
+	u_int64_t nclk = now >> TW_GRAN_SHIFT;
+	u_int64_t clk;
+	u_int32_t level,slot;
+	linked_ring_s ring;
+	struct timer* timer;
+	
+	while(tw->tw_count){
+		clk = tw_next_clk(tw,&level);
+		if(clk > nclk) break;
+		tw->tw_clk = clk;
+		
+		/* Cascade the higher level slots, that start here. */
+		for(level=1; level<TW_LEVELS; ++level){
+			if(clk & (tw_span(level-1)-1)) break;
+			slot = (u_int32_t)(clk >> tw_shift(level)) & TW_SLOT_MASK;
+			tw_take_slot(tw,level,slot,&ring);
+			while(ring.next != &ring){
+				timer = ring.next->data;
+				linked_ring_remove(&(timer->tm_entry));
+				tw_enqueue(tw,timer);
+			}
+		}
+		
+		/*
+		 * Expire the level 0 slot. Timers, that expire later within the
+		 * current granule, or that were clamped to the last level, go back.
+		 */
+		tw_take_slot(tw,0,(u_int32_t)clk & TW_SLOT_MASK,&ring);
+		while(ring.next != &ring){
+			timer = ring.next->data;
+			linked_ring_remove(&(timer->tm_entry));
+			if(timer->tm_expires <= now){
+				linked_ring_insert(&(tw->tw_expired),&(timer->tm_entry),1);
+				timer->tm_level = TW_EXPIRED;
+			}else
+				tw_enqueue(tw,timer);
+		}
+		
+		if(clk == nclk) return;
+		tw->tw_clk = clk+1;
+	}
+	
+	/* Nothing is pending up to 'now'. */
+	if(tw->tw_clk < nclk) tw->tw_clk = nclk;
+}
+
+static u_int64_t tw_next_expiry(struct timer_wheel* tw){
+	u_int64_t clk,best;
+	u_int32_t level;
+	linked_ring_t head,elem;
+	
+	if(!tw->tw_count) return TIMER_NEVER;
+	clk = tw_next_clk(tw,&level);
+	
+	/* A cascade might move timers to earlier slots, so it counts as an expiry. */
+	if(level) return clk << TW_GRAN_SHIFT;
+	
+	head = &(tw->tw_slots[0][(u_int32_t)clk & TW_SLOT_MASK]);
+	best = TIMER_NEVER;
+	for(elem=head->next; elem!=head; elem=elem->next)
+		if(((struct timer*)elem->data)->tm_expires < best)
+			best = ((struct timer*)elem->data)->tm_expires;
+	return best;
+}
+
+void timer_wheel_init(struct cpu* cpu){
+	struct timer_wheel* tw;
+	u_int32_t level,slot;
+	
+	tw = kmalloc(sizeof(struct timer_wheel));
+	if(!tw) panic("Couldn't allocate the timer wheel for CPU %d!",(int)cpu->cpu_cpu_id);
+	
+	for(level=0; level<TW_LEVELS; ++level){
+		for(slot=0; slot<TW_SLOTS; ++slot)
+			linked_ring_init(&(tw->tw_slots[level][slot]));
+		tw->tw_pending[level] = 0;
+	}
+	linked_ring_init(&(tw->tw_expired));
+	tw->tw_clk     = ktime_get_ns() >> TW_GRAN_SHIFT;
+	tw->tw_count   = 0;
+	tw->tw_running = 0;
+	kernlock_init(&(tw->tw_lock));
+	
+	cpu->cpu_timer_wheel = tw;
+}
+
+void timer_init(struct timer* timer, void (*func)(struct timer* timer), void* arg){
+	timer->tm_expires = 0;
+	timer->tm_func    = func;
+	timer->tm_arg     = arg;
+	timer->tm_wheel   = 0;
+	timer->tm_level   = TW_NONE;
+	timer->tm_slot    = 0;
+}
+
+void timer_add(struct timer* timer, u_int64_t expires){
+	struct thread* self = kernel_get_current_thread();
+	struct cpu* cpu;
+	struct timer_wheel* tw;
+	int first;
+	
+	self->t_nonpreempt++;
+	cpu = kernel_get_current_cpu();
+	tw = cpu->cpu_timer_wheel;
+	
+	kernlock_lock(&(tw->tw_lock));
+	first = expires < tw_next_expiry(tw);
+	timer->tm_expires = expires;
+	timer->tm_wheel   = tw;
+	tw_enqueue(tw,timer);
+	kernlock_unlock(&(tw->tw_lock));
+	
+	self->t_nonpreempt--;
+	
+	/* The clock event may be programmed for a later expiry. */
+	if(first) hal_cpu_kick(cpu);
+}
+
+int timer_cancel(struct timer* timer){
+	struct thread* self = kernel_get_current_thread();
+	struct timer_wheel* tw = timer->tm_wheel;
+	int pending,running;
+	
+	if(!tw) return 0;
+	
+	self->t_nonpreempt++;
+	kernlock_lock(&(tw->tw_lock));
+	pending = (timer->tm_level != TW_NONE);
+	if(pending) tw_dequeue(tw,timer);
+	kernlock_unlock(&(tw->tw_lock));
+	self->t_nonpreempt--;
+	
+	if(pending) return 1;
+	
+	/* Wait for the function, if it is running on the CPU of the wheel. */
+	do{
+		self->t_nonpreempt++;
+		kernlock_lock(&(tw->tw_lock));
+		running = (tw->tw_running == timer);
+		kernlock_unlock(&(tw->tw_lock));
+		self->t_nonpreempt--;
+	}while(running);
+	return 0;
+}
+
+void timer_run(struct cpu* cpu){
+	struct timer_wheel* tw = cpu->cpu_timer_wheel;
+	struct timer* timer;
+	
+	if(!tw) return;
+	
+	kernlock_lock(&(tw->tw_lock));
+	tw_advance(tw,ktime_get_ns());
+	
+	/*
+	 * The functions are called without the lock, so that they can add timers.
+	 * The timer isn't touched after its function returned, as it may be gone.
+	 */
+	while(tw->tw_expired.next != &(tw->tw_expired)){
+		timer = tw->tw_expired.next->data;
+		linked_ring_remove(&(timer->tm_entry));
+		timer->tm_level = TW_NONE;
+		tw->tw_running = timer;
+		kernlock_unlock(&(tw->tw_lock));
+		
+		timer->tm_func(timer);
+		
+		kernlock_lock(&(tw->tw_lock));
+		tw->tw_running = 0;
+	}
+	kernlock_unlock(&(tw->tw_lock));
+}
+
+u_int64_t timer_next_expiry(struct cpu* cpu){
+	struct timer_wheel* tw = cpu->cpu_timer_wheel;
+	u_int64_t next;
+	
+	if(!tw) return TIMER_NEVER;
+	
+	kernlock_lock(&(tw->tw_lock));
+	next = tw_next_expiry(tw);
+	kernlock_unlock(&(tw->tw_lock));
+	return next;
+}
@@ -22,6 +22,8 @@
 #include <kern/sched.h>
 #include <kern/wait_queue.h>
 #include <kern/wait.h>
+#include <kern/timer.h>
+#include <kern/ktime.h>
 #include <sys/thread.h>
 #include <sysarch/hal.h>
 
@@ -41,6 +43,7 @@ static inline linked_ring_t waitqueue_elem(struct thread* thread){
 
 void waitqueue_enter(struct wait_queue* queue,struct thread* thread,int after){
 	linked_ring_insert(&(queue->wq_threads), waitqueue_elem(thread), after);
+	thread->t_wait_queue = queue;
 }
 
 int waitqueue_get_first(struct wait_queue* queue){
@@ -104,3 +107,47 @@ void waitqueue_wait(kspinlock_t* lock,struct wait_queue* queue,int after){
 	kernlock_lock(lock);
 }
 
+/*
+ * The timeout of waitqueue_wait_timeout(). The wait-queue is protected by the
+ * caller's lock, which can't be taken here, so the thread is only made runnable
+ * by clearing the THREAD_SF_QUEUE_WAIT flag. It leaves the queue by itself.
+ */
+static void waitqueue_timeout(struct timer* timer){
+	struct thread* thread = timer->tm_arg;
+	__atomic_and_fetch(&(thread->t_stateflags),~THREAD_SF_QUEUE_WAIT,__ATOMIC_RELAXED);
+	sched_actualize(thread);
+}
+
+int waitqueue_wait_timeout(kspinlock_t* lock,struct wait_queue* queue,int after,u_int64_t ns){
+	struct thread* self = kernel_get_current_thread();
+	struct timer timer;
+	
+	timer_init(&timer,waitqueue_timeout,self);
+	
+	waitqueue_enter(queue,self,after);
+	kernlock_unlock(lock);
+	self->t_stateflags |=  THREAD_SF_QUEUE_WAIT;
+	
+	/*
+	 * Arm the timer after the flag has been set, so that an early expiry can't
+	 * be overwritten.
+	 */
+	timer_add(&timer,ktime_get_ns()+ns);
+	
+	hal_induce_preemption();
+	
+	/* The timer lives on this stack, so make sure, it's gone. */
+	timer_cancel(&timer);
+	self->t_stateflags &= ~THREAD_SF_QUEUE_WAIT;
+	
+	kernlock_lock(lock);
+	
+	/*
+	 * If the thread has been removed from the queue, it got woken up, even if
+	 * the timer has expired as well.
+	 */
+	if(!self->t_wait_queue) return 1;
+	linked_ring_remove(&(self->t_wait_entry));
+	self->t_wait_queue = 0;
+	return 0;
+}
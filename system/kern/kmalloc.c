@@ -0,0 +1,129 @@
+/*
+ * 
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <kern/kmalloc.h>
+#include <kern/zalloc.h>
+#include <vm/vm_top.h>
+#include <sysarch/pages.h>
+#include <libkern/panic.h>
+
+/*
+ * The size classes. Every class is a multiple of 16 bytes, and the zones keep them
+ * as they are (ZONE_SIZECLASS). The two largest classes fit 3 and 2 objects into a
+ * slab, instead of wasting the remainder of it.
+ */
+#define KM_NCLASSES 12
+
+static const size_t km_sizes[KM_NCLASSES] = {
+	16, 32, 64, 128, 192, 256, 384, 512, 768, 1024, 1344, 1984
+};
+
+static const char* km_names[KM_NCLASSES] = {
+	"kmalloc.16",   "kmalloc.32",   "kmalloc.64",   "kmalloc.128",
+	"kmalloc.192",  "kmalloc.256",  "kmalloc.384",  "kmalloc.512",
+	"kmalloc.768",  "kmalloc.1024", "kmalloc.1344", "kmalloc.1984"
+};
+
+static zone_t km_zones[KM_NCLASSES];
+
+/* Size class index by (size-1)/16, for sizes up to 128. */
+static const u_int8_t km_small_idx[8] = { 0, 1, 2, 2, 3, 3, 3, 3 };
+
+/* Size class index by (size-1)/64, for sizes up to 1984. */
+static const u_int8_t km_large_idx[31] = {
+	 3,  3,  4,  5,  6,  6,  7,  7,
+	 8,  8,  8,  8,  9,  9,  9,  9,
+	10, 10, 10, 10, 10, 11, 11, 11,
+	11, 11, 11, 11, 11, 11, 11
+};
+
+/*
+ * Large allocations are prefixed by a header, so the returned pointer is at a
+ * page offset of KM_HDR_SIZE. As every size class is a multiple of 16, no object
+ * from a size class zone can ever be at this offset.
+ */
+#define KM_HDR_SIZE  8
+#define KM_MAGIC     0x4B4D4C47
+
+struct km_large_hdr {
+	u_int32_t kh_magic;
+	u_int32_t kh_size;   /* Size of the allocation, including the header. */
+};
+
+void kmalloc_init(){
+	int i;
+	for(i=0;i<KM_NCLASSES;++i)
+		km_zones[i] = zinit(km_sizes[i],ZONE_AUTO_REFILL|ZONE_SIZECLASS,km_names[i]);
+}
+
+void* kmalloc(size_t size){
+	struct km_large_hdr* hdr;
+	vaddr_t begin,vsize;
+	
+	if(!size) size = 1;
+	if(size <= 128)
+		return zalloc(km_zones[km_small_idx[(size-1)>>4]]);
+	if(size <= KMALLOC_MAX_SMALL)
+		return zalloc(km_zones[km_large_idx[(size-1)>>6]]);
+	
+	vsize = size + KM_HDR_SIZE;
+	if(!vm_kalloc_ll(&begin,&vsize)) return 0;
+	hdr = (struct km_large_hdr*)begin;
+	hdr->kh_magic = KM_MAGIC;
+	hdr->kh_size = vsize;
+	return (void*)(begin + KM_HDR_SIZE);
+}
+
+void  kfree(void* ptr){
+	struct km_large_hdr* hdr;
+	if(!ptr) return;
+	if((((u_intptr_t)ptr) & (SYSARCH_PAGESIZE-1)) != KM_HDR_SIZE){
+		zfree(ptr);
+		return;
+	}
+	hdr = (struct km_large_hdr*)(((u_intptr_t)ptr) - KM_HDR_SIZE);
+	if(hdr->kh_magic != KM_MAGIC) panic("kfree: bad pointer %p",ptr);
+	hdr->kh_magic = 0;
+	if(!vm_kfree_ll((vaddr_t)hdr)) panic("kfree: bad pointer %p",ptr);
+}
+
+/*
+ * The sizes cover a single page, a few pages, and more than a buddy block of the
+ * largest order, which has to be pieced together from several ranges.
+ */
+static const size_t km_check_sizes[] = {
+	KMALLOC_MAX_SMALL+1, 3*SYSARCH_PAGESIZE, 1100*SYSARCH_PAGESIZE
+};
+
+void kmalloc_check(){
+	u_int8_t* buf;
+	size_t size,i;
+	u_int32_t j;
+	for(j=0;j<(sizeof(km_check_sizes)/sizeof(km_check_sizes[0]));++j){
+		size = km_check_sizes[j];
+		buf = kmalloc(size);
+		if(!buf) panic("kmalloc_check: can't allocate %u bytes",(unsigned)size);
+		for(i=0;i<size;i+=SYSARCH_PAGESIZE) buf[i] = (u_int8_t)j;
+		buf[size-1] = (u_int8_t)j;
+		kfree(buf);
+	}
+}
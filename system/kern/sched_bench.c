@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <kern/sched.h>
+#include <kern/zalloc.h>
+#include <sys/cpu.h>
+#include <sys/thread.h>
+#include <sysarch/hal.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * The benchmark runs on a private scheduler, attached to a fake CPU. The threads
+ * are never run, so only the fields used by the scheduler are set up.
+ */
+#define BENCH_THREADS  32
+#define BENCH_ROUNDS   1024
+
+static const u_int32_t bench_populated[] = { 1, 8, 32 };
+
+static struct cpu     bench_cpu;
+static struct thread  bench_threads[BENCH_THREADS];
+
+/*
+ * Spreads the threads evenly over 'npri' priorities, then measures sched_remove()
+ * followed by sched_insert() of the removed thread, as it happens on a switch.
+ */
+static void bench_run(u_int32_t npri){
+	u_int64_t t;
+	u_int32_t i,total;
+	struct thread* thr;
+	
+	sched_instanciate(&bench_cpu);
+	for(i=0;i<BENCH_THREADS;++i){
+		memset(&bench_threads[i],0,sizeof(struct thread));
+		bench_threads[i].t_priority = (i % npri) * (SCHED_NRQS / npri);
+		sched_insert(&bench_cpu,&bench_threads[i]);
+	}
+	
+	t = hal_cycles();
+	for(i=0;i<BENCH_ROUNDS;++i){
+		thr = sched_remove(&bench_cpu);
+		if(!thr) break;
+		sched_insert(&bench_cpu,thr);
+	}
+	total = (u_int32_t)(hal_cycles()-t);
+	
+	printf("sched: %u priorities: %u cycles/switch\n",
+		(unsigned)npri,(unsigned)(total/BENCH_ROUNDS));
+	
+	zfree(bench_cpu.cpu_scheduler);
+	bench_cpu.cpu_scheduler = 0;
+}
+
+void sched_benchmark(){
+	u_int32_t i;
+	
+	for(i=0;i<(sizeof(bench_populated)/sizeof(bench_populated[0]));++i)
+		bench_run(bench_populated[i]);
+}
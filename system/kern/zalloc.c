@@ -23,25 +23,84 @@
 #include <kern/zalloc_priv.h>
 #include <libkern/panic.h>
 #include <vm/vm_top.h>
+#include <sys/cpu.h>
+#include <sys/thread.h>
+#include <sys/kterm.h>
+#include <libkern/iopipe.h>
+#include <kern/wait.h>
+#include <kern/wait_queue.h>
+#include <sysarch/hal.h>
 
 static struct zone s_zone_zone;
+static struct zone s_zmag_zone;
 typedef void* Pointer;
 static zone_t zone_zone = 0;
+static zone_t zmag_zone = 0;
 
 /* This code is largely inspired by the MACH operating system by the CMU. */
 
 /* This is the size of a cache line (in x86). */
 #define BUF_LINE  128
 
-static u_int8_t szz_buf[1<<16] __attribute__ ((aligned (BUF_LINE)));
+static u_int8_t szz_buf[1<<16] __attribute__ ((aligned (SYSARCH_PAGESIZE)));
+static u_int8_t szm_buf[1<<14] __attribute__ ((aligned (SYSARCH_PAGESIZE)));
+
+/* The magazine cache of the boot CPU. */
+static struct zone_cpu_cache boot_cpu_cache;
+
+static struct zone_cpu_cache* zone_cpu_caches = 0;
+static int                    zone_cpu_next_idx = 0;
+static kspinlock_t            zone_cpu_lock;
+
+/* The list of all zones. Zones are never destroyed. */
+static zone_t                 zone_list = 0;
+static kspinlock_t            zone_list_lock;
+static u_int32_t              zone_list_walkers = 0; /* See zone_list_enter(). */
+
+static int                    zgc_wanted = 0;
+
+/* The refill thread. */
+static struct thread*         zrefill_thread = 0;
+static struct wait_queue      zrefill_queue;
+static kspinlock_t            zrefill_lock;
+static int                    zrefill_pending = 0;
+
+/* Threads waiting for a busy synchronous refill to finish. */
+static struct wait_queue      zrefill_done;
+
+/* Results of zone_refill(). */
+#define ZR_FAILED  0
+#define ZR_DONE    1
+#define ZR_BUSY    2
+
+/*
+ * Acquires the zone lock, and counts, how often we had to spin for it.
+ */
+static inline void zone_lock(zone_t zone){
+	u_int32_t spins = 0;
+	while(kernlock_try_lock(&(zone->zn_lock))) spins++;
+	zone->zn_lock_spins += spins;
+}
+
+#define zone_unlock(zone) kernlock_unlock(&((zone)->zn_lock))
 
 static void _zcram(zone_t zone, void* mem, size_t size);
-static void _zrefill(zone_t zone, u_int32_t min, u_int32_t num);
+static int  zone_refill(zone_t zone, u_int32_t target);
+static void zone_refill_wakeup(zone_t zone);
+static int  zone_refill_wait(zone_t zone);
+static void zslab_destruct(zone_t zone, struct zslab* slab);
+static void zlf_drain(zone_t zone);
+
+/* The freelist link of a free object. */
+#define ZLINK(zone,obj) (*((Pointer*)((obj) + (zone)->zn_link_off)))
 
-static size_t calc_bufsize(size_t size) {
+static size_t calc_bufsize(size_t size, unsigned int memtype) {
 	size_t num = 0;
 	size_t mul = 1;
-	size += sizeof(Pointer);
+	/* A free object must be able to hold the freelist pointer. */
+	if(size < sizeof(Pointer)) size = sizeof(Pointer);
+	/* Size classes are chosen to fill the slabs, don't round them up any further. */
+	if(memtype & ZONE_SIZECLASS) return (size + 15) & ~((size_t)15);
 	while(num<size){
 		if(num<BUF_LINE){
 			mul<<=1;
@@ -53,89 +112,600 @@ static size_t calc_bufsize(size_t size) {
 	return num;
 }
 
-static Pointer remove_top(zone_t zone){
-	Pointer top = zone->zn_freelist;
-	if(top){
-		/* Set the zn_freelist-pointer to the next element. */
-		zone->zn_freelist = *((Pointer*)top);
-		/* Stash a reference to the zone in the 'next'-field. */
-		*((Pointer*)top) = (Pointer) zone;
-		/* use the space behind the 'next'-field. */
-		top += sizeof(Pointer);
-		zone->zn_count--;
+/*
+ * Turns a page into a slab, and inserts it into the zone's empty slab list.
+ */
+static void zslab_init(zone_t zone, void* page, u_int16_t flags){
+	struct zslab* slab = ZSLAB_OF(page);
+	size_t bufsize = zone->zn_bufsize;
+	u_int32_t i,n = zone->zn_slab_objs;
+	Pointer mem = page;
+	
+	slab->zs_zone = zone;
+	slab->zs_freelist = 0;
+	slab->zs_free = n;
+	slab->zs_total = n;
+	slab->zs_flags = flags;
+	slab->zs_magic = ZSLAB_MAGIC;
+	for(i=0;i<n;++i, mem += bufsize){
+		if(zone->zn_ctor) zone->zn_ctor(mem);
+		ZLINK(zone,mem) = slab->zs_freelist;
+		slab->zs_freelist = mem;
 	}
+	list_push_head(&(zone->zn_slabs_empty),&(slab->zs_link));
+	zone->zn_count += n;
+	zone->zn_nslabs++;
+	zone->zn_nslabs_empty++;
+}
+
+/*
+ * Allocates an object from the zone's slabs. Partially used slabs are preferred, so
+ * that empty slabs stay empty and can be reclaimed.
+ */
+static Pointer zslab_alloc(zone_t zone){
+	struct zslab* slab;
+	list_node_t node;
+	Pointer top;
+	
+	if(!list_is_empty(&(zone->zn_slabs_partial))){
+		node = zone->zn_slabs_partial.next;
+	}else if(!list_is_empty(&(zone->zn_slabs_empty))){
+		node = zone->zn_slabs_empty.next;
+		zone->zn_nslabs_empty--;
+	}else return 0;
+	slab = containerof(node,struct zslab,zs_link);
+	
+	top = slab->zs_freelist;
+	slab->zs_freelist = ZLINK(zone,top);
+	slab->zs_free--;
+	zone->zn_count--;
+	zone->zn_inuse++;
+	if(zone->zn_inuse > zone->zn_peak_inuse) zone->zn_peak_inuse = zone->zn_inuse;
+	
+	list_item_remove(node);
+	if(slab->zs_free) list_push_head(&(zone->zn_slabs_partial),node);
+	else              list_push_head(&(zone->zn_slabs_full),node);
 	return top;
 }
 
+/*
+ * Returns an object to it's slab.
+ */
+static void zslab_free(zone_t zone, Pointer object){
+	struct zslab* slab = ZSLAB_OF(object);
+	
+	ZLINK(zone,object) = slab->zs_freelist;
+	slab->zs_freelist = object;
+	slab->zs_free++;
+	zone->zn_count++;
+	zone->zn_inuse--;
+	
+	if(slab->zs_free == slab->zs_total){
+		list_item_remove(&(slab->zs_link));
+		list_push_head(&(zone->zn_slabs_empty),&(slab->zs_link));
+		zone->zn_nslabs_empty++;
+	}else if(slab->zs_free == 1){
+		list_item_remove(&(slab->zs_link));
+		list_push_head(&(zone->zn_slabs_partial),&(slab->zs_link));
+	}
+}
+
+static void zone_setup(zone_t z, size_t size, unsigned int memtype, const char* name,
+		zone_ctor_t ctor, zone_dtor_t dtor){
+	z->zn_objsize = size;
+	z->zn_ctor = ctor;
+	z->zn_dtor = dtor;
+	if(ctor){
+		/*
+		 * Free objects stay constructed, so the freelist link can't overlay the
+		 * object. Put it behind the object instead.
+		 */
+		z->zn_link_off = (size + sizeof(Pointer) - 1) & ~(sizeof(Pointer) - 1);
+		z->zn_bufsize = calc_bufsize(z->zn_link_off + sizeof(Pointer),memtype);
+	}else{
+		z->zn_link_off = 0;
+		z->zn_bufsize = calc_bufsize(size,memtype);
+	}
+	z->zn_count = 0;
+	z->zn_memtype = memtype;
+	if(name)
+		z->zn_name = name;
+	else
+		z->zn_name = "(null)";
+	if(z->zn_bufsize > ZSLAB_USABLE) panic("zinit: object too large: %s",z->zn_name);
+	z->zn_cpu_idx = -1;
+	z->zn_depot_full = 0;
+	z->zn_depot_empty = 0;
+	z->zn_depot_nfull = 0;
+	z->zn_depot_nempty = 0;
+	list_init(&(z->zn_slabs_partial));
+	list_init(&(z->zn_slabs_full));
+	list_init(&(z->zn_slabs_empty));
+	z->zn_slab_objs = ZSLAB_USABLE / z->zn_bufsize;
+	z->zn_nslabs = 0;
+	z->zn_nslabs_empty = 0;
+	z->zn_allocs = 0;
+	z->zn_frees = 0;
+	z->zn_refills = 0;
+	z->zn_refill_fails = 0;
+	z->zn_inuse = 0;
+	z->zn_peak_inuse = 0;
+	z->zn_lock_spins = 0;
+	z->zn_minimum = ZONE_WM_MIN;
+	z->zn_lowat = ZONE_WM_LOW;
+	z->zn_hiwat = ZONE_WM_HIGH;
+	z->zn_refill_queued = 0;
+	z->zn_refiller = 0;
+	kernlock_init(&(z->zn_refill_lock));
+	z->zn_lf_head.zh_top = 0;
+	z->zn_lf_head.zh_gen = 0;
+	z->zn_lf_count = 0;
+	z->zn_lf_allocs = 0;
+	z->zn_lf_frees = 0;
+	kernlock_init(&(z->zn_lock));
+	
+	kernlock_lock(&zone_list_lock);
+	z->zn_next = zone_list;
+	zone_list = z;
+	kernlock_unlock(&zone_list_lock);
+}
+
+/*
+ * The zone list is walked without holding 'zone_list_lock', as the walkers do work,
+ * that may block. zdestroy() unlinks a zone, and waits until all walkers, that might
+ * still see it, have left, before it frees the zone.
+ */
+static zone_t zone_list_enter(){
+	zone_t zone;
+	kernlock_lock(&zone_list_lock);
+	__atomic_add_fetch(&zone_list_walkers,1,__ATOMIC_ACQ_REL);
+	zone = zone_list;
+	kernlock_unlock(&zone_list_lock);
+	return zone;
+}
+
+static void zone_list_leave(){
+	__atomic_sub_fetch(&zone_list_walkers,1,__ATOMIC_ACQ_REL);
+}
+
 void zone_bootstrap(){
-	s_zone_zone.zn_bufsize = calc_bufsize(sizeof(struct zone));
-	s_zone_zone.zn_freelist = 0;
-	s_zone_zone.zn_name = "zone";
-	s_zone_zone.zn_count = 0;
-	kernlock_init(&(s_zone_zone.zn_lock));
+	kernlock_init(&zone_list_lock);
+	zone_list = 0;
+	kernlock_init(&zrefill_lock);
+	linked_ring_init(&(zrefill_done.wq_threads));
+	
+	zone_setup(&s_zone_zone,sizeof(struct zone),ZONE_NOCACHE,"zone",0,0);
 	_zcram(&s_zone_zone,szz_buf,sizeof(szz_buf));
 	zone_zone = &s_zone_zone;
+	
+	/*
+	 * Magazines are allocated from an uncached zone, so the magazine layer never
+	 * recurses into itself. Refills only touch the critical VM zones, which are
+	 * uncached as well. The depot exchange hits this zone from all CPUs, so it
+	 * uses the lock-free stack.
+	 */
+	zone_setup(&s_zmag_zone,sizeof(struct zmag),
+		ZONE_AUTO_REFILL|ZONE_AR_CRITICAL|ZONE_NOCACHE|ZONE_LOCKFREE,"magazines",0,0);
+	_zcram(&s_zmag_zone,szm_buf,sizeof(szm_buf));
+	zmag_zone = &s_zmag_zone;
+	
+	kernlock_init(&zone_cpu_lock);
+	zone_cpu_caches = 0;
+	zone_cpu_next_idx = 0;
+	zone_cpu_init(kernel_get_current_cpu());
+}
+
+static void zone_cpu_cache_register(struct cpu* cpu, struct zone_cpu_cache* zcc){
+	int i;
+	for(i=0;i<ZONE_NCPUCACHE;++i){
+		zcc->zcc_zones[i].zc_loaded   = 0;
+		zcc->zcc_zones[i].zc_previous = 0;
+		zcc->zcc_zones[i].zc_hits     = 0;
+		zcc->zcc_zones[i].zc_misses   = 0;
+		zcc->zcc_zones[i].zc_allocs   = 0;
+		zcc->zcc_zones[i].zc_frees    = 0;
+	}
+	kernlock_lock(&zone_cpu_lock);
+	zcc->zcc_next = zone_cpu_caches;
+	zone_cpu_caches = zcc;
+	kernlock_unlock(&zone_cpu_lock);
+	cpu->cpu_zone_cache = zcc;
+}
+
+void zone_cpu_init(struct cpu* cpu){
+	vaddr_t begin,size;
+	if(!cpu) return;
+	if(!zone_cpu_caches){
+		zone_cpu_cache_register(cpu,&boot_cpu_cache);
+		return;
+	}
+	size = sizeof(struct zone_cpu_cache);
+	if(!vm_kalloc_ll(&begin,&size)) panic("zone_cpu_init: out of memory");
+	zone_cpu_cache_register(cpu,(struct zone_cpu_cache*)begin);
 }
 
 zone_t zinit(size_t size, unsigned int memtype, const char* name){
+	return zinit_ctor(size,memtype,name,0,0);
+}
+
+zone_t zinit_ctor(size_t size, unsigned int memtype, const char* name,
+		zone_ctor_t ctor, zone_dtor_t dtor){
 	zone_t z;
 	if(!zone_zone) panic("zinit: no zone_zone");
 	z = zalloc(zone_zone);
 	if(!z) panic("zinit");
-	z->zn_bufsize = calc_bufsize(size);
-	z->zn_freelist = 0;
-	z->zn_memtype = memtype;
-	if(name)
-		z->zn_name = name;
-	else
-		z->zn_name = "(null)";
-	kernlock_init(&(z->zn_lock));
+	zone_setup(z,size,memtype,name,ctor,dtor);
+	if(!(memtype & ZONE_NOCACHE)){
+		kernlock_lock(&zone_cpu_lock);
+		if(zone_cpu_next_idx < ZONE_NCPUCACHE)
+			z->zn_cpu_idx = zone_cpu_next_idx++;
+		kernlock_unlock(&zone_cpu_lock);
+	}
 	return z;
 }
 
+void zdestroy(zone_t zone){
+	zone_t* link;
+	list_node_t node;
+	struct zslab* slab;
+	list_node_s reclaim;
+	
+	if(zone->zn_cpu_idx >= 0) panic("zdestroy: %s is cached",zone->zn_name);
+	
+	kernlock_lock(&zone_list_lock);
+	for(link = &zone_list; *link; link = &((*link)->zn_next)){
+		if(*link != zone) continue;
+		*link = zone->zn_next;
+		break;
+	}
+	kernlock_unlock(&zone_list_lock);
+	
+	/* Wait for the walkers, that might still see the zone (a refill, or zgc()). */
+	while(__atomic_load_n(&zone_list_walkers,__ATOMIC_ACQUIRE))
+		hal_induce_preemption();
+	
+	zone_lock(zone);
+	if((zone->zn_memtype) & ZONE_LOCKFREE) zlf_drain(zone);
+	if(zone->zn_inuse) panic("zdestroy: %s has %u objects in use",zone->zn_name,(unsigned)zone->zn_inuse);
+	list_init(&reclaim);
+	while((node = list_pop_head(&(zone->zn_slabs_empty))))
+		list_push_head(&reclaim,node);
+	zone_unlock(zone);
+	
+	while((node = list_pop_head(&reclaim))){
+		slab = containerof(node,struct zslab,zs_link);
+		if(slab->zs_flags & ZSLAB_STATIC) continue;
+		if(zone->zn_dtor) zslab_destruct(zone,slab);
+		vm_kfree_ll((vaddr_t)ZSLAB_PAGE(slab));
+	}
+	zfree(zone);
+}
+
+/*
+ * The magazine layer must not be interrupted by another thread on the same CPU, and
+ * the thread must not be migrated to another CPU, while it works on the CPU's
+ * magazines. So we disable preemption while accessing them.
+ */
+static inline struct zone_cpu* zone_cpu_enter(zone_t zone){
+	struct cpu* cpu;
+	struct thread* thread;
+	if(zone->zn_cpu_idx < 0) return 0;
+	cpu = kernel_get_current_cpu();
+	if(!(cpu->cpu_zone_cache)) return 0;
+	thread = cpu->cpu_current_thread;
+	if(thread) thread->t_nonpreempt++;
+	__atomic_signal_fence(__ATOMIC_ACQUIRE);
+	return &(cpu->cpu_zone_cache->zcc_zones[zone->zn_cpu_idx]);
+}
+
+static inline void zone_cpu_leave(){
+	struct thread* thread = kernel_get_current_cpu()->cpu_current_thread;
+	__atomic_signal_fence(__ATOMIC_RELEASE);
+	if(thread) thread->t_nonpreempt--;
+}
+
+static inline void zone_cpu_swap(struct zone_cpu* zc){
+	struct zmag* mag = zc->zc_loaded;
+	zc->zc_loaded = zc->zc_previous;
+	zc->zc_previous = mag;
+}
+
+/*
+ * Pops an object from the lock-free stack.
+ */
+static Pointer zlf_pop(zone_t zone){
+	union zlf_head old,new;
+	old.zh_raw = zone->zn_lf_head.zh_raw;
+	do{
+		if(!old.zh_top) return 0;
+		new.zh_top = ZLINK(zone,(Pointer)old.zh_top);
+		new.zh_gen = old.zh_gen+1;
+	}while(!arch_cas64(&(zone->zn_lf_head.zh_raw),&(old.zh_raw),new.zh_raw));
+	__atomic_sub_fetch(&(zone->zn_lf_count),1,__ATOMIC_RELAXED);
+	return old.zh_top;
+}
+
+/*
+ * Pushes an object onto the lock-free stack.
+ */
+static void zlf_push(zone_t zone, Pointer object){
+	union zlf_head old,new;
+	__atomic_add_fetch(&(zone->zn_lf_count),1,__ATOMIC_RELAXED);
+	old.zh_raw = zone->zn_lf_head.zh_raw;
+	new.zh_top = object;
+	do{
+		ZLINK(zone,object) = old.zh_top;
+		new.zh_gen = old.zh_gen+1;
+	}while(!arch_cas64(&(zone->zn_lf_head.zh_raw),&(old.zh_raw),new.zh_raw));
+}
+
+/*
+ * Detaches the whole lock-free stack, and returns it's objects to the slabs.
+ * Called with the zone lock held.
+ */
+static void zlf_drain(zone_t zone){
+	union zlf_head old,new;
+	Pointer obj;
+	u_int32_t n = 0;
+	old.zh_raw = zone->zn_lf_head.zh_raw;
+	new.zh_top = 0;
+	do{
+		if(!old.zh_top) return;
+		new.zh_gen = old.zh_gen+1;
+	}while(!arch_cas64(&(zone->zn_lf_head.zh_raw),&(old.zh_raw),new.zh_raw));
+	
+	obj = old.zh_top;
+	while(obj){
+		old.zh_top = ZLINK(zone,obj);
+		zslab_free(zone,obj);
+		obj = old.zh_top;
+		n++;
+	}
+	__atomic_sub_fetch(&(zone->zn_lf_count),n,__ATOMIC_RELAXED);
+}
+
+/*
+ * Magazine allocation. Returns 0 if the object had to be allocated from the zone.
+ */
+static Pointer zmag_alloc(zone_t zone, struct zone_cpu* zc){
+	struct zmag* mag;
+	
+	/* Fast path: the loaded magazine has rounds. */
+	mag = zc->zc_loaded;
+	if(mag && mag->zm_rounds){
+		zc->zc_hits++;
+		return mag->zm_objs[--(mag->zm_rounds)];
+	}
+	
+	/* The previous magazine is full. Swap them. */
+	mag = zc->zc_previous;
+	if(mag && mag->zm_rounds){
+		zone_cpu_swap(zc);
+		zc->zc_hits++;
+		return mag->zm_objs[--(mag->zm_rounds)];
+	}
+	zc->zc_misses++;
+	
+	/* Both magazines are empty. Exchange one with a full one from the depot. */
+	zone_lock(zone);
+	mag = zone->zn_depot_full;
+	if(!mag){
+		zone_unlock(zone);
+		return 0;
+	}
+	zone->zn_depot_full = mag->zm_next;
+	zone->zn_depot_nfull--;
+	if(zc->zc_previous){
+		zc->zc_previous->zm_next = zone->zn_depot_empty;
+		zone->zn_depot_empty = zc->zc_previous;
+		zone->zn_depot_nempty++;
+	}
+	zone_unlock(zone);
+	
+	zc->zc_previous = zc->zc_loaded;
+	zc->zc_loaded = mag;
+	return mag->zm_objs[--(mag->zm_rounds)];
+}
+
+/*
+ * Magazine free. Returns 0 if the object must be returned to the zone.
+ */
+static int zmag_free(zone_t zone, struct zone_cpu* zc, Pointer object){
+	struct zmag* mag;
+	
+	/* Fast path: the loaded magazine has space. */
+	mag = zc->zc_loaded;
+	if(mag && (mag->zm_rounds < ZMAG_ROUNDS)){
+		zc->zc_hits++;
+		mag->zm_objs[(mag->zm_rounds)++] = object;
+		return 1;
+	}
+	
+	/* The previous magazine is empty. Swap them. */
+	mag = zc->zc_previous;
+	if(mag && !(mag->zm_rounds)){
+		zone_cpu_swap(zc);
+		zc->zc_hits++;
+		mag->zm_objs[(mag->zm_rounds)++] = object;
+		return 1;
+	}
+	zc->zc_misses++;
+	
+	/* Both magazines are full (or missing). Get an empty one from the depot. */
+	zone_lock(zone);
+	mag = zone->zn_depot_empty;
+	if(mag){
+		zone->zn_depot_empty = mag->zm_next;
+		zone->zn_depot_nempty--;
+	}
+	zone_unlock(zone);
+	
+	/* The depot has no empty magazines. Allocate a new one. */
+	if(!mag){
+		mag = zalloc(zmag_zone);
+		if(!mag) return 0;
+		mag->zm_rounds = 0;
+	}
+	
+	/* Return the full previous magazine to the depot. */
+	if(zc->zc_previous){
+		zone_lock(zone);
+		zc->zc_previous->zm_next = zone->zn_depot_full;
+		zone->zn_depot_full = zc->zc_previous;
+		zone->zn_depot_nfull++;
+		zone_unlock(zone);
+	}
+	
+	zc->zc_previous = zc->zc_loaded;
+	zc->zc_loaded = mag;
+	mag->zm_objs[(mag->zm_rounds)++] = object;
+	return 1;
+}
 
 void* zalloc(zone_t zone){
 	Pointer ret;
+	struct zone_cpu* zc;
+	u_int32_t free;
+	int status;
 	if(!zone) panic("zalloc: null zone");
 	
-	kernlock_lock(&(zone->zn_lock));
-	if((zone->zn_memtype) & ZONE_AUTO_REFILL){
-		_zrefill(zone,32,32);
+	zc = zone_cpu_enter(zone);
+	if(zc){
+		ret = zmag_alloc(zone,zc);
+		if(ret) zc->zc_allocs++;
+		zone_cpu_leave();
+		if(ret) return ret;
+	}
+	
+	if((zone->zn_memtype) & ZONE_LOCKFREE){
+		ret = zlf_pop(zone);
+		if(ret){
+			__atomic_add_fetch(&(zone->zn_lf_allocs),1,__ATOMIC_RELAXED);
+			return ret;
+		}
 	}
 	
-	ret = remove_top(zone);
-	kernlock_unlock(&(zone->zn_lock));
-	return ret;
+	for(;;){
+		zone_lock(zone);
+		ret = zslab_alloc(zone);
+		if(ret) zone->zn_allocs++;
+		free = zone->zn_count;
+		zone_unlock(zone);
+		
+		if(!((zone->zn_memtype) & ZONE_AUTO_REFILL)) return ret;
+		
+		/* Below the low watermark: Let the refill thread top up the zone. */
+		if(free < zone->zn_lowat) zone_refill_wakeup(zone);
+		if(ret && (free >= zone->zn_minimum)) return ret;
+		
+		/* Below the hard minimum: Refill synchronously. */
+		status = zone_refill(zone,zone->zn_lowat);
+		if(ret || (status == ZR_FAILED)) return ret;
+		
+		/*
+		 * Another thread is refilling the zone. Sleep until it is done, but never
+		 * spin for it: If we can't block, we fail instead.
+		 */
+		if((status == ZR_BUSY) && !zone_refill_wait(zone)) return ret;
+		
+		/* We got nothing, but memory was added. Retry. */
+	}
 }
 
 void   zfree(void* object){
+	struct zone_cpu* zc;
+	struct zslab* slab;
+	zone_t zone;
+	int done;
 	if(!object) return;
-	object -= sizeof(Pointer);
-	zone_t zone = (zone_t) (*((Pointer*)object));
+	slab = ZSLAB_OF(object);
+	if(slab->zs_magic != ZSLAB_MAGIC) panic("zfree: not a zone object: %p",object);
+	zone = slab->zs_zone;
+	
+	zc = zone_cpu_enter(zone);
+	if(zc){
+		done = zmag_free(zone,zc,object);
+		if(done) zc->zc_frees++;
+		zone_cpu_leave();
+		if(done) return;
+	}
+	
+	if((zone->zn_memtype) & ZONE_LOCKFREE){
+		zlf_push(zone,object);
+		__atomic_add_fetch(&(zone->zn_lf_frees),1,__ATOMIC_RELAXED);
+		return;
+	}
+	
+	zone_lock(zone);
+		zslab_free(zone,object);
+		zone->zn_frees++;
+	zone_unlock(zone);
+}
+
+u_int32_t zalloc_bulk(zone_t zone, u_int32_t n, void** out){
+	u_int32_t i,free;
+	Pointer obj;
+	if(!zone) panic("zalloc_bulk: null zone");
+	
+	if((zone->zn_memtype) & ZONE_AUTO_REFILL){
+		if(zone->zn_count < (n + zone->zn_minimum))
+			zone_refill(zone,n + zone->zn_lowat);
+	}
+	
+	zone_lock(zone);
+	for(i=0;i<n;++i){
+		obj = zslab_alloc(zone);
+		if(!obj) break;
+		out[i] = obj;
+	}
+	zone->zn_allocs += i;
+	free = zone->zn_count;
+	zone_unlock(zone);
 	
-	kernlock_lock(&(zone->zn_lock));
-		/* Insert the element in the '->zn_freelist' */
-		*((Pointer*)object) = zone->zn_freelist;
-		zone->zn_freelist = object;
-		zone->zn_count++;
-	kernlock_unlock(&(zone->zn_lock));
+	if(((zone->zn_memtype) & ZONE_AUTO_REFILL) && (free < zone->zn_lowat))
+		zone_refill_wakeup(zone);
+	return i;
 }
 
+void   zfree_bulk(void** objs, u_int32_t n){
+	struct zslab* slab;
+	zone_t zone = 0;
+	u_int32_t i;
+	
+	for(i=0;i<n;++i){
+		if(!objs[i]) continue;
+		slab = ZSLAB_OF(objs[i]);
+		if(slab->zs_magic != ZSLAB_MAGIC) panic("zfree_bulk: not a zone object: %p",objs[i]);
+		
+		/* Keep the lock, as long as the objects belong to the same zone. */
+		if(slab->zs_zone != zone){
+			if(zone) zone_unlock(zone);
+			zone = slab->zs_zone;
+			zone_lock(zone);
+		}
+		zslab_free(zone,objs[i]);
+		zone->zn_frees++;
+	}
+	if(zone) zone_unlock(zone);
+}
+
+/*
+ * Crammed memory is split into page aligned slabs. Partial pages at either end are
+ * not used. The slabs are marked static, as we don't know, where the memory came from.
+ */
 static void _zcram(zone_t zone, void* mem, size_t size){
-	size_t bufsize = zone->zn_bufsize;
+	u_intptr_t begin = (u_intptr_t)mem;
+	u_intptr_t end = begin+size;
 	if(!mem) panic("zcram: memory at zero");
-	for( ; size >= bufsize ; size -= bufsize , mem += bufsize){
-		/* Insert the chunk into the '->zn_freelist' */
-		*((Pointer*)mem) = zone->zn_freelist;
-		zone->zn_freelist = mem;
-		zone->zn_count++;
-	}
+	begin = (begin + SYSARCH_PAGESIZE - 1) & ~((u_intptr_t)(SYSARCH_PAGESIZE-1));
+	for( ; (begin+SYSARCH_PAGESIZE) <= end ; begin += SYSARCH_PAGESIZE)
+		zslab_init(zone,(void*)begin,ZSLAB_STATIC);
 }
 
 void   zcram(zone_t zone, void* mem, size_t size){
-	kernlock_lock(&(zone->zn_lock));
+	zone_lock(zone);
 		_zcram(zone,mem,size);
-	kernlock_unlock(&(zone->zn_lock));
+	zone_unlock(zone);
 }
 
 u_int32_t zcount(zone_t zone){
@@ -146,23 +716,317 @@ size_t zbufsize(zone_t zone){
 	return zone->zn_bufsize;
 }
 
-static void _zrefill(zone_t zone, u_int32_t min, u_int32_t num){
-	vaddr_t begin,size;
-	if( zone->zn_count < min ){
-		size = (vaddr_t)(zone->zn_bufsize) * num;
-		if((zone->zn_memtype) & ZONE_AR_CRITICAL){
-			vm_refill();
-			if(!vm_alloc_critical(&begin,&size)) return;
-		}else{
-			if(!vm_kalloc_ll(&begin,&size)) return;
+void zcachestats(zone_t zone, u_int64_t* hits, u_int64_t* misses){
+	struct zone_cpu_cache* zcc;
+	*hits = 0;
+	*misses = 0;
+	if(zone->zn_cpu_idx < 0) return;
+	kernlock_lock(&zone_cpu_lock);
+	for(zcc = zone_cpu_caches; zcc; zcc = zcc->zcc_next){
+		*hits   += zcc->zcc_zones[zone->zn_cpu_idx].zc_hits;
+		*misses += zcc->zcc_zones[zone->zn_cpu_idx].zc_misses;
+	}
+	kernlock_unlock(&zone_cpu_lock);
+}
+
+/*
+ * Adds a single slab to the zone.
+ */
+static int zone_grow(zone_t zone){
+	vaddr_t begin,size = SYSARCH_PAGESIZE;
+	if((zone->zn_memtype) & ZONE_AR_CRITICAL){
+		if(!vm_alloc_critical(&begin,&size)) return 0;
+	}else{
+		if(!vm_kalloc_ll(&begin,&size)) return 0;
+	}
+	zone_lock(zone);
+		zslab_init(zone,(void*)begin,0);
+	zone_unlock(zone);
+	return 1;
+}
+
+/*
+ * Grows the zone, until it has at least 'target' free objects. The memory is
+ * allocated without holding the zone lock, as the VM system allocates from zones
+ * itself; in case of the critical VM zones, even from the zone being refilled.
+ * Such a nested refill is detected, and fails, so the nested allocation is served
+ * from the objects below the hard minimum.
+ *
+ * Returns ZR_BUSY, if another thread is refilling this zone.
+ */
+static int zone_refill(zone_t zone, u_int32_t target){
+	struct cpu* cpu = kernel_get_current_cpu();
+	void* self = cpu->cpu_current_thread ? (void*)(cpu->cpu_current_thread) : (void*)cpu;
+	int status = ZR_DONE;
+	
+	if(zone->zn_refiller == self) return ZR_FAILED;
+	if(kernlock_try_lock(&(zone->zn_refill_lock))) return ZR_BUSY;
+	zone->zn_refiller = self;
+	
+	if(zone->zn_count < target) zone->zn_refills++;
+	while(zone->zn_count < target){
+		if(!zone_grow(zone)){
+			zone->zn_refill_fails++;
+			status = ZR_FAILED;
+			break;
 		}
-		_zcram(zone,(void*)begin,(size_t)size);
 	}
+	
+	zone->zn_refiller = 0;
+	kernlock_unlock(&(zone->zn_refill_lock));
+	
+	/* Wake up the threads, that waited for us. */
+	kernlock_lock(&zrefill_lock);
+	while(waitqueue_get_first(&zrefill_done));
+	kernlock_unlock(&zrefill_lock);
+	return status;
+}
+
+/*
+ * Blocks until the refill, that is currently running on the zone, has finished.
+ * Returns 0, if the caller can't block (no thread, or preemption disabled, as
+ * in the magazine layer), 1 otherwise.
+ */
+static int zone_refill_wait(zone_t zone){
+	struct thread* thread = kernel_get_current_cpu()->cpu_current_thread;
+	if(!thread) return 0;
+	if(thread->t_nonpreempt) return 0;
+	
+	kernlock_lock(&zrefill_lock);
+	if(zone->zn_refiller)
+		waitqueue_wait(&zrefill_lock,&zrefill_done,1);
+	kernlock_unlock(&zrefill_lock);
+	return 1;
 }
 
 void zrefill(zone_t zone, u_int32_t min, u_int32_t num){
-	kernlock_lock(&(zone->zn_lock));
-		_zrefill(zone,min,num);
-	kernlock_unlock(&(zone->zn_lock));
+	u_int32_t count = zone->zn_count;
+	if(count < min) zone_refill(zone,count+num);
+}
+
+void zone_set_watermarks(zone_t zone, u_int32_t minimum, u_int32_t low, u_int32_t high){
+	zone->zn_minimum = minimum;
+	zone->zn_lowat = low;
+	zone->zn_hiwat = high;
+}
+
+/*
+ * Queues the zone for the refill thread.
+ */
+static void zone_refill_wakeup(zone_t zone){
+	if(__atomic_exchange_n(&(zone->zn_refill_queued),1,__ATOMIC_ACQ_REL)) return;
+	kernlock_lock(&zrefill_lock);
+	zrefill_pending = 1;
+	/* Until the thread is started, the zones just stay queued. */
+	if(zrefill_thread) waitqueue_get_first(&zrefill_queue);
+	kernlock_unlock(&zrefill_lock);
+}
+
+static void zone_refill_thread(void* arg){
+	zone_t zone;
+	(void)arg;
+	for(;;){
+		kernlock_lock(&zrefill_lock);
+		while(!zrefill_pending)
+			waitqueue_wait(&zrefill_lock,&zrefill_queue,1);
+		zrefill_pending = 0;
+		kernlock_unlock(&zrefill_lock);
+		
+		zone = zone_list_enter();
+		
+		for(;zone;zone = zone->zn_next){
+			if(!__atomic_exchange_n(&(zone->zn_refill_queued),0,__ATOMIC_ACQ_REL)) continue;
+			zone_refill(zone,zone->zn_hiwat);
+		}
+		zone_list_leave();
+	}
+}
+
+void zone_refill_start(){
+	linked_ring_init(&(zrefill_queue.wq_threads));
+	zrefill_thread = thread_create_kernel(zone_refill_thread,0,ZONE_REFILL_PRIORITY);
+	if(!zrefill_thread) panic("zone_refill_start: can't create the refill thread");
+	
+	/* Process the zones, that were queued during boot. */
+	kernlock_lock(&zrefill_lock);
+	if(zrefill_pending) waitqueue_get_first(&zrefill_queue);
+	kernlock_unlock(&zrefill_lock);
 }
 
+/*
+ * Calls the destructor on every object of an empty slab.
+ */
+static void zslab_destruct(zone_t zone, struct zslab* slab){
+	Pointer mem = (Pointer)ZSLAB_PAGE(slab);
+	u_int32_t i;
+	for(i=0;i<slab->zs_total;++i, mem += zone->zn_bufsize)
+		zone->zn_dtor(mem);
+}
+
+/*
+ * Garbage-collects a single zone. If the zone is busy, it is skipped.
+ */
+static void zgc_zone(zone_t zone){
+	struct zmag *mags = 0,*mag;
+	struct zslab* slab;
+	list_node_s reclaim;
+	list_node_t node,next;
+	
+	if(kernlock_try_lock(&(zone->zn_lock))) return;
+	
+	/*
+	 * Flush the depot: Return the objects in the full magazines to their slabs,
+	 * and collect all magazines, to free them later.
+	 */
+	while((mag = zone->zn_depot_full)){
+		zone->zn_depot_full = mag->zm_next;
+		while(mag->zm_rounds)
+			zslab_free(zone,mag->zm_objs[--(mag->zm_rounds)]);
+		mag->zm_next = mags;
+		mags = mag;
+	}
+	while((mag = zone->zn_depot_empty)){
+		zone->zn_depot_empty = mag->zm_next;
+		mag->zm_next = mags;
+		mags = mag;
+	}
+	zone->zn_depot_nfull = 0;
+	zone->zn_depot_nempty = 0;
+	
+	if((zone->zn_memtype) & ZONE_LOCKFREE) zlf_drain(zone);
+	
+	/*
+	 * Detach the empty slabs. Auto-refilled zones keep enough of them, to stay
+	 * at the high watermark.
+	 */
+	list_init(&reclaim);
+	for(node = zone->zn_slabs_empty.next; node != &(zone->zn_slabs_empty); node = next){
+		next = node->next;
+		slab = containerof(node,struct zslab,zs_link);
+		if(slab->zs_flags & ZSLAB_STATIC) continue;
+		if((zone->zn_memtype) & ZONE_LOCKFREE) break;
+		if(
+			((zone->zn_memtype) & ZONE_AUTO_REFILL) &&
+			((zone->zn_count - slab->zs_total) < zone->zn_hiwat)
+		) break;
+		list_item_remove(node);
+		list_push_head(&reclaim,node);
+		zone->zn_count -= slab->zs_total;
+		zone->zn_nslabs--;
+		zone->zn_nslabs_empty--;
+	}
+	
+	zone_unlock(zone);
+	
+	/*
+	 * Give the pages back, without holding the zone lock, as vm_kfree_ll() frees
+	 * objects into other zones.
+	 */
+	while((node = list_pop_head(&reclaim))){
+		slab = containerof(node,struct zslab,zs_link);
+		if(zone->zn_dtor) zslab_destruct(zone,slab);
+		vm_kfree_ll((vaddr_t)ZSLAB_PAGE(slab));
+	}
+	while((mag = mags)){
+		mags = mag->zm_next;
+		zfree(mag);
+	}
+}
+
+void zgc(){
+	zone_t zone;
+	zone = zone_list_enter();
+	
+	for(;zone;zone = zone->zn_next)
+		zgc_zone(zone);
+	zone_list_leave();
+}
+
+void zgc_request(){
+	__atomic_store_n(&zgc_wanted,1,__ATOMIC_RELEASE);
+}
+
+void zgc_consider(){
+	if(__atomic_exchange_n(&zgc_wanted,0,__ATOMIC_ACQUIRE)) zgc();
+}
+
+void zone_info(zone_t zone, struct zone_info* info){
+	struct zone_cpu_cache* zcc;
+	struct zone_cpu* zc;
+	
+	info->zi_name = zone->zn_name;
+	info->zi_objsize = zone->zn_objsize;
+	info->zi_bufsize = zone->zn_bufsize;
+	
+	zone_lock(zone);
+	info->zi_free         = zone->zn_count;
+	info->zi_inuse        = zone->zn_inuse;
+	info->zi_peak_inuse   = zone->zn_peak_inuse;
+	info->zi_slabs        = zone->zn_nslabs;
+	info->zi_slabs_empty  = zone->zn_nslabs_empty;
+	info->zi_allocs       = zone->zn_allocs;
+	info->zi_frees        = zone->zn_frees;
+	info->zi_refills      = zone->zn_refills;
+	info->zi_refill_fails = zone->zn_refill_fails;
+	info->zi_lock_spins   = zone->zn_lock_spins;
+	info->zi_wasted       = (zone->zn_bufsize - zone->zn_objsize) * zone->zn_nslabs * zone->zn_slab_objs;
+	zone_unlock(zone);
+	
+	/*
+	 * Objects on the lock-free stack are free, although the slab layer counts them
+	 * as in use. The count may be a little ahead of the stack, so clamp it.
+	 */
+	info->zi_lf_free = __atomic_load_n(&(zone->zn_lf_count),__ATOMIC_RELAXED);
+	if(info->zi_lf_free > info->zi_inuse) info->zi_lf_free = info->zi_inuse;
+	info->zi_free        += info->zi_lf_free;
+	info->zi_inuse       -= info->zi_lf_free;
+	info->zi_allocs      += __atomic_load_n(&(zone->zn_lf_allocs),__ATOMIC_RELAXED);
+	info->zi_frees       += __atomic_load_n(&(zone->zn_lf_frees),__ATOMIC_RELAXED);
+	
+	info->zi_cache_hits   = 0;
+	info->zi_cache_misses = 0;
+	if(zone->zn_cpu_idx < 0) return;
+	kernlock_lock(&zone_cpu_lock);
+	for(zcc = zone_cpu_caches; zcc; zcc = zcc->zcc_next){
+		zc = &(zcc->zcc_zones[zone->zn_cpu_idx]);
+		info->zi_allocs       += zc->zc_allocs;
+		info->zi_frees        += zc->zc_frees;
+		info->zi_cache_hits   += zc->zc_hits;
+		info->zi_cache_misses += zc->zc_misses;
+	}
+	kernlock_unlock(&zone_cpu_lock);
+}
+
+/* Computes 100*a/b without 64-bit division. */
+static u_int32_t zpercent(u_int64_t a, u_int64_t b){
+	while(b > 0x1000000){
+		a >>= 1;
+		b >>= 1;
+	}
+	if(!b) return 0;
+	return ((u_int32_t)a * 100) / (u_int32_t)b;
+}
+
+void zprint(){
+	struct zone_info info;
+	zone_t zone;
+	
+	zone = zone_list_enter();
+	
+	for(;zone;zone = zone->zn_next){
+		zone_info(zone,&info);
+		iopipe_printf(kterm_instance,"%s: size %u/%u, in use %u (peak %u), free %u, slabs %u (%u empty)\n",
+			info.zi_name,(unsigned)info.zi_objsize,(unsigned)info.zi_bufsize,
+			info.zi_inuse,info.zi_peak_inuse,info.zi_free,info.zi_slabs,info.zi_slabs_empty);
+		iopipe_printf(kterm_instance,"\tallocs %u, frees %u, refills %u (%u failed), lock spins %u, wasted %u bytes\n",
+			(unsigned)info.zi_allocs,(unsigned)info.zi_frees,info.zi_refills,info.zi_refill_fails,
+			info.zi_lock_spins,(unsigned)info.zi_wasted);
+		if((zone->zn_memtype) & ZONE_LOCKFREE)
+			iopipe_printf(kterm_instance,"\tlock-free stack: %u free\n",info.zi_lf_free);
+		if(zone->zn_cpu_idx < 0) continue;
+		iopipe_printf(kterm_instance,"\tmagazines: %u hits, %u misses (%u%% hit rate)\n",
+			(unsigned)info.zi_cache_hits,(unsigned)info.zi_cache_misses,
+			zpercent(info.zi_cache_hits,info.zi_cache_hits+info.zi_cache_misses));
+	}
+	zone_list_leave();
+}
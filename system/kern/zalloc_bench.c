@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <kern/zalloc.h>
+#include <sys/thread.h>
+#include <sysarch/hal.h>
+#include <stdio.h>
+
+/*
+ * One thread per CPU allocates and frees batches of objects from a shared zone at
+ * the same time. This compares the lock-free stack (ZONE_LOCKFREE) with the zone
+ * lock under contention. Both zones are uncached, so the magazines don't hide it.
+ * The threads exit and the zones are destroyed after each run, so the benchmark
+ * leaves no load behind.
+ */
+#define BENCH_OBJSIZE  64
+#define BENCH_BATCH    16
+#define BENCH_ROUNDS   256
+#define BENCH_OPS      (BENCH_ROUNDS*BENCH_BATCH*2)
+#define BENCH_PRIORITY 8
+
+static zone_t             bench_zone;
+static u_int32_t          bench_nthreads;
+static u_int32_t          bench_ready;
+static u_int32_t          bench_done;
+static u_int32_t          bench_cycles;   /* Sum of the cycles/op of all threads. */
+
+static void bench_thread(void* arg){
+	void* objs[BENCH_BATCH];
+	u_int64_t t;
+	u_int32_t i,j;
+	(void)arg;
+	
+	/* Start all threads at once. */
+	__atomic_add_fetch(&bench_ready,1,__ATOMIC_ACQ_REL);
+	while(__atomic_load_n(&bench_ready,__ATOMIC_ACQUIRE) < __atomic_load_n(&bench_nthreads,__ATOMIC_ACQUIRE))
+		hal_induce_preemption();
+	
+	t = hal_cycles();
+	for(i=0;i<BENCH_ROUNDS;++i){
+		for(j=0;j<BENCH_BATCH;++j) objs[j] = zalloc(bench_zone);
+		for(j=0;j<BENCH_BATCH;++j) zfree(objs[j]);
+	}
+	t = hal_cycles()-t;
+	
+	__atomic_add_fetch(&bench_cycles,((u_int32_t)t)/BENCH_OPS,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&bench_done,1,__ATOMIC_RELEASE);
+}
+
+static void bench_run(unsigned int memtype, const char* name, u_int32_t nthreads){
+	struct zone_info info;
+	u_int32_t i,spins;
+	
+	bench_zone = zinit(BENCH_OBJSIZE,memtype,name);
+	if(!bench_zone) return;
+	zrefill(bench_zone,BENCH_BATCH*nthreads,BENCH_BATCH*nthreads);
+	zone_info(bench_zone,&info);
+	spins = info.zi_lock_spins;
+	
+	bench_nthreads = nthreads;
+	bench_ready = 0;
+	bench_done = 0;
+	bench_cycles = 0;
+	for(i=0;i<nthreads;++i)
+		if(!thread_create_kernel(bench_thread,0,BENCH_PRIORITY)) break;
+	if(!i){
+		zdestroy(bench_zone);
+		return;
+	}
+	
+	/* Don't let the started threads wait for the missing ones. */
+	nthreads = i;
+	__atomic_store_n(&bench_nthreads,nthreads,__ATOMIC_RELEASE);
+	
+	while(__atomic_load_n(&bench_done,__ATOMIC_ACQUIRE) < nthreads)
+		hal_induce_preemption();
+	
+	zone_info(bench_zone,&info);
+	printf("zalloc: %s, %u threads: %u cycles/op, %u lock spins\n",
+		name,(unsigned)nthreads,(unsigned)(bench_cycles/nthreads),
+		(unsigned)(info.zi_lock_spins-spins));
+	
+	zdestroy(bench_zone);
+	bench_zone = 0;
+}
+
+void zalloc_benchmark(u_int32_t ncpus){
+	if(!ncpus) ncpus = 1;
+	bench_run(ZONE_NOCACHE|ZONE_LOCKFREE,"lock-free",ncpus);
+	bench_run(ZONE_NOCACHE,"zone lock",ncpus);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <sys/physmem_alloc.h>
+#include <sysarch/pages.h>
+#include <sysarch/hal.h>
+#include <kern/kmalloc.h>
+#include <stdio.h>
+
+#define DIV_32(x)  ((x) >> 5)
+
+#ifdef SYSARCH_PAGESIZE_SHIFT
+#define MUL_PAGESIZE(x)  ((x)<<SYSARCH_PAGESIZE_SHIFT)
+#else
+#define MUL_PAGESIZE(x)  ((x)*SYSARCH_PAGESIZE)
+#endif
+
+/*
+ * The benchmark runs on a synthetic range of 128 MiB. Its pages are never touched,
+ * so it doesn't matter, that there is no memory behind them.
+ */
+#define BENCH_PFN     0x10000
+#define BENCH_PAGES   0x8000
+#define BENCH_BATCH   64
+#define BENCH_ROUNDS  64
+
+static const u_int32_t bench_occupancy[] = { 10, 50, 95 };
+
+static struct physmem_bmalloc   bench_pmbm;
+static struct physmem_bmalloc*  bench_maps[1];
+static struct physmem_bmaset    bench_pmas;
+static paddr_t                  bench_pages[BENCH_BATCH];
+
+static u_int32_t bench_random(u_int32_t* seed){
+	*seed = ((*seed) * 1103515245) + 12345;
+	return (*seed) >> 16;
+}
+
+/*
+ * Occupies the given percentage of the range, scattered randomly, then measures
+ * batches of page allocations, each followed by freeing the batch.
+ */
+static void bench_run(u_int32_t* storage, u_int32_t occupancy){
+	u_int64_t t;
+	u_int32_t i,j,n,ops = 0,talloc = 0,tfree = 0,seed = 1;
+	paddr_t page;
+	
+	for(i=0;i<DIV_32(BENCH_PAGES);++i) bench_pmbm.pmb_bitmap[i] = 0;
+	vm_phys_bm_buddyinit(&bench_pmbm,storage);
+	
+	while(vm_phys_alloc(&bench_pmas,&page));
+	for(i=0;i<BENCH_PAGES;++i)
+		if((bench_random(&seed) % 100) >= occupancy)
+			vm_phys_free(&bench_pmas,MUL_PAGESIZE(BENCH_PFN+i));
+	
+	for(i=0;i<BENCH_ROUNDS;++i){
+		t = hal_cycles();
+		for(n=0;n<BENCH_BATCH;++n)
+			if(!vm_phys_alloc(&bench_pmas,&bench_pages[n])) break;
+		talloc += (u_int32_t)(hal_cycles()-t);
+		
+		t = hal_cycles();
+		for(j=0;j<n;++j)
+			vm_phys_free(&bench_pmas,bench_pages[j]);
+		tfree += (u_int32_t)(hal_cycles()-t);
+		ops += n;
+	}
+	if(!ops) ops = 1;
+	printf("vm_phys: %u%% occupied: %u cycles/alloc, %u cycles/free\n",
+		(unsigned)occupancy,(unsigned)(talloc/ops),(unsigned)(tfree/ops));
+}
+
+void vm_phys_benchmark(){
+	u_int32_t* storage;
+	u_int32_t i;
+	
+	bench_pmbm.pmb_range.pm_begin = MUL_PAGESIZE(BENCH_PFN);
+	bench_pmbm.pmb_range.pm_end   = MUL_PAGESIZE(BENCH_PFN+BENCH_PAGES);
+	bench_pmbm.pmb_length = BENCH_PAGES;
+	bench_pmbm.pmb_pfn    = BENCH_PFN;
+	bench_pmbm.pmb_bitmap = kmalloc(DIV_32(BENCH_PAGES) * sizeof(u_int32_t));
+	storage = kmalloc(vm_phys_bm_buddywords(BENCH_PFN,BENCH_PAGES) * sizeof(u_int32_t));
+	if(!(bench_pmbm.pmb_bitmap && storage)){
+		printf("vm_phys_benchmark: out of memory\n");
+		kfree(bench_pmbm.pmb_bitmap);
+		kfree(storage);
+		return;
+	}
+	bench_maps[0] = &bench_pmbm;
+	bench_pmas.pmb_maps   = bench_maps;
+	bench_pmas.pmb_n_maps = 1;
+	kernlock_init(&(bench_pmas.pmb_lock));
+	
+	for(i=0;i<(sizeof(bench_occupancy)/sizeof(bench_occupancy[0]));++i)
+		bench_run(storage,bench_occupancy[i]);
+	
+	kfree(bench_pmbm.pmb_bitmap);
+	kfree(storage);
+}
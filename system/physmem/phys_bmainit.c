@@ -24,10 +24,21 @@
 
 #define DIV_32(x)  ((x) >> 5)
 #define MUL_32(x)  ((x) << 5)
+#define MOD_32(x)  ((x) & 31)
+#define BIT_32(x)  (1 << MOD_32(x))
 
 #define UNUMBER 0x1000
 #define NNUMBER 0x10
 
+/*
+ * The buddy bitmaps of all orders together have less than twice as many bits as
+ * there are pages, plus up to two partial words per order and range. Their summary
+ * bitmaps need a 32th of that, plus one partial word per order and range. The
+ * 'pmb_cached' bitmaps are as large as the allocation bitmaps.
+ */
+#define BNUMBER_MAPS ((UNUMBER*2)+(NNUMBER*PMB_NORDERS*2))
+#define BNUMBER      (BNUMBER_MAPS + DIV_32(BNUMBER_MAPS) + (NNUMBER*PMB_NORDERS) + UNUMBER)
+
 #ifdef SYSARCH_PAGESIZE_SHIFT
 #define MUL_PAGESIZE(x)  ((x)<<SYSARCH_PAGESIZE_SHIFT)
 #define DIV_PAGESIZE(x)  ((x)>>SYSARCH_PAGESIZE_SHIFT)
@@ -41,7 +52,59 @@ static struct physmem_bmalloc  prealloc_pbma[NNUMBER];
 static struct physmem_bmalloc* prealloc_pbma_ptr[NNUMBER];
 
 static u_int32_t bitmap_block[UNUMBER];
+static u_int32_t buddy_block[BNUMBER];
 
+/* Number of words of the free bitmap of order 'k'. */
+static paddr_t buddy_mapwords(paddr_t first, paddr_t end, u_int32_t k){
+	if(end<=first) return 0;
+	return DIV_32( ((end-1)>>k) - (first>>k) + 1 + 31 );
+}
+
+paddr_t vm_phys_bm_buddywords(paddr_t pfn, paddr_t npages){
+	paddr_t n,total = 0;
+	u_int32_t k;
+	for(k=0;k<PMB_NORDERS;++k){
+		n = buddy_mapwords(pfn,pfn+npages,k);
+		total += n + DIV_32(n+31);
+	}
+	return total + DIV_32(npages+31);
+}
+
+u_int32_t* vm_phys_bm_buddyinit(struct physmem_bmalloc* pmbm, u_int32_t* storage){
+	paddr_t first = pmbm->pmb_pfn;
+	paddr_t end   = first + pmbm->pmb_length;
+	paddr_t p,n,m,i;
+	u_int32_t k;
+	
+	for(k=0;k<PMB_NORDERS;++k){
+		n = buddy_mapwords(first,end,k);
+		m = n + DIV_32(n+31);
+		for(i=0;i<m;++i) storage[i] = 0;
+		pmbm->pmb_free_map[k]     = storage;
+		pmbm->pmb_free_summary[k] = storage+n;
+		pmbm->pmb_free_words[k]   = n;
+		pmbm->pmb_free_count[k]   = 0;
+		pmbm->pmb_free_hint[k]    = 0;
+		storage += m;
+	}
+	
+	/* No page is on a per-CPU list. */
+	n = DIV_32(pmbm->pmb_length+31);
+	for(i=0;i<n;++i) storage[i] = 0;
+	pmbm->pmb_cached = storage;
+	storage += n;
+	
+	/* Mark the pages free, as the largest aligned blocks, that fit. */
+	for(p=first;p<end;p += ((paddr_t)1)<<k){
+		for(k=PMB_MAX_ORDER;k;--k)
+			if( !(p & ((((paddr_t)1)<<k)-1)) && ((p + (((paddr_t)1)<<k)) <= end) ) break;
+		i = (p>>k) - (first>>k);
+		pmbm->pmb_free_map[k][DIV_32(i)] |= BIT_32(i);
+		pmbm->pmb_free_summary[k][DIV_32(DIV_32(i))] |= BIT_32(DIV_32(i));
+		pmbm->pmb_free_count[k]++;
+	}
+	return storage;
+}
 
 int vm_phys_bm_bootinit(
 		struct physmem_range *rng,
@@ -52,6 +115,7 @@ int vm_phys_bm_bootinit(
 ){
 	u_int32_t *bitmap_current = bitmap_block;
 	u_int32_t *bitmap_last    = bitmap_current+UNUMBER;
+	u_int32_t *buddy_current  = buddy_block;
 	struct physmem_range * __restrict__ range = rng;
 	u_intptr_t i;
 	paddr_t  j,n,m,k;
@@ -80,7 +144,9 @@ int vm_phys_bm_bootinit(
 		prealloc_pbma[i].pmb_range  = range[i];
 		prealloc_pbma[i].pmb_bitmap = bitmap_current;
 		prealloc_pbma[i].pmb_length = k;
+		prealloc_pbma[i].pmb_pfn    = DIV_PAGESIZE(range[i].pm_begin);
 		bitmap_current = &bitmap_current[j];
+		buddy_current = vm_phys_bm_buddyinit(&prealloc_pbma[i],buddy_current);
 		
 		if(bitmap_current >= bitmap_last){
 			*Pi = i;
@@ -93,3 +159,60 @@ int vm_phys_bm_bootinit(
 }
 
 
+
+/* Number of words of the allocation bitmap, and of the buddy bitmaps of a range. */
+static paddr_t range_words(struct physmem_range *range){
+	paddr_t m = DIV_PAGESIZE(range->pm_end-range->pm_begin);
+	return DIV_32( m + 31 ) + vm_phys_bm_buddywords(DIV_PAGESIZE(range->pm_begin),m);
+}
+
+paddr_t vm_phys_bm_bootsize(struct physmem_range *rng, u_intptr_t n_ranges){
+	paddr_t    size;
+	u_intptr_t i;
+	
+	size  = sizeof(struct physmem_bmaset);
+	size += n_ranges*(sizeof(struct physmem_bmalloc)+sizeof(struct physmem_bmalloc*));
+	for(i=0;i<n_ranges;++i)
+		size += range_words(&rng[i])*sizeof(u_int32_t);
+	return size;
+}
+
+int vm_phys_bm_init(
+		struct physmem_range *rng,
+		u_intptr_t n_ranges,
+		void* storage,
+		paddr_t size,
+		struct physmem_bmaset** Pbma
+){
+	struct physmem_bmaset   *bmas;
+	struct physmem_bmalloc  *pbma;
+	struct physmem_bmalloc **pbma_ptr;
+	u_int32_t *words;
+	u_intptr_t i;
+	paddr_t    j,n,m;
+	
+	if(size < vm_phys_bm_bootsize(rng,n_ranges)) return 0;
+	
+	bmas     = storage;
+	pbma     = (struct physmem_bmalloc*)(bmas+1);
+	pbma_ptr = (struct physmem_bmalloc**)(pbma+n_ranges);
+	words    = (u_int32_t*)(pbma_ptr+n_ranges);
+	
+	bmas->pmb_maps   = pbma_ptr;
+	bmas->pmb_n_maps = n_ranges;
+	kernlock_init(&(bmas->pmb_lock));
+	
+	for(i=0;i<n_ranges;++i){
+		pbma_ptr[i] = &pbma[i];
+		m = DIV_PAGESIZE(rng[i].pm_end-rng[i].pm_begin);
+		n = DIV_32( m + 31 );
+		for(j=0;j<n;++j) words[j] = 0;
+		pbma[i].pmb_range  = rng[i];
+		pbma[i].pmb_bitmap = words;
+		pbma[i].pmb_length = m;
+		pbma[i].pmb_pfn    = DIV_PAGESIZE(rng[i].pm_begin);
+		words = vm_phys_bm_buddyinit(&pbma[i],words+n);
+	}
+	*Pbma = bmas;
+	return -1;
+}
@@ -23,6 +23,7 @@
 #include <sysarch/pages.h>
 
 #define DIV_32(x)  ((x) >> 5)
+#define MUL_32(x)  ((x) << 5)
 #define MOD_32(x)  ((x) & 31)
 #define BIT_32(x)  (1 << MOD_32(x))
 
@@ -34,54 +35,346 @@
 #define DIV_PAGESIZE(x)  ((x)/SYSARCH_PAGESIZE)
 #endif
 
-static int bitmap_search(struct physmem_bmalloc* pmbm,paddr_t *res){
-	u_int32_t i;
-	u_int32_t* __restrict__ bitmap = pmbm->pmb_bitmap;
-	u_int32_t n                    = pmbm->pmb_length;
-	for(i=0;i<n;++i){
-		if(bitmap[DIV_32(i)] & BIT_32(i)) continue; /* If Used, continue. */
-		/*
-		 * We found a free page. Now, we need to multiply the index with the Page-size,
-		 * and add the offset to the begin of the physical memory region, this bitmap
-		 * belongs to.
-		 */
-		bitmap[DIV_32(i)] |= BIT_32(i);
-		*res = MUL_PAGESIZE(i) + pmbm->pmb_range.pm_begin;
+/* The bit of block 'blk' in the free bitmap of order 'k'. */
+#define BUDDY_IDX(pmbm,k,blk)  ((blk) - ((pmbm)->pmb_pfn >> (k)))
+
+/*
+ * Finds a free block of order 'k'. The search starts at the hint word, and walks the
+ * summary bitmap, wrapping around at the end. The summary word containing the hint
+ * is visited twice: first the part from the hint on, finally the part before it.
+ */
+static int buddy_search(struct physmem_bmalloc* pmbm, u_int32_t k, u_int32_t *res){
+	u_int32_t* __restrict__ map = pmbm->pmb_free_map[k];
+	u_int32_t* __restrict__ sum = pmbm->pmb_free_summary[k];
+	u_int32_t nsum = DIV_32(pmbm->pmb_free_words[k]+31);
+	u_int32_t hint = pmbm->pmb_free_hint[k];
+	u_int32_t i,j,w,bits;
+	
+	for(i=0,j=DIV_32(hint);i<=nsum;++i,++j){
+		if(j>=nsum) j = 0;
+		bits = sum[j];
+		if(i==0)    bits &= ~0U << MOD_32(hint);
+		if(i==nsum) bits &= ~(~0U << MOD_32(hint));
+		if(!bits) continue;
+		w = MUL_32(j) + __builtin_ctz(bits);
+		pmbm->pmb_free_hint[k] = w;
+		*res = MUL_32(w) + __builtin_ctz(map[w]);
 		return -1;
 	}
-	/* No memory found. */
 	return 0;
 }
 
-int vm_phys_alloc(struct physmem_bmaset* pmas,paddr_t *res) {
+static inline void buddy_set(struct physmem_bmalloc* pmbm, u_int32_t k, paddr_t blk){
+	paddr_t i = BUDDY_IDX(pmbm,k,blk);
+	pmbm->pmb_free_map[k][DIV_32(i)] |= BIT_32(i);
+	pmbm->pmb_free_summary[k][DIV_32(DIV_32(i))] |= BIT_32(DIV_32(i));
+	pmbm->pmb_free_count[k]++;
+}
+
+static inline void buddy_clear(struct physmem_bmalloc* pmbm, u_int32_t k, paddr_t blk){
+	paddr_t i = BUDDY_IDX(pmbm,k,blk);
+	pmbm->pmb_free_map[k][DIV_32(i)] &= ~BIT_32(i);
+	if(!pmbm->pmb_free_map[k][DIV_32(i)])
+		pmbm->pmb_free_summary[k][DIV_32(DIV_32(i))] &= ~BIT_32(DIV_32(i));
+	pmbm->pmb_free_count[k]--;
+}
+
+/*
+ * Returns non-zero, if the block 'blk' of order 'k' lies within the range, and is free.
+ */
+static inline int buddy_isfree(struct physmem_bmalloc* pmbm, u_int32_t k, paddr_t blk){
+	paddr_t i;
+	if( (blk<<k) < pmbm->pmb_pfn ) return 0;
+	if( ((blk+1)<<k) > (pmbm->pmb_pfn + pmbm->pmb_length) ) return 0;
+	i = BUDDY_IDX(pmbm,k,blk);
+	return pmbm->pmb_free_map[k][DIV_32(i)] & BIT_32(i);
+}
+
+/*
+ * Marks the pages [first,first+n) in the allocation bitmap.
+ */
+static inline void pages_mark(struct physmem_bmalloc* pmbm, paddr_t first, paddr_t n, int used){
+	u_int32_t* __restrict__ bitmap = pmbm->pmb_bitmap;
+	paddr_t i = first - pmbm->pmb_pfn;
+	for(n += i;i<n;){
+		if( !MOD_32(i) && ((n-i) >= 32) ){ /* Whole words at once. */
+			bitmap[DIV_32(i)] = used ? ~0U : 0;
+			i += 32;
+			continue;
+		}
+		if(used) bitmap[DIV_32(i)] |=  BIT_32(i);
+		else     bitmap[DIV_32(i)] &= ~BIT_32(i);
+		++i;
+	}
+}
+
+static inline int page_used(struct physmem_bmalloc* pmbm, paddr_t pfn){
+	paddr_t i = pfn - pmbm->pmb_pfn;
+	return pmbm->pmb_bitmap[DIV_32(i)] & BIT_32(i);
+}
+
+/*
+ * Returns non-zero, if all pages [first,first+n) are allocated.
+ */
+static int pages_used(struct physmem_bmalloc* pmbm, paddr_t first, paddr_t n){
+	u_int32_t* __restrict__ bitmap = pmbm->pmb_bitmap;
+	paddr_t i = first - pmbm->pmb_pfn;
+	for(n += i;i<n;){
+		if( !MOD_32(i) && ((n-i) >= 32) ){
+			if(bitmap[DIV_32(i)] != ~0U) return 0;
+			i += 32;
+			continue;
+		}
+		if(!(bitmap[DIV_32(i)] & BIT_32(i))) return 0;
+		++i;
+	}
+	return 1;
+}
+
+static inline int page_cached(struct physmem_bmalloc* pmbm, paddr_t pfn){
+	paddr_t i = pfn - pmbm->pmb_pfn;
+	return __atomic_load_n(&(pmbm->pmb_cached[DIV_32(i)]),__ATOMIC_ACQUIRE) & BIT_32(i);
+}
+
+static inline int in_range(struct physmem_bmalloc* pmbm, paddr_t pfn, paddr_t n){
+	return (pfn >= pmbm->pmb_pfn) && ((pfn + n) <= (pmbm->pmb_pfn + pmbm->pmb_length));
+}
+
+/*
+ * Finds the range, that holds the pages [pfn,pfn+n).
+ */
+static struct physmem_bmalloc* find_range(struct physmem_bmaset* pmas, paddr_t pfn, paddr_t n){
+	u_int32_t i,m;
+	for(i=0,m=pmas->pmb_n_maps;i<m;++i)
+		if(in_range(pmas->pmb_maps[i],pfn,n)) return pmas->pmb_maps[i];
+	return 0;
+}
+
+/*
+ * Allocates a block from the range: Takes the smallest free block, that is large
+ * enough, and splits it down to the requested order. The upper halves, that are
+ * split off, become free blocks of the lower orders.
+ */
+static int buddy_alloc(struct physmem_bmalloc* pmbm, u_int32_t order, paddr_t *res){
+	u_int32_t k,idx;
+	paddr_t blk;
+	for(k=order;k<PMB_NORDERS;++k)
+		if(pmbm->pmb_free_count[k]) break;
+	if(k>=PMB_NORDERS) return 0;
+	if(!buddy_search(pmbm,k,&idx)) return 0;
+	
+	blk = idx + (pmbm->pmb_pfn >> k);
+	buddy_clear(pmbm,k,blk);
+	while(k>order){
+		k--;
+		blk <<= 1;
+		buddy_set(pmbm,k,blk+1);
+	}
+	pages_mark(pmbm,blk<<order,((paddr_t)1)<<order,1);
+	*res = MUL_PAGESIZE(blk<<order);
+	return -1;
+}
+
+/*
+ * Frees a block, and merges it with it's buddy as long as the buddy is free.
+ */
+static void buddy_free(struct physmem_bmalloc* pmbm, u_int32_t order, paddr_t pfn){
+	u_int32_t k = order;
+	paddr_t blk = pfn>>order;
+	pages_mark(pmbm,pfn,((paddr_t)1)<<order,0);
+	while(k<PMB_MAX_ORDER){
+		if(!buddy_isfree(pmbm,k,blk^1)) break;
+		buddy_clear(pmbm,k,blk^1);
+		blk >>= 1;
+		k++;
+	}
+	buddy_set(pmbm,k,blk);
+}
+
+/*
+ * Frees the pages [pfn,pfn+n) as the largest aligned blocks, that fit.
+ */
+static void buddy_free_run(struct physmem_bmalloc* pmbm, paddr_t pfn, paddr_t n){
+	paddr_t end = pfn+n;
+	u_int32_t k;
+	while(pfn<end){
+		for(k=PMB_MAX_ORDER;k;--k)
+			if( !(pfn & ((((paddr_t)1)<<k)-1)) && ((pfn + (((paddr_t)1)<<k)) <= end) ) break;
+		buddy_free(pmbm,k,pfn);
+		pfn += ((paddr_t)1)<<k;
+	}
+}
+
+/* The smallest order, whose blocks hold 'npages' pages. */
+static u_int32_t order_of(paddr_t npages){
+	u_int32_t k = 0;
+	while((((paddr_t)1)<<k) < npages) k++;
+	return k;
+}
+
+int vm_phys_alloc_order(struct physmem_bmaset* pmas,u_int32_t order,paddr_t *res) {
 	u_int32_t i,n;
 	int status = 0;
+	if(order>PMB_MAX_ORDER) return 0;
 	kernlock_lock(&(pmas->pmb_lock));
 	for(i=0,n=pmas->pmb_n_maps;i<n;++i){
-		status = bitmap_search(pmas->pmb_maps[i],res);
+		status = buddy_alloc(pmas->pmb_maps[i],order,res);
 		if(status) break;
 	}
 	kernlock_unlock(&(pmas->pmb_lock));
 	return status;
 }
 
-int vm_phys_free(struct physmem_bmaset* pmas,paddr_t page) {
+int vm_phys_alloc_contig(struct physmem_bmaset* pmas,paddr_t npages,paddr_t align,paddr_t *res) {
 	struct physmem_bmalloc* pmbm;
-	u_int32_t i,j,n;
+	u_int32_t i,n,order;
+	paddr_t block;
 	int status = 0;
+	if(!npages) return 0;
+	order = order_of(npages);
+	if(order < order_of(DIV_PAGESIZE(align))) order = order_of(DIV_PAGESIZE(align));
+	if(order>PMB_MAX_ORDER) return 0;
+	block = ((paddr_t)1)<<order;
 	kernlock_lock(&(pmas->pmb_lock));
 	for(i=0,n=pmas->pmb_n_maps;i<n;++i){
 		pmbm = pmas->pmb_maps[i];
-		if(
-			(pmbm->pmb_range.pm_begin < page)||
-			(pmbm->pmb_range.pm_end >= page)
-		) continue;
-		status = -1;
-		j = (u_int32_t)DIV_PAGESIZE(page-(pmbm->pmb_range.pm_begin));
-		pmbm->pmb_bitmap[DIV_32(j)] &= ~BIT_32(j);
+		status = buddy_alloc(pmbm,order,res);
+		if(!status) continue;
+		if(npages<block) buddy_free_run(pmbm,DIV_PAGESIZE(*res)+npages,block-npages);
 		break;
 	}
 	kernlock_unlock(&(pmas->pmb_lock));
 	return status;
 }
 
+int vm_phys_free_contig(struct physmem_bmaset* pmas,paddr_t page,paddr_t npages) {
+	return vm_phys_free_range(pmas,page,npages);
+}
+
+int vm_phys_free_range(struct physmem_bmaset* pmas,paddr_t begin,paddr_t npages) {
+	struct physmem_bmalloc* pmbm;
+	paddr_t pfn = DIV_PAGESIZE(begin);
+	int status = 0;
+	if(!npages) return 0;
+	kernlock_lock(&(pmas->pmb_lock));
+	pmbm = find_range(pmas,pfn,npages);
+	if(pmbm && pages_used(pmbm,pfn,npages)){
+		buddy_free_run(pmbm,pfn,npages);
+		status = -1;
+	}
+	kernlock_unlock(&(pmas->pmb_lock));
+	return status;
+}
+
+/*
+ * Frees a block. Called with 'pmb_lock' held.
+ */
+static int free_locked(struct physmem_bmaset* pmas,paddr_t page,u_int32_t order){
+	struct physmem_bmalloc* pmbm;
+	paddr_t pfn = DIV_PAGESIZE(page);
+	pmbm = find_range(pmas,pfn,((paddr_t)1)<<order);
+	if(!pmbm) return 0;
+	if(pfn & ((((paddr_t)1)<<order)-1)) return 0; /* Misaligned. */
+	if(!page_used(pmbm,pfn)) return 0;            /* Not allocated. */
+	if(page_cached(pmbm,pfn)) return 0;           /* On a per-CPU list. */
+	buddy_free(pmbm,order,pfn);
+	return -1;
+}
+
+int vm_phys_free_order(struct physmem_bmaset* pmas,paddr_t page,u_int32_t order) {
+	int status;
+	if(order>PMB_MAX_ORDER) return 0;
+	kernlock_lock(&(pmas->pmb_lock));
+	status = free_locked(pmas,page,order);
+	kernlock_unlock(&(pmas->pmb_lock));
+	return status;
+}
+
+u_int32_t vm_phys_alloc_batch(struct physmem_bmaset* pmas,paddr_t *res,u_int32_t n) {
+	u_int32_t i = 0,j,m;
+	kernlock_lock(&(pmas->pmb_lock));
+	for(j=0,m=pmas->pmb_n_maps;(i<n)&&(j<m);){
+		if(buddy_alloc(pmas->pmb_maps[j],0,&res[i])) i++;
+		else j++;
+	}
+	kernlock_unlock(&(pmas->pmb_lock));
+	return i;
+}
+
+static void sort_pages(paddr_t *pages,u_int32_t n){
+	u_int32_t i,j;
+	paddr_t p;
+	for(i=1;i<n;++i){
+		p = pages[i];
+		for(j=i;j && (pages[j-1] > p);--j) pages[j] = pages[j-1];
+		pages[j] = p;
+	}
+}
+
+/*
+ * The pages are sorted, so that the owning range is looked up once per run of pages,
+ * and consecutive pages are freed as whole buddy blocks.
+ */
+void vm_phys_free_batch(struct physmem_bmaset* pmas,paddr_t *pages,u_int32_t n) {
+	struct physmem_bmalloc* pmbm = 0;
+	u_int32_t i,j;
+	paddr_t pfn;
+	sort_pages(pages,n);
+	kernlock_lock(&(pmas->pmb_lock));
+	for(i=0;i<n;i=j){
+		j = i+1;
+		pfn = DIV_PAGESIZE(pages[i]);
+		if(!(pmbm && in_range(pmbm,pfn,1))) pmbm = find_range(pmas,pfn,1);
+		if(!(pmbm && page_used(pmbm,pfn))) continue;
+		if(page_cached(pmbm,pfn)) continue;
+		while(
+			(j<n) &&
+			(DIV_PAGESIZE(pages[j]) == (pfn+(j-i))) &&
+			in_range(pmbm,pfn+(j-i),1) &&
+			page_used(pmbm,pfn+(j-i)) &&
+			!page_cached(pmbm,pfn+(j-i))
+		) ++j;
+		buddy_free_run(pmbm,pfn,j-i);
+	}
+	kernlock_unlock(&(pmas->pmb_lock));
+}
+
+int vm_phys_alloc(struct physmem_bmaset* pmas,paddr_t *res) {
+	if(vm_phys_cpu_alloc(pmas,res)) return -1;
+	return vm_phys_alloc_order(pmas,0,res);
+}
+
+int vm_phys_free(struct physmem_bmaset* pmas,paddr_t page) {
+	if(vm_phys_cpu_free(pmas,page)) return -1;
+	return vm_phys_free_order(pmas,page,0);
+}
+
+/*
+ * The ranges never change after boot, and the allocation bit of a page, that the
+ * caller owns, can't change under it. The mark is set atomically, so of two frees
+ * of the same page, only one gets it. This doesn't take 'pmb_lock'.
+ */
+int vm_phys_page_cache(struct physmem_bmaset* pmas,paddr_t page) {
+	struct physmem_bmalloc* pmbm;
+	paddr_t pfn = DIV_PAGESIZE(page);
+	paddr_t i;
+	if(MUL_PAGESIZE(pfn) != page) return 0; /* Misaligned. */
+	pmbm = find_range(pmas,pfn,1);
+	if(!pmbm) return 0;
+	if(!page_used(pmbm,pfn)) return 0;
+	i = pfn - pmbm->pmb_pfn;
+	if(__atomic_fetch_or(&(pmbm->pmb_cached[DIV_32(i)]),BIT_32(i),__ATOMIC_ACQ_REL) & BIT_32(i))
+		return 0;
+	return 1;
+}
+
+void vm_phys_page_uncache(struct physmem_bmaset* pmas,paddr_t page) {
+	struct physmem_bmalloc* pmbm;
+	paddr_t pfn = DIV_PAGESIZE(page);
+	paddr_t i;
+	pmbm = find_range(pmas,pfn,1);
+	if(!pmbm) return;
+	i = pfn - pmbm->pmb_pfn;
+	__atomic_fetch_and(&(pmbm->pmb_cached[DIV_32(i)]),~BIT_32(i),__ATOMIC_ACQ_REL);
+}
+
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <sys/physmem_alloc.h>
+#include <sys/cpu.h>
+#include <sys/thread.h>
+#include <sys/kernslice.h>
+#include <kern/kmalloc.h>
+#include <libkern/panic.h>
+#include <stdio.h>
+
+static struct physmem_cpu_cache boot_page_cache;
+
+void vm_phys_cpu_init(struct cpu* cpu){
+	struct physmem_cpu_cache* pcc;
+	if(!cpu) return;
+	if(!boot_page_cache.pcc_pmas){
+		pcc = &boot_page_cache;
+	}else{
+		pcc = kmalloc(sizeof(struct physmem_cpu_cache));
+		if(!pcc) panic("vm_phys_cpu_init: out of memory");
+	}
+	pcc->pcc_pmas   = cpu->cpu_kernel_slice->ks_memory_allocator;
+	pcc->pcc_count  = 0;
+	pcc->pcc_low    = PCC_LOW;
+	pcc->pcc_high   = PCC_HIGH;
+	pcc->pcc_hits   = 0;
+	pcc->pcc_misses = 0;
+	cpu->cpu_page_cache = pcc;
+}
+
+int vm_phys_cpu_tune(struct cpu* cpu,u_int32_t low,u_int32_t high){
+	struct physmem_cpu_cache* pcc = cpu->cpu_page_cache;
+	if(!pcc) return 0;
+	if((!low) || (low >= high) || (high > PCC_MAX_PAGES)) return 0;
+	pcc->pcc_low  = low;
+	pcc->pcc_high = high;
+	return 1;
+}
+
+/*
+ * The thread must neither be preempted nor migrated, while it works on the CPU's
+ * page list.
+ */
+static inline struct physmem_cpu_cache* pcc_enter(struct physmem_bmaset* pmas){
+	struct thread* thread = kernel_get_current_cpu()->cpu_current_thread;
+	struct physmem_cpu_cache* pcc;
+	if(thread) thread->t_nonpreempt++;
+	__atomic_signal_fence(__ATOMIC_ACQUIRE);
+	pcc = kernel_get_current_cpu()->cpu_page_cache;
+	if(pcc && (pcc->pcc_pmas == pmas)) return pcc;
+	__atomic_signal_fence(__ATOMIC_RELEASE);
+	if(thread) thread->t_nonpreempt--;
+	return 0;
+}
+
+static inline void pcc_leave(){
+	struct thread* thread = kernel_get_current_cpu()->cpu_current_thread;
+	__atomic_signal_fence(__ATOMIC_RELEASE);
+	if(thread) thread->t_nonpreempt--;
+}
+
+/*
+ * The pages on the list stay allocated in the bitmap, and carry a mark, so that a
+ * page on the list can't be freed again. See vm_phys_page_cache().
+ */
+int vm_phys_cpu_alloc(struct physmem_bmaset* pmas,paddr_t *res){
+	struct physmem_cpu_cache* pcc = pcc_enter(pmas);
+	u_int32_t i;
+	if(!pcc) return 0;
+	if(pcc->pcc_count){
+		pcc->pcc_hits++;
+	}else{
+		pcc->pcc_misses++;
+		pcc->pcc_count = vm_phys_alloc_batch(pmas,pcc->pcc_pages,pcc->pcc_low);
+		if(!pcc->pcc_count){
+			pcc_leave();
+			return 0;
+		}
+		for(i=0;i<pcc->pcc_count;++i)
+			vm_phys_page_cache(pmas,pcc->pcc_pages[i]);
+	}
+	*res = pcc->pcc_pages[--(pcc->pcc_count)];
+	vm_phys_page_uncache(pmas,*res);
+	pcc_leave();
+	return -1;
+}
+
+/*
+ * Only pages, that belong to the allocator, are allocated, and aren't on a list yet,
+ * are put onto the list. Anything else goes to vm_phys_free_order(), which rejects it.
+ */
+int vm_phys_cpu_free(struct physmem_bmaset* pmas,paddr_t page){
+	struct physmem_cpu_cache* pcc;
+	u_int32_t i;
+	pcc = pcc_enter(pmas);
+	if(!pcc) return 0;
+	if(!vm_phys_page_cache(pmas,page)){
+		pcc_leave();
+		return 0;
+	}
+	if(pcc->pcc_count < pcc->pcc_high){
+		pcc->pcc_hits++;
+	}else{
+		pcc->pcc_misses++;
+		for(i=pcc->pcc_low;i<pcc->pcc_count;++i)
+			vm_phys_page_uncache(pmas,pcc->pcc_pages[i]);
+		vm_phys_free_batch(pmas,&(pcc->pcc_pages[pcc->pcc_low]),pcc->pcc_count - pcc->pcc_low);
+		pcc->pcc_count = pcc->pcc_low;
+	}
+	pcc->pcc_pages[(pcc->pcc_count)++] = page;
+	pcc_leave();
+	return -1;
+}
+
+void vm_phys_cpu_stats(struct cpu* cpu,u_int32_t* hits,u_int32_t* misses){
+	struct physmem_cpu_cache* pcc = cpu->cpu_page_cache;
+	*hits   = pcc ? pcc->pcc_hits   : 0;
+	*misses = pcc ? pcc->pcc_misses : 0;
+}
+
+void vm_phys_cpu_print(){
+	struct cpu* cpu;
+	u_int32_t i,n,hits,misses;
+	for(i=0,n=kernslice_count();i<n;++i){
+		for(cpu = kernslice_get(i)->ks_cpu_list; cpu; cpu = cpu->cpu_ks_next){
+			if(!(cpu->cpu_page_cache)) continue;
+			vm_phys_cpu_stats(cpu,&hits,&misses);
+			printf("cpu %u (slice %u): %u pages cached, %u hits, %u misses\n",
+				(unsigned)cpu->cpu_cpu_id,
+				(unsigned)i,
+				(unsigned)cpu->cpu_page_cache->pcc_count,
+				(unsigned)hits,
+				(unsigned)misses);
+		}
+	}
+}
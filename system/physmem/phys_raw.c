@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <sys/physmem_alloc.h>
+#include <sys/kernslice.h>
+#include <sysarch/pages.h>
+
+int vm_phys_raw_alloc(struct kernslice* slice, paddr_t npages, paddr_t *res){
+	struct physmem_range* range;
+	paddr_t    size = npages*SYSARCH_PAGESIZE;
+	u_intptr_t i;
+	int        ok = 0;
+	
+	kernlock_lock(&(slice->ks_memory_raw_lock));
+	for(i=slice->ks_raw_memory.range_idx;i<slice->ks_num_memory_ranges;++i){
+		range = &(slice->ks_memory_ranges[i]);
+		if((range->pm_end - range->pm_begin) < size) continue;
+		*res = range->pm_begin;
+		range->pm_begin += size;
+		slice->ks_raw_memory.range_idx    = i;
+		slice->ks_raw_memory.pos_in_range = range->pm_begin;
+		ok = -1;
+		break;
+	}
+	kernlock_unlock(&(slice->ks_memory_raw_lock));
+	return ok;
+}
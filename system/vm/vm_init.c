@@ -40,17 +40,7 @@ void vm_init(){
 	vm_mem_init   ();
 	vm_range_init ();
 	
-	vm_seg_refill  ();
-	vm_mem_refill  ();
-	vm_range_refill();
-	
 	/* Initial vm_as_mcram(). */
 	vm_as_mcram    ();
 }
 
-void vm_refill(){
-	vm_seg_refill  ();
-	vm_mem_refill  ();
-	vm_range_refill();
-}
-
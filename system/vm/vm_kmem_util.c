@@ -30,6 +30,8 @@
 #include <sys/kernslice.h>
 #include <sys/physmem_alloc.h>
 #include <vm/pmap.h>
+#include <vm/vm_numa.h>
+#include <vm/vm_page.h>
 #include <kern/zalloc.h>
 
 #ifdef SYSARCH_PAGESIZE_SHIFT
@@ -45,8 +47,6 @@
 #define NORMAL   0
 #define CRITICAL 1
 
-#define PMBM(slice) ((slice)->ks_memory_allocator)
-
 #define VM_PROT_KMEM  VM_PROT_READ | VM_PROT_WRITE
 
 static struct vm_mem* vm_mem_kfilled(vaddr_t size,struct kernslice* slice, int level){
@@ -56,7 +56,8 @@ static struct vm_mem* vm_mem_kfilled(vaddr_t size,struct kernslice* slice, int l
 	vaddr_t N = DIV_PAGESIZE(size); /* XXX: this should be rounded up by default. */
 	vaddr_t i,j,M;
 	paddr_t page;
-	vm_range_t range,next = 0;
+	paddr_t pages[VM_RANGE_NUM];
+	vm_range_t range;
 	
 	/* This shouldn't happen. */
 	if(N<1) return 0;
@@ -73,52 +74,42 @@ static struct vm_mem* vm_mem_kfilled(vaddr_t size,struct kernslice* slice, int l
 	 * If the mapping is only one memory page big, put-in the page directly.
 	 */
 	if(N==1){
-		if(!vm_phys_alloc(PMBM(slice),&page)) goto FAILED;
+		if(!vm_numa_alloc(VM_NUMA_DEFAULT,&page,0)) goto FAILED;
 		mem->mem_phys_type = VMM_IS_PGADDR;
 		mem->mem_pgaddr = page;
 		return mem;
 	}
 	
 	/*
-	 * Otherwise, allocate one or more vm_range_t structs.
+	 * Try to get a physically contiguous run first. It is described by the
+	 * vm_mem_t itself, with no vm_range_t structs at all.
 	 */
-	if(level) range = vm_range_alloc_critical(slice);
-	else      range = vm_range_alloc(1,slice);
-	if(!range) goto FAILED;
-	mem->mem_pmrange = range;
-	mem->mem_phys_type = VMM_IS_PMRANGE;
+	if( (N <= (1<<PMB_MAX_ORDER)) && vm_numa_alloc_contig(VM_NUMA_DEFAULT,N,SYSARCH_PAGESIZE,&page,0) ){
+		mem->mem_phys_type = VMM_IS_EXTENT;
+		mem->mem_extent = page;
+		mem->mem_extent_pages = N;
+		return mem;
+	}
 	
 	/*
-	 * Allocate Physical Memory and put it into the vm_range_t
+	 * Otherwise, allocate a chain of vm_range_t structs, in as few zone lock
+	 * round-trips as possible.
 	 */
-	M = N;
-	if(M>VM_RANGE_NUM) M = VM_RANGE_NUM;
-	for(j=0;j<M;++j){
-		if(!vm_phys_alloc(PMBM(slice),&page)) goto FAILED2;
-		range->rang_pages[j].page_addr = page;
-		vm_range_bmset(range,j);
-	}
+	M = (N + VM_RANGE_NUM - 1)/VM_RANGE_NUM;
+	if(level) range = vm_range_alloc_chain_critical(slice,M);
+	else      range = vm_range_alloc_chain(1,slice,M);
+	if(!range) goto FAILED;
+	mem->mem_pmrange = range;
+	mem->mem_phys_type = VMM_IS_PMRANGE;
 	
 	/*
-	 * Allocate subsequent ranges.
+	 * Allocate Physical Memory and put it into the vm_range_t structs.
 	 */
-	for(i=VM_RANGE_NUM;i<N;i+=VM_RANGE_NUM){
-		/*
-		 * Allocate another range and append it to the list.
-		 */
-		if(level) next = vm_range_alloc_critical(slice);
-		else      next = vm_range_alloc(1,slice);
-		if(!next) goto FAILED;
-		range->rang_next = next;
-		range = next;
-		
-		/*
-		 * XXX: This is duplicate code. See above.
-		 */
+	for(i=0;i<N;i+=M, range = range->rang_next){
 		M = N-i;
 		if(M>VM_RANGE_NUM) M = VM_RANGE_NUM;
 		for(j=0;j<M;++j){
-			if(!vm_phys_alloc(PMBM(slice),&page)) goto FAILED2;
+			if(!vm_numa_alloc(VM_NUMA_DEFAULT,&page,0)) goto FAILED2;
 			range->rang_pages[j].page_addr = page;
 			vm_range_bmset(range,j);
 		}
@@ -129,16 +120,14 @@ static struct vm_mem* vm_mem_kfilled(vaddr_t size,struct kernslice* slice, int l
 	 * On error, we need to free allocated resources.
 	 */
 	FAILED2:
-	range = mem->mem_pmrange;
-	while(range){
-		for(j=0;j<VM_RANGE_NUM;++j){
+	for(range = mem->mem_pmrange; range; range = range->rang_next){
+		for(j=0,M=0;j<VM_RANGE_NUM;++j){
 			if(vm_range_bmlkup(range,j))
-				vm_phys_free(PMBM(slice),range->rang_pages[j].page_addr);
+				pages[M++] = range->rang_pages[j].page_addr;
 		}
-		next = range->rang_next;
-		zfree(range);
-		range = next;
+		vm_page_free_batch(slice,pages,(u_int32_t)M);
 	}
+	vm_range_free_chain(mem->mem_pmrange);
 	FAILED:
 	zfree(mem);
 	return 0;
@@ -195,7 +184,14 @@ static int vm_kalloc_generic(vaddr_t *addr /* [out] */,vaddr_t *size /* [in/out]
 	/*
 	 * Now, we allocate memory for this segment.
 	 */
-	if(!vm_seg_kfill(seg,as->as_pmap,level)) goto endKalloc2;
+	if(!vm_seg_kfill(seg,as->as_pmap,level)) {
+		/*
+		 * We ran out of physical memory. Ask the zone allocator to give back
+		 * it's empty slabs.
+		 */
+		zgc_request();
+		goto endKalloc2;
+	}
 	
 	/*
 	 * Finally, we map the entire allocated memory to the segment's address range.
@@ -237,3 +233,43 @@ int vm_alloc_critical(vaddr_t *addr /* [out] */,vaddr_t *size /* [in/out]*/){
 	return vm_kalloc_generic(addr,size,CRITICAL);
 }
 
+
+int vm_kfree_ll(vaddr_t addr){
+	vm_as_t as;
+	vm_seg_t seg = 0;
+	vm_mem_t mem;
+	vm_bintree_t* entry;
+	
+	as = vm_as_get_kernel();
+	
+	/*
+	 * Lookup the segment, that starts at 'addr'.
+	 */
+	kernlock_lock(&(as->as_lock_segs));
+	entry = bt_lookup(&(as->as_segs),addr);
+	if(entry && *entry) seg = (vm_seg_t)((*entry)->V);
+	kernlock_unlock(&(as->as_lock_segs));
+	
+	if(!seg) return 0;
+	
+	kernlock_lock(&(seg->seg_lock));
+	
+	/*
+	 * Unmap the segment, and detach it from the address space.
+	 */
+	if(!vm_remove_entry(as,seg)) {
+		kernlock_unlock(&(seg->seg_lock));
+		return 0;
+	}
+	mem = seg->seg_mem;
+	seg->seg_mem = 0;
+	
+	kernlock_unlock(&(seg->seg_lock));
+	
+	/*
+	 * Return the physical memory to the allocator.
+	 */
+	if(mem) vm_mem_destroy(mem,pmap_kernslice(as->as_pmap));
+	zfree(seg);
+	return 1;
+}
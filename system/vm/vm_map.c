@@ -22,6 +22,7 @@
  */
 #include <vm/vm_map.h>
 #include <kern/zalloc.h>
+#include <sysarch/pages.h>
 #include <string.h>
 #include <xcpu/vm.h>
 
@@ -30,17 +31,14 @@ static zone_t vm_map_entry_zone;   /* Zone for vm_map_entry objects. (User mode)
 static zone_t vm_map_kentry_zone;  /* Zone for vm_map_entry objects. (Kernel mode) */
 
 
-/* This is the size of a cache line (in x86). */
-#define CACHE_LINE  128
-
-static u_int8_t z_map_buf[1<<12] __attribute__ ((aligned (CACHE_LINE)));
+static u_int8_t z_map_buf[1<<12] __attribute__ ((aligned (SYSARCH_PAGESIZE)));
 
 static struct vm_map kernel_map;
 
 void vm_map_init(){
 	vm_map_zone        = zinit(sizeof(struct vm_map),ZONE_AUTO_REFILL,"VM address space zone");
 	vm_map_entry_zone  = zinit(sizeof(struct vm_map_entry),ZONE_AUTO_REFILL,"user mode segment zone");
-	vm_map_kentry_zone = zinit(sizeof(struct vm_map_entry),0,"kernel mode segment zone");
+	vm_map_kentry_zone = zinit(sizeof(struct vm_map_entry),ZONE_NOCACHE,"kernel mode segment zone");
 	
 	zcram(vm_map_kentry_zone,(void*)z_map_buf,sizeof(z_map_buf));
 	
@@ -24,34 +24,28 @@
 #include <vm/vm_top.h>
 #include <vm/vm_priv.h>
 #include <kern/zalloc.h>
+#include <sysarch/pages.h>
 #include <string.h>
 
 static zone_t vm_mem_zone;  /* Zone for user vm_mem structures. */
 static zone_t vm_kmem_zone; /* Zone for kernel vm_mem structures. */
 static zone_t vm_cmem_zone; /* Zone for critical kernel vm_mem structures. */
 
-/* This is the size of a cache line (in x86). */
-#define CACHE_LINE  128
-
-static u_int8_t z_mem_buf[1<<12] __attribute__ ((aligned (CACHE_LINE)));
+/*
+ * The zone allocator carves crammed memory into page sized slabs, so the static
+ * buffer must be page aligned.
+ */
+static u_int8_t z_mem_buf[1<<12] __attribute__ ((aligned (SYSARCH_PAGESIZE)));
 
 void vm_mem_init(){
 	vm_mem_zone = zinit(sizeof(struct vm_mem),ZONE_AUTO_REFILL,"user-mode memory zone");
 	vm_kmem_zone = zinit(sizeof(struct vm_mem),
 	               ZONE_AUTO_REFILL|ZONE_AR_CRITICAL,"kernel-mode memory zone");
-	vm_cmem_zone = zinit(sizeof(struct vm_mem),0,"critical kernel-mode memory zone");
+	vm_cmem_zone = zinit(sizeof(struct vm_mem),ZONE_AUTO_REFILL|ZONE_AR_CRITICAL|ZONE_NOCACHE,"critical kernel-mode memory zone");
+	zone_set_watermarks(vm_cmem_zone,16,64,320);
 	zcram(vm_cmem_zone,(void*)z_mem_buf,sizeof(z_mem_buf));
 }
 
-void vm_mem_refill(){
-	vaddr_t begin,size;
-	if( zcount(vm_cmem_zone) < 64 ){
-		size = (vaddr_t)zbufsize(vm_cmem_zone) * 256;
-		if(!vm_alloc_critical(&begin,&size)) return;
-		zcram(vm_cmem_zone,(void*)begin,(size_t)size);
-	}
-}
-
 int vm_mem_lookup(struct vm_mem* mem, vaddr_t rva, paddr_t *pag, vm_prot_t *prot){
 	vm_page_t pgobj;
 	switch(mem->mem_phys_type){
@@ -66,6 +60,10 @@ int vm_mem_lookup(struct vm_mem* mem, vaddr_t rva, paddr_t *pag, vm_prot_t *prot
 		return -1;
 	case VMM_IS_PMRANGE:
 		return vm_range_get(mem->mem_pmrange,rva,pag,prot);
+	case VMM_IS_EXTENT:
+		if( (rva/SYSARCH_PAGESIZE) >= mem->mem_extent_pages ) return 0;
+		*pag = mem->mem_extent + (rva & ~((vaddr_t)(SYSARCH_PAGESIZE-1)));
+		return -1;
 	}
 	return 0;
 }
@@ -88,13 +86,17 @@ void vm_mem_destroy(struct vm_mem* mem,struct kernslice* slice) {
 	switch(mem->mem_phys_type){
 	case VMM_IS_PGADDR:
 		vm_page_free(slice,mem->mem_pgaddr);
-		return;
+		break;
 	case VMM_IS_PGOBJ:
 		if(mem->mem_pgobj)   vm_page_drop(mem->mem_pgobj);
-		return;
+		break;
 	case VMM_IS_PMRANGE:
 		if(mem->mem_pmrange) vm_range_drop(mem->mem_pmrange);
-		return;
+		break;
+	case VMM_IS_EXTENT:
+		vm_page_free_contig(slice,mem->mem_extent,mem->mem_extent_pages);
+		break;
 	}
+	zfree(mem);
 }
 
@@ -0,0 +1,123 @@
+/*
+ * 
+ * Copyright (c) 2017 Simon Schmidt
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <vm/vm_numa.h>
+#include <sys/kernslice.h>
+#include <sys/physmem_alloc.h>
+#include <sys/cpu.h>
+#include <stdio.h>
+
+static int       vm_numa_policy = VM_NUMA_LOCAL;
+static u_int32_t vm_numa_next   = 0;
+
+int vm_numa_get_policy(){
+	return vm_numa_policy;
+}
+
+int vm_numa_set_policy(int policy){
+	if( (policy < VM_NUMA_LOCAL) || (policy > VM_NUMA_INTERLEAVE) ) return 0;
+	vm_numa_policy = policy;
+	return -1;
+}
+
+/*
+ * Returns the slice, the allocation should be served from first.
+ */
+static struct kernslice* vm_numa_target(int policy){
+	u_int32_t n = kernslice_count();
+	if( (policy == VM_NUMA_INTERLEAVE) && (n > 1) )
+		return kernslice_get(__atomic_fetch_add(&vm_numa_next,1,__ATOMIC_RELAXED) % n);
+	return kernel_get_current_cpu()->cpu_kernel_slice;
+}
+
+/*
+ * Returns the nearest slice to 'home', that is not in 'tried' (a bitmap of indices),
+ * or 0 if all slices have been tried.
+ */
+static struct kernslice* vm_numa_nearest(struct kernslice* home, u_int32_t tried){
+	struct kernslice *slice,*best = 0;
+	u_int32_t i,n = kernslice_count();
+	u_int32_t d,bestd = 0;
+	for(i=0;i<n;++i){
+		if(tried & (1<<i)) continue;
+		slice = kernslice_get(i);
+		d = kernslice_distance(home,slice);
+		if( (!best) || (d < bestd) ){
+			best  = slice;
+			bestd = d;
+		}
+	}
+	return best;
+}
+
+/*
+ * The common part of the allocation functions. 'npages' is 0 for a single page.
+ */
+static int vm_numa_alloc_generic(int policy, paddr_t npages, paddr_t align, paddr_t *res, struct kernslice** owner){
+	struct kernslice *home,*slice;
+	u_int32_t tried;
+	int ok;
+	
+	if(policy == VM_NUMA_DEFAULT) policy = vm_numa_policy;
+	
+	home  = vm_numa_target(policy);
+	slice = home;
+	tried = 0;
+	while(slice){
+		tried |= 1<<(slice->ks_index);
+		if(!slice->ks_memory_allocator) ok = 0;
+		else if(npages) ok = vm_phys_alloc_contig(slice->ks_memory_allocator,npages,align,res);
+		else       ok = vm_phys_alloc(slice->ks_memory_allocator,res);
+		if(ok){
+			if(slice == home) __atomic_fetch_add(&(slice->ks_numa_hits),1,__ATOMIC_RELAXED);
+			else __atomic_fetch_add(&(slice->ks_numa_fallbacks),1,__ATOMIC_RELAXED);
+			if(owner) *owner = slice;
+			return -1;
+		}
+		if(slice == home) __atomic_fetch_add(&(home->ks_numa_misses),1,__ATOMIC_RELAXED);
+		if(policy == VM_NUMA_STRICT) break;
+		slice = vm_numa_nearest(home,tried);
+	}
+	return 0;
+}
+
+int vm_numa_alloc(int policy, paddr_t *res, struct kernslice** owner){
+	return vm_numa_alloc_generic(policy,0,0,res,owner);
+}
+
+int vm_numa_alloc_contig(int policy, paddr_t npages, paddr_t align, paddr_t *res, struct kernslice** owner){
+	if(!npages) return 0;
+	return vm_numa_alloc_generic(policy,npages,align,res,owner);
+}
+
+void vm_numa_print(){
+	struct kernslice* slice;
+	u_int32_t i,n = kernslice_count();
+	for(i=0;i<n;++i){
+		slice = kernslice_get(i);
+		printf("slice %u: %u hits, %u misses, %u fallbacks\n",
+			(unsigned)i,
+			(unsigned)slice->ks_numa_hits,
+			(unsigned)slice->ks_numa_misses,
+			(unsigned)slice->ks_numa_fallbacks);
+	}
+}
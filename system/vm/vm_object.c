@@ -22,6 +22,7 @@
  */
 #include <vm/vm_object.h>
 #include <kern/zalloc.h>
+#include <sysarch/pages.h>
 #include <string.h>
 #include <xcpu/vm.h>
 #include <vm/vm_priv.h>
@@ -30,19 +31,10 @@ static zone_t vm_object_zone;   /* VM object Zone. */
 
 static zone_t vm_c_object_zone; /* Zone for vm_map_entry objects. */
 
-/* This is the size of a cache line (in x86). */
-#define CACHE_LINE  128
+static u_int8_t z_obj_buf[1<<12] __attribute__ ((aligned (SYSARCH_PAGESIZE)));
 
-static u_int8_t z_obj_buf[1<<12] __attribute__ ((aligned (CACHE_LINE)));
-
-void vm_object_init(){
-	vm_object_zone     = zinit(sizeof(struct vm_object),ZONE_AUTO_REFILL,"VM object zone.");
-	vm_c_object_zone   = zinit(sizeof(struct vm_object),0,"VM object zone. (Critical)");
-	
-	zcram(vm_c_object_zone,(void*)z_obj_buf,sizeof(z_obj_buf));
-}
-
-static void vm_object_constructor(vm_object_t obj){
+static void vm_object_constructor(void* ptr){
+	vm_object_t obj = ptr;
 	list_init(&(obj->memq));
 	list_init(&(obj->parents));
 	obj->size = 0;
@@ -70,16 +62,22 @@ static void vm_object_constructor(vm_object_t obj){
 	obj->Lock                = 0;
 }
 
+void vm_object_init(){
+	vm_object_zone     = zinit_ctor(sizeof(struct vm_object),ZONE_AUTO_REFILL,"VM object zone.",
+	                                vm_object_constructor,0);
+	vm_c_object_zone   = zinit_ctor(sizeof(struct vm_object),ZONE_NOCACHE,"VM object zone. (Critical)",
+	                                vm_object_constructor,0);
+	
+	zcram(vm_c_object_zone,(void*)z_obj_buf,sizeof(z_obj_buf));
+}
+
+/*
+ * Objects are kept constructed in the zones. They must be freed in that state.
+ */
 struct vm_object* vm_object_alloc_critical(){
-	vm_object_t obj = zalloc(vm_c_object_zone);
-	if(obj)
-		vm_object_constructor(obj);
-	return obj;
+	return zalloc(vm_c_object_zone);
 }
 vm_object_t vm_object_alloc(){
-	vm_object_t obj = zalloc(vm_c_object_zone);
-	if(obj)
-		vm_object_constructor(obj);
-	return obj;
+	return zalloc(vm_object_zone);
 }
 
@@ -26,9 +26,121 @@
 #include <sys/physmem_alloc.h>
 #include <kern/zalloc.h>
 #include <vm/pmap.h>
+#include <vm/vm_top.h>
+#include <libkern/panic.h>
+#include <stdio.h>
+#include <string.h>
+
+static int vm_page_refill(struct kernslice* slice);
+
+void vm_page_init(struct kernslice* slice){
+	struct physmem_range* ranges = slice->ks_memory_ranges;
+	u_intptr_t i,n = slice->ks_num_memory_ranges;
+	paddr_t    first,last,pfn,end;
+	vaddr_t    addr,size;
+	vm_page_t  page;
+	
+	list_init(&(slice->ks_memory_free_list));
+	list_init(&(slice->ks_memory_fictitious));
+	slice->ks_memory_free_count = 0;
+	slice->ks_memory_fic_count  = 0;
+	
+	if(!n) return;
+	
+	/*
+	 * The array spans all memory ranges of the slice.
+	 */
+	first = ranges[0].pm_begin;
+	last  = ranges[0].pm_end;
+	for(i=1;i<n;++i){
+		if(ranges[i].pm_begin < first) first = ranges[i].pm_begin;
+		if(ranges[i].pm_end   > last ) last  = ranges[i].pm_end;
+	}
+	first /= SYSARCH_PAGESIZE;
+	last  /= SYSARCH_PAGESIZE;
+	
+	size = (vaddr_t)((last-first)*sizeof(struct vm_page));
+	if(!vm_kalloc_ll(&addr,&size)) panic("vm_page_init: Couldn't allocate the vm_page array!");
+	
+	slice->ks_page_array = (vm_page_t)addr;
+	slice->ks_page_pfn   = first;
+	slice->ks_page_count = last-first;
+	
+	/*
+	 * Every frame starts out as private, until it is found in a range.
+	 */
+	memset((void*)addr,0,(last-first)*sizeof(struct vm_page));
+	for(pfn=first;pfn<last;++pfn){
+		page = &(slice->ks_page_array[pfn-first]);
+		page->phys_addr  = pfn*SYSARCH_PAGESIZE;
+		page->pg_slice   = slice;
+		page->is_private = 1;
+		kernlock_init(&(page->pg_lock));
+	}
+	for(i=0;i<n;++i){
+		end = ranges[i].pm_end/SYSARCH_PAGESIZE;
+		for(pfn=ranges[i].pm_begin/SYSARCH_PAGESIZE;pfn<end;++pfn)
+			slice->ks_page_array[pfn-first].is_private = 0;
+	}
+	
+	while(slice->ks_memory_free_count < VM_PAGE_FREE_LOW)
+		if(!vm_page_refill(slice)) break;
+}
+
+vm_page_t vm_page_lookup(struct kernslice* slice, paddr_t addr){
+	paddr_t idx = addr/SYSARCH_PAGESIZE;
+	if(idx < slice->ks_page_pfn) return (vm_page_t)0;
+	idx -= slice->ks_page_pfn;
+	if(idx >= slice->ks_page_count) return (vm_page_t)0;
+	return &(slice->ks_page_array[idx]);
+}
+
+/*
+ * Pages may have been allocated from another slice, than the one given. Free them
+ * to the slice, they belong to.
+ */
+static struct kernslice* vm_page_owner(struct kernslice* slice, paddr_t addr){
+	struct kernslice* owner = kernslice_find(addr);
+	return owner ? owner : slice;
+}
 
 void vm_page_free(struct kernslice* slice, paddr_t addr){
-	vm_phys_free(slice->ks_memory_allocator,addr);
+	vm_phys_free(vm_page_owner(slice,addr)->ks_memory_allocator,addr);
+}
+
+void vm_page_free_contig(struct kernslice* slice, paddr_t addr, paddr_t npages){
+	vm_phys_free_contig(vm_page_owner(slice,addr)->ks_memory_allocator,addr,npages);
+}
+
+void vm_page_free_batch(struct kernslice* slice, paddr_t *addrs, u_int32_t n){
+	struct kernslice* owner;
+	u_int32_t i,m;
+	paddr_t   t;
+	if(!n) return;
+	if(kernslice_count() <= 1){
+		vm_phys_free_batch(vm_page_owner(slice,addrs[0])->ks_memory_allocator,addrs,n);
+		return;
+	}
+	
+	/*
+	 * Move the pages of the first page's slice to the front, and free them in one
+	 * batch. Repeat with the rest.
+	 */
+	while(n){
+		owner = vm_page_owner(slice,addrs[0]);
+		for(i=0,m=0;i<n;++i){
+			if(vm_page_owner(slice,addrs[i]) != owner) continue;
+			if(i!=m){
+				t = addrs[m];
+				addrs[m] = addrs[i];
+				addrs[i] = t;
+			}
+			m++;
+		}
+		vm_phys_free_batch(owner->ks_memory_allocator,addrs,m);
+		addrs += m;
+		n -= m;
+	}
 }
 
 void vm_page_drop(vm_page_t page){
@@ -45,42 +157,58 @@ void vm_page_drop(vm_page_t page){
 }
 
 void vm_page_release(vm_page_t page){
-	if(page->is_private){
+	struct kernslice* slice = page->pg_slice;
+	if(page->is_private && !page->fictitious){
+		/* Frames of the vm_page array are never turned into fictitious pages. */
+		if(vm_page_lookup(slice,page->phys_addr)==page) return;
 		page->fictitious = 1;
 		page->is_private = 0;
 		page->phys_addr = 0;
 	}
-	struct kernslice* slice = page->pg_slice;
 	kernlock_lock(&(slice->ks_memory_lock));
-	page->free = 1;
 	if(page->fictitious){
+		page->free = 1;
 		list_push_tail(&(slice->ks_memory_fictitious),&(page->pagequeue));
 		slice->ks_memory_fic_count++;
-	}else{
+	}else if(slice->ks_memory_free_count < VM_PAGE_FREE_HIGH){
+		page->free = 1;
 		list_push_tail(&(slice->ks_memory_free_list),&(page->pagequeue));
 		slice->ks_memory_free_count++;
+	}else{
+		/* The free list is full, give the frame back to the physical allocator. */
+		kernlock_unlock(&(slice->ks_memory_lock));
+		page->object = 0;
+		list_clear(&(page->pagequeue));
+		vm_phys_free(slice->ks_memory_allocator,page->phys_addr);
+		return;
 	}
 	kernlock_unlock(&(slice->ks_memory_lock));
 }
 
-struct vm_page* vm_page_grab_critical(struct kernslice* slice){
-	vm_page_t page = (vm_page_t)0;
+/*
+ * Takes up to VM_PAGE_FREE_BATCH frames from the physical allocator, and puts their
+ * vm_page structures onto the free list.
+ */
+static int vm_page_refill(struct kernslice* slice){
+	paddr_t   pages[VM_PAGE_FREE_BATCH];
+	vm_page_t page;
+	u_int32_t i,n;
 	
-	kernlock_lock(&(slice->ks_memory_lock));
+	n = vm_phys_alloc_batch(slice->ks_memory_allocator,pages,VM_PAGE_FREE_BATCH);
+	if(!n) return 0;
 	
-	if(slice->ks_memory_free_count){
-		slice->ks_memory_free_count--;
-		page = containerof(list_pop_head(&(slice->ks_memory_free_list)),struct vm_page,pagequeue);
-		page->free    = 0;
-		page->pg_refc = 1;
+	kernlock_lock(&(slice->ks_memory_lock));
+	for(i=0;i<n;++i){
+		page = PHYS_TO_VM_PAGE(slice,pages[i]);
+		page->free = 1;
+		list_push_tail(&(slice->ks_memory_free_list),&(page->pagequeue));
+		slice->ks_memory_free_count++;
 	}
-	
 	kernlock_unlock(&(slice->ks_memory_lock));
-	
-	return page;
+	return -1;
 }
 
-vm_page_t vm_page_grab(struct kernslice* slice){
+static vm_page_t vm_page_pop(struct kernslice* slice){
 	vm_page_t page = (vm_page_t)0;
 	
 	kernlock_lock(&(slice->ks_memory_lock));
@@ -97,6 +225,25 @@ vm_page_t vm_page_grab(struct kernslice* slice){
 	return page;
 }
 
+struct vm_page* vm_page_grab_critical(struct kernslice* slice){
+	vm_page_t page;
+	
+	for(;;){
+		page = vm_page_pop(slice);
+		if(page) return page;
+		if(!vm_page_refill(slice)) return (vm_page_t)0;
+	}
+}
+
+vm_page_t vm_page_grab(struct kernslice* slice){
+	vm_page_t page;
+	
+	page = vm_page_pop(slice);
+	if(page) return page;
+	if(!vm_page_refill(slice)) return (vm_page_t)0;
+	return vm_page_pop(slice);
+}
+
 vm_page_t vm_page_grab_fictitious(struct kernslice* slice){
 	vm_page_t page = (vm_page_t)0;
 	
@@ -120,3 +267,49 @@ void vm_page_zero_fill(vm_page_t page){
 	
 }
 
+
+int vm_page_grab_zeroed(struct kernslice* slice, paddr_t *res){
+	kernlock_lock(&(slice->ks_zero_lock));
+	if(slice->ks_zero_count){
+		*res = slice->ks_zero_pages[--(slice->ks_zero_count)];
+		slice->ks_zero_hits++;
+		kernlock_unlock(&(slice->ks_zero_lock));
+		return -1;
+	}
+	slice->ks_zero_misses++;
+	kernlock_unlock(&(slice->ks_zero_lock));
+	
+	if(!vm_phys_alloc(slice->ks_memory_allocator,res)) return 0;
+	pmap_zero_page(*res);
+	return -1;
+}
+
+int vm_page_zero_idle(struct kernslice* slice){
+	paddr_t page;
+	if(slice->ks_zero_count >= KS_ZERO_POOL) return 0;
+	if(!vm_phys_alloc(slice->ks_memory_allocator,&page)) return 0;
+	pmap_zero_page(page);
+	
+	kernlock_lock(&(slice->ks_zero_lock));
+	if(slice->ks_zero_count < KS_ZERO_POOL){
+		slice->ks_zero_pages[(slice->ks_zero_count)++] = page;
+		page = 0;
+	}
+	kernlock_unlock(&(slice->ks_zero_lock));
+	
+	/* Someone else filled the pool in the meantime. */
+	if(page) vm_phys_free(slice->ks_memory_allocator,page);
+	return -1;
+}
+
+void vm_page_zero_print(struct kernslice* slice){
+	u_int32_t hits = slice->ks_zero_hits;
+	u_int32_t total = hits + slice->ks_zero_misses;
+	while(total > 0x1000000){
+		hits >>= 1;
+		total >>= 1;
+	}
+	printf("zeroed pages: %u pooled, %u hits, %u misses (%u%% hit rate)\n",
+		(unsigned)slice->ks_zero_count,(unsigned)slice->ks_zero_hits,(unsigned)slice->ks_zero_misses,
+		(unsigned)(total ? ((hits*100)/total) : 0));
+}
@@ -37,25 +37,31 @@ static zone_t vm_crange_zone; /* Zone for critical kernel vm_range structures. *
 #define DIV_PAGESIZE(x)  ((x)/SYSARCH_PAGESIZE)
 #endif
 
-/* This is the size of a cache line (in x86). */
-#define CACHE_LINE  128
+static u_intptr_t z_range_buf[1<<12] __attribute__ ((aligned (SYSARCH_PAGESIZE)));
 
-static u_intptr_t z_range_buf[1<<12] __attribute__ ((aligned (CACHE_LINE)));
+/*
+ * Ranges are kept constructed in the zones: All page slots are empty, and the lock
+ * is initialized. vm_range_destroy() empties the slots, it walks anyway.
+ */
+static void vm_range_ctor(void* obj){
+	vm_range_t range = obj;
+	memset((void*)range,0,sizeof(struct vm_range));
+	kernlock_init(&(range->rang_lock));
+}
 
-void vm_range_init(){
-	vm_range_zone = zinit(sizeof(struct vm_range),ZONE_AUTO_REFILL,"user-mode range zone");
-	vm_krange_zone = zinit(sizeof(struct vm_range),ZONE_AUTO_REFILL|ZONE_AR_CRITICAL,"kernel-mode range zone");
-	vm_crange_zone = zinit(sizeof(struct vm_range),0,"critical kernel-mode range zone");
-	zcram(vm_crange_zone,(void*)z_range_buf,sizeof(z_range_buf));
+static inline vm_range_t vm_range_reset(vm_range_t range, struct kernslice* slice){
+	range->rang_slice = slice;
+	range->rang_refc = 1;
+	range->rang_next = 0;
+	return range;
 }
 
-void vm_range_refill(){
-	vaddr_t begin,size;
-	if( zcount(vm_crange_zone) < 128 ){
-		size = (vaddr_t)zbufsize(vm_crange_zone) * 256;
-		if(!vm_alloc_critical(&begin,&size)) return;
-		zcram(vm_crange_zone,(void*)begin,(size_t)size);
-	}
+void vm_range_init(){
+	vm_range_zone = zinit_ctor(sizeof(struct vm_range),ZONE_AUTO_REFILL,"user-mode range zone",vm_range_ctor,0);
+	vm_krange_zone = zinit_ctor(sizeof(struct vm_range),ZONE_AUTO_REFILL|ZONE_AR_CRITICAL,"kernel-mode range zone",vm_range_ctor,0);
+	vm_crange_zone = zinit_ctor(sizeof(struct vm_range),ZONE_AUTO_REFILL|ZONE_AR_CRITICAL|ZONE_NOCACHE,"critical kernel-mode range zone",vm_range_ctor,0);
+	zone_set_watermarks(vm_crange_zone,16,128,384);
+	zcram(vm_crange_zone,(void*)z_range_buf,sizeof(z_range_buf));
 }
 
 int vm_range_bmlkup(vm_range_t range, int i){
@@ -101,30 +107,79 @@ int vm_range_get   (vm_range_t range, vaddr_t rva, paddr_t *pag, vm_prot_t *prot
 vm_range_t vm_range_alloc(int kernel, struct kernslice* slice){
 	vm_range_t range = zalloc(kernel ? vm_krange_zone : vm_range_zone);
 	if(!range) return 0;
-	memset((void*)range,0,sizeof(struct vm_range));
-	kernlock_init(&(range->rang_lock));
-	range->rang_slice = slice;
-	range->rang_refc = 1;
-	return range;
+	return vm_range_reset(range,slice);
 }
 
 struct vm_range *vm_range_alloc_critical(struct kernslice* slice){
 	vm_range_t range = zalloc(vm_crange_zone);
 	if(!range) return 0;
-	memset((void*)range,0,sizeof(struct vm_range));
-	kernlock_init(&(range->rang_lock));
-	range->rang_slice = slice;
-	range->rang_refc = 1;
-	return range;
+	return vm_range_reset(range,slice);
+}
+
+/* Number of ranges, allocated or freed per zone lock round-trip. */
+#define VM_RANGE_BATCH 16
+
+static vm_range_t vm_range_alloc_chain_from(zone_t zone, struct kernslice* slice, u_int32_t n){
+	vm_range_t batch[VM_RANGE_BATCH];
+	vm_range_t head = 0, *tail = &head;
+	u_int32_t i,k,got;
+	
+	while(n){
+		k = (n > VM_RANGE_BATCH) ? VM_RANGE_BATCH : n;
+		got = zalloc_bulk(zone,k,(void**)batch);
+		for(i=0;i<got;++i){
+			vm_range_reset(batch[i],slice);
+			*tail = batch[i];
+			tail = &(batch[i]->rang_next);
+		}
+		if(got<k){
+			vm_range_free_chain(head);
+			return 0;
+		}
+		n -= k;
+	}
+	return head;
+}
+
+vm_range_t vm_range_alloc_chain(int kernel, struct kernslice* slice, u_int32_t n){
+	return vm_range_alloc_chain_from(kernel ? vm_krange_zone : vm_range_zone,slice,n);
+}
+
+struct vm_range *vm_range_alloc_chain_critical(struct kernslice* slice, u_int32_t n){
+	return vm_range_alloc_chain_from(vm_crange_zone,slice,n);
+}
+
+void vm_range_free_chain(vm_range_t range){
+	vm_range_t batch[VM_RANGE_BATCH];
+	u_int32_t k = 0;
+	
+	while(range){
+		batch[k++] = range;
+		range = range->rang_next;
+		/* This is an error path, so simply reconstruct the range. */
+		vm_range_ctor(batch[k-1]);
+		if(k==VM_RANGE_BATCH){
+			zfree_bulk((void**)batch,k);
+			k = 0;
+		}
+	}
+	zfree_bulk((void**)batch,k);
 }
 
 static void vm_range_destroy(vm_range_t range){
+	paddr_t pages[VM_RANGE_NUM];
+	u_int32_t n = 0;
 	int i;
 	for(i=0;i<VM_RANGE_NUM;++i){
 		if(vm_range_bmlkup(range,i))
-			vm_page_free(range->rang_slice,range->rang_pages[i].page_addr);
-		else	vm_page_drop(range->rang_pages[i].page_obj);
+			pages[n++] = range->rang_pages[i].page_addr;
+		else if(range->rang_pages[i].page_obj)
+			vm_page_drop(range->rang_pages[i].page_obj);
+		range->rang_pages[i].page_obj = 0;
 	}
+	vm_page_free_batch(range->rang_slice,pages,n);
+	for(i=0;i<4;++i)
+		range->rang_pages_tbm[i] = 0;
 	zfree((void*)range);
 }
 
@@ -141,6 +196,7 @@ restart:
 	
 	next = range->rang_next;
 	vm_range_destroy(range);
+	if(!next) return;
 	range = next;
 	goto restart;
 }
@@ -31,45 +31,51 @@
 #include <kern/zalloc.h>
 #include <string.h>
 
-/* This is the size of a cache line (in x86). */
-#define CACHE_LINE  128
-
-static u_intptr_t z_seg_buf[1<<10] __attribute__ ((aligned (CACHE_LINE)));
+static u_intptr_t z_seg_buf[1<<10] __attribute__ ((aligned (SYSARCH_PAGESIZE)));
 
 static zone_t vm_seg_zone;  /* Zone for user vm_seg structures. */
 static zone_t vm_kseg_zone; /* Zone for kernel vm_seg structures. */
 static zone_t vm_cseg_zone; /* Zone for critical kernel vm_seg structures. */
 
-void vm_seg_init(){
-	vm_seg_zone = zinit(sizeof(struct vm_seg),ZONE_AUTO_REFILL,"user-mode segment zone");
-	vm_kseg_zone = zinit(sizeof(struct vm_seg),ZONE_AUTO_REFILL|ZONE_AR_CRITICAL,"kernel-mode segment zone");
-	vm_cseg_zone = zinit(sizeof(struct vm_seg),0,"critical kernel-mode segment zone");
-	zcram(vm_cseg_zone,(void*)z_seg_buf,sizeof(z_seg_buf));
+/*
+ * Segments are kept constructed in the zones: zeroed, with an initialized lock.
+ */
+static void vm_seg_ctor(void* obj){
+	vm_seg_t seg = obj;
+	memset((void*)seg,0,sizeof(struct vm_seg));
+	kernlock_init(&(seg->seg_lock));
 }
 
-void vm_seg_refill(){
-	vaddr_t begin,size;
-	if( zcount(vm_cseg_zone) < 64 ){
-		size = (vaddr_t)zbufsize(vm_cseg_zone) * 128;
-		if(!vm_alloc_critical(&begin,&size)) return;
-		zcram(vm_cseg_zone,(void*)begin,(size_t)size);
-	}
+/*
+ * Resets the fields, a segment's user may have changed. '_bt_node', 'seg_begin'
+ * and 'seg_end' are set by vm_insert_entry(), and the lock is released on free.
+ */
+static inline vm_seg_t vm_seg_reset(vm_seg_t seg){
+	seg->seg_mem = 0;
+	seg->seg_prot = 0;
+	seg->seg_bstore = 0;
+	seg->seg_bstore_offset = 0;
+	return seg;
+}
+
+void vm_seg_init(){
+	vm_seg_zone = zinit_ctor(sizeof(struct vm_seg),ZONE_AUTO_REFILL,"user-mode segment zone",vm_seg_ctor,0);
+	vm_kseg_zone = zinit_ctor(sizeof(struct vm_seg),ZONE_AUTO_REFILL|ZONE_AR_CRITICAL,"kernel-mode segment zone",vm_seg_ctor,0);
+	vm_cseg_zone = zinit_ctor(sizeof(struct vm_seg),ZONE_AUTO_REFILL|ZONE_AR_CRITICAL|ZONE_NOCACHE,"critical kernel-mode segment zone",vm_seg_ctor,0);
+	zone_set_watermarks(vm_cseg_zone,16,64,192);
+	zcram(vm_cseg_zone,(void*)z_seg_buf,sizeof(z_seg_buf));
 }
 
 vm_seg_t vm_seg_alloc(int kernel){
 	vm_seg_t seg = zalloc(kernel ? vm_kseg_zone : vm_seg_zone);
 	if(!seg) return 0;
-	memset((void*)seg,0,sizeof(struct vm_seg));
-	kernlock_init(&(seg->seg_lock));
-	return seg;
+	return vm_seg_reset(seg);
 }
 
 struct vm_seg *vm_seg_alloc_critical(){
 	vm_seg_t seg = zalloc(vm_cseg_zone);
 	if(!seg) return 0;
-	memset((void*)seg,0,sizeof(struct vm_seg));
-	kernlock_init(&(seg->seg_lock));
-	return seg;
+	return vm_seg_reset(seg);
 }
 
 void vm_seg_initobj(vm_seg_t seg){
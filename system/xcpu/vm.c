@@ -22,29 +22,41 @@
  */
 #include <xcpu/vm.h>
 #include <vm/tlb_cache.h>
+#include <sysarch/hal.h>
+
+/*
+ * The kernel's mappings are shared by all CPUs, so they are shot down on every
+ * one of them. The callers free the physical pages only after this returned.
+ */
 
 /*
  * TLB flush all.
  */
 void xcpu_tlb_flush_all(pmap_t pmap){
-	(void)pmap;
-	mmu_tlb_flush_all();
+	if(pmap == pmap_kernel())
+		hal_tlb_shootdown(0,~((vaddr_t)0));
+	else
+		mmu_tlb_flush_all();
 }
 
 /*
  * Flush a range of page-mappings from the TLB.
  */
 void xcpu_tlb_flush_range(pmap_t pmap, vaddr_t begin, vaddr_t end){
-	(void)pmap;
-	mmu_tlb_flush_range(begin,end);
+	if(pmap == pmap_kernel())
+		hal_tlb_shootdown(begin,end);
+	else
+		mmu_tlb_flush_range(begin,end);
 }
 
 /*
  * Flush a single page-mapping from the TLB.
  */
 void xcpu_tlb_flush_page(pmap_t pmap, vaddr_t pos){
-	(void)pmap;
-	mmu_tlb_flush_page(pos);
+	if(pmap == pmap_kernel())
+		hal_tlb_shootdown(pos,pos);
+	else
+		mmu_tlb_flush_page(pos);
 }
 
 